@@ -1,132 +1,181 @@
 #include "AST.h"
 
-#include <unordered_map>
-
 namespace Parser {
 
 	void PrintSpacing(int depth) {
 		printf("%s", std::string(depth, '\t').c_str());
 	}
 
-	void NumberExpr::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- NumberExpr: %f\n", m_value);
-	}
-
-	void VariableExpr::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- VariableExpr: '%s'\n", m_name.c_str());
-	}
-
-	void BinaryExpr::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- BinaryExpr: op = '%c'\n", m_op);
-		m_rhs->Dump(depth + 1);
-		m_lhs->Dump(depth + 1);
-	}
-
-	void CallExpr::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- CallExpr: %s\n", m_calleeName.c_str());
-		for (const auto &arg : m_args)
-			arg->Dump(depth + 1);
-	}
-
-	void CompoundStmt::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- CompoundStmt:\n");
-		for (const auto &stmt : m_statements)
-			stmt->Dump(depth + 1);
-	}
+	class ASTDumper : public ASTVisitor<ASTDumper> {
+	public:
+		ASTDumper(const ASTContext &context, int depth) : ASTVisitor(context), m_depth(depth) {}
 
-	void AssignStmt::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- AssignStmt:\n");
-		for (const auto &lhs : m_lhs) {
-			lhs->Dump(depth + 1);
+		void VisitNumberExpr(NodeId, const NumberExpr &expr) {
+			PrintSpacing(m_depth);
+			printf("- NumberExpr: %f\n", expr.Value);
 		}
-		m_rhs->Dump(depth + 1);
-	}
 
-	void ReturnStmt::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- ReturnStmt:\n");
-		m_returnExpr->Dump(depth + 1);
-	}
+		void VisitVariableExpr(NodeId, const VariableExpr &expr) {
+			PrintSpacing(m_depth);
+			printf("- VariableExpr: '%s'\n", Symbols::GetName(expr.Name).data());
+		}
 
-	void IfStmt::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- IfStmt: %s\n", m_else ? "has_else" : "");
-		m_condition->Dump(depth + 1);
-		m_body->Dump(depth + 1);
+		void VisitBinaryExpr(NodeId, const BinaryExpr &expr) {
+			PrintSpacing(m_depth);
+			printf("- BinaryExpr: op = '%c'\n", expr.Op);
+			VisitChild(expr.Rhs);
+			VisitChild(expr.Lhs);
+		}
 
-		if (m_else)
-			m_else->Dump(depth + 1);
-	}
+		void VisitCallExpr(NodeId, const CallExpr &expr) {
+			PrintSpacing(m_depth);
+			printf("- CallExpr: %s\n", Symbols::GetName(expr.Callee).data());
+			for (NodeId arg : expr.Args)
+				VisitChild(arg);
+		}
 
-	void ForStmt::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- ForStmt: \n");
-		m_value->Dump(depth + 1);
-		m_condition->Dump(depth + 1);
-		m_step->Dump(depth + 1);
-		m_body->Dump(depth + 1);
-	}
+		void VisitIndexExpr(NodeId, const IndexExpr &expr) {
+			PrintSpacing(m_depth);
+			printf("- IndexExpr: '%s'\n", Symbols::GetName(expr.Array).data());
+			VisitChild(expr.Index);
+		}
 
-	void PrototypeDecl::Dump(int depth) const {
-		PrintSpacing(depth);
-		std::string displayName = m_name.empty() ? "__anonymous__" : m_name;
-		printf("- PrototypeDecl: %s", displayName.c_str());
+		void VisitCompoundStmt(NodeId, const CompoundStmt &stmt) {
+			PrintSpacing(m_depth);
+			printf("- CompoundStmt:\n");
+			for (NodeId child : stmt.Statements)
+				VisitChild(child);
+		}
 
-		printf("(");
-		for (int i = 0; i < m_params.size(); i++) {
-			printf("%s", m_params[i].c_str());
-			if (i < m_params.size() - 1)
-				printf(", ");
+		void VisitAssignStmt(NodeId, const AssignStmt &stmt) {
+			PrintSpacing(m_depth);
+			printf("- AssignStmt:\n");
+			for (NodeId lhs : stmt.Lhs) {
+				VisitChild(lhs);
+			}
+			VisitChild(stmt.Rhs);
 		}
-		printf(")");
 
-		printf("\n");
-	}
+		void VisitReturnStmt(NodeId, const ReturnStmt &stmt) {
+			PrintSpacing(m_depth);
+			printf("- ReturnStmt:\n");
+			VisitChild(stmt.ReturnExpr);
+		}
 
-	void FunctionDecl::Dump(int depth) const {
-		PrintSpacing(depth);
-		printf("- FunctionDecl: \n");
+		void VisitIfStmt(NodeId, const IfStmt &stmt) {
+			PrintSpacing(m_depth);
+			printf("- IfStmt: %s\n", stmt.Else ? "has_else" : "");
+			VisitChild(stmt.Condition);
+			VisitChild(stmt.Body);
 
-		m_prototype->Dump(depth + 1);
-		m_body->Dump(depth + 1);
-	}
+			if (stmt.Else)
+				VisitChild(stmt.Else);
+		}
 
-	void TranslationUnitDecl::Dump() const {
-		printf("TranslationUnitDecl: '%s'\n", m_name.c_str());
-		for (const auto &proto : m_prototypes)
-			proto->Dump(1);
+		void VisitForStmt(NodeId, const ForStmt &stmt) {
+			PrintSpacing(m_depth);
+			printf("- ForStmt: \n");
+			VisitChild(stmt.Value);
+			VisitChild(stmt.Condition);
+			VisitChild(stmt.Step);
+			VisitChild(stmt.Body);
+		}
 
-		for (const auto &func : m_functions)
-			func->Dump(1);
-	}
+		void VisitPrototypeDecl(NodeId, const PrototypeDecl &decl) {
+			PrintSpacing(m_depth);
+			llvm::StringRef displayName = Symbols::GetName(decl.Name);
+			printf("- PrototypeDecl: %s", displayName.empty() ? "__anonymous__" : displayName.data());
+
+			printf("(");
+			for (size_t i = 0; i < decl.Params.size(); i++) {
+				printf("%s%s", Symbols::GetName(decl.Params[i]).data(), decl.IsArrayParam(i) ? "[]" : "");
+				if (i < decl.Params.size() - 1)
+					printf(", ");
+			}
+			printf(")");
+
+			static const char *const modeNames[] = {"", " strict", " contract", " fast"};
+			printf("%s\n", modeNames[size_t(decl.Mode)]);
+		}
 
-	NumberExpr::NumberExpr(double value) : m_value(value) {}
+		void VisitFunctionDecl(NodeId, const FunctionDecl &decl) {
+			PrintSpacing(m_depth);
+			printf("- FunctionDecl: \n");
 
-	VariableExpr::VariableExpr(const std::string &name) : m_name(name) {}
+			VisitChild(decl.Prototype);
+			VisitChild(decl.Body);
+		}
 
-	BinaryExpr::BinaryExpr(char op, ExprPtr lhs, ExprPtr rhs) : m_op(op), m_lhs(std::move(lhs)), m_rhs(std::move(rhs)) {}
+	private:
+		void VisitChild(NodeId child) {
+			m_depth++;
+			Visit(child);
+			m_depth--;
+		}
 
-	CallExpr::CallExpr(const std::string &name, std::vector<ExprPtr> args) : m_calleeName(name), m_args(std::move(args)) {}
+		int m_depth;
+	};
 
-	ReturnStmt::ReturnStmt(ExprPtr returnExpr) : m_returnExpr(std::move(returnExpr)) {}
+	static void RebaseChild(uint32_t &slot, uint32_t offset) {
+		if (NodeId(slot))
+			slot += offset;
+	}
 
-	IfStmt::IfStmt(ExprPtr cond, CompoundStmtPtr body, CompoundStmtPtr elseStmt) : m_condition(std::move(cond)), m_body(std::move(body)), m_else(std::move(elseStmt)) {}
+	uint32_t ASTContext::Append(const ASTContext &other) {
+		uint32_t nodeOffset = uint32_t(m_nodes.size());
+		uint32_t listOffset = uint32_t(m_lists.size());
+		uint32_t symbolListOffset = uint32_t(m_symbolLists.size());
+
+		Grow(m_nodes, other.m_nodes.size(), true);
+		for (Node node : other.m_nodes) {
+			switch (node.Kind) {
+				case NodeKind::NumberExpr:
+				case NodeKind::VariableExpr:
+					break;
+				case NodeKind::CallExpr:
+				case NodeKind::CompoundStmt:
+					node.Slots[0] += listOffset;
+					break;
+				case NodeKind::AssignStmt:
+					node.Slots[0] += listOffset;
+					RebaseChild(node.Slots[2], nodeOffset);
+					break;
+				case NodeKind::PrototypeDecl:
+					node.Slots[0] += symbolListOffset;
+					break;
+				case NodeKind::BinaryExpr:
+				case NodeKind::IndexExpr:
+				case NodeKind::ReturnStmt:
+				case NodeKind::IfStmt:
+				case NodeKind::ForStmt:
+				case NodeKind::FunctionDecl:
+					for (uint32_t &slot : node.Slots)
+						RebaseChild(slot, nodeOffset);
+					break;
+			}
+			m_nodes.push_back(node);
+		}
 
-	ForStmt::ForStmt(const std::string &varName, ExprPtr value, ExprPtr cond, ExprPtr step, CompoundStmtPtr body) : m_loopVarName(varName), m_value(std::move(value)), m_condition(std::move(cond)), m_step(std::move(step)), m_body(std::move(body)) {}
+		Grow(m_lists, other.m_lists.size(), true);
+		for (NodeId id : other.m_lists)
+			m_lists.push_back(NodeId(id.GetIndex() + nodeOffset));
+		Grow(m_symbolLists, other.m_symbolLists.size(), true);
+		m_symbolLists.insert(m_symbolLists.end(), other.m_symbolLists.begin(), other.m_symbolLists.end());
 
-	CompoundStmt::CompoundStmt(std::vector<StmtPtr> stmts) : m_statements(std::move(stmts)) {}
+		return nodeOffset;
+	}
 
-	AssignStmt::AssignStmt(std::vector<VariableExprPtr> lhs, ExprPtr rhs) : m_lhs(std::move(lhs)), m_rhs(std::move(rhs)) {}
+	void TranslationUnitDecl::Dump() const {
+		printf("TranslationUnitDecl: '%s'\n", m_name.c_str());
 
-	PrototypeDecl::PrototypeDecl(std::string name, std::vector<std::string> params) : m_name(name), m_params(params) {}
+		ASTDumper dumper(m_context, 1);
+		for (NodeId proto : m_prototypes)
+			dumper.Visit(proto);
 
-	FunctionDecl::FunctionDecl(PrototypeASTPtr prototype, CompoundStmtPtr body) : m_prototype(std::move(prototype)), m_body(std::move(body)) {}
+		for (NodeId func : m_functions)
+			dumper.Visit(func);
+	}
 
-	TranslationUnitDecl::TranslationUnitDecl(const std::string &name, std::vector<PrototypeASTPtr> protos, std::vector<FunctionDeclPtr> funcs) : m_prototypes(std::move(protos)), m_functions(std::move(funcs)) {}
-}
\ No newline at end of file
+	TranslationUnitDecl::TranslationUnitDecl(const std::string &name, ASTContext context, std::vector<NodeId> protos, std::vector<NodeId> funcs)
+	    : m_name(name), m_context(std::move(context)), m_functions(std::move(funcs)), m_prototypes(std::move(protos)) {}
+}
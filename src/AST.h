@@ -1,216 +1,464 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <initializer_list>
 #include <memory>
 #include <string>
 #include <vector>
 
-#include <llvm/IR/Value.h>
+#include <llvm/ADT/ArrayRef.h>
+
+#include "Symbols.h"
 
 #define ANON_EXPR_NAME "__anon_expr"
 
 namespace Parser {
 
-	class Stmt {
+	// Index of a node in its ASTContext. Behaves like a nullable pointer, so parsers can
+	// return nullptr on errors and test results with 'if (auto id = Parse...())'.
+	class NodeId {
 	public:
-		virtual ~Stmt() = default;
+		NodeId(std::nullptr_t = nullptr) : m_index(s_invalidIndex) {}
+		explicit NodeId(uint32_t index) : m_index(index) {}
+
+		explicit operator bool() const { return m_index != s_invalidIndex; }
+		uint32_t GetIndex() const { return m_index; }
 
-		virtual llvm::Value *GenerateCode() = 0;
-		virtual void Dump(int depth) const = 0;
+		bool operator==(NodeId other) const { return m_index == other.m_index; }
+		bool operator!=(NodeId other) const { return m_index != other.m_index; }
+
+	private:
+		static constexpr uint32_t s_invalidIndex = ~0u;
+		uint32_t m_index;
 	};
-	using StmtPtr = std::unique_ptr<Stmt>;
 
-	class Expr : public Stmt {
-	public:
-		virtual ~Expr() {}
+	enum class NodeKind : uint8_t {
+		NumberExpr,
+		VariableExpr,
+		BinaryExpr,
+		CallExpr,
+		IndexExpr,
+		CompoundStmt,
+		AssignStmt,
+		ReturnStmt,
+		IfStmt,
+		ForStmt,
+		PrototypeDecl,
+		FunctionDecl,
 	};
-	using ExprPtr = std::unique_ptr<Expr>;
+
+	// #### Node views
+	// Fields of each node kind, as passed to ASTContext::Add and returned by ASTContext::Get.
+	// Lists returned by Get point into the context.
 
 	//	<literal>
 	// 		::= <digit> | <digit> <literal>
-	class NumberExpr : public Expr {
-	public:
-		NumberExpr(double value);
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		double m_value;
+	struct NumberExpr {
+		static constexpr NodeKind Kind = NodeKind::NumberExpr;
+		double Value;
 	};
-	using NumberASTPtr = std::unique_ptr<NumberExpr>;
 
 	//  <variable>
 	//		::= <id>
-	class VariableExpr : public Expr {
-	public:
-		VariableExpr(const std::string &name);
-
-		std::string GetName() const { return m_name; }
-
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		std::string m_name;
+	struct VariableExpr {
+		static constexpr NodeKind Kind = NodeKind::VariableExpr;
+		Symbols::Symbol Name;
 	};
-	using VariableExprPtr = std::unique_ptr<VariableExpr>;
 
 	// 	<binary_expr>
 	//		::= <number> [<operator> <binary_expr>]
-	class BinaryExpr : public Expr {
-	public:
-		BinaryExpr(char op, ExprPtr lhs, ExprPtr rhs);
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		char m_op;
-		ExprPtr m_lhs, m_rhs;
+	struct BinaryExpr {
+		static constexpr NodeKind Kind = NodeKind::BinaryExpr;
+		char Op;
+		NodeId Lhs, Rhs;
 	};
 
 	//  <function_call>
 	//		::= <identifier>(<args>)
-	class CallExpr : public Expr {
-	public:
-		CallExpr(const std::string &name, std::vector<ExprPtr> args);
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
+	struct CallExpr {
+		static constexpr NodeKind Kind = NodeKind::CallExpr;
+		Symbols::Symbol Callee;
+		llvm::ArrayRef<NodeId> Args;
+	};
 
-	private:
-		std::string m_calleeName;
-		std::vector<ExprPtr> m_args;
+	//  <index_expr>
+	//		::= <identifier>[<expr>]
+	struct IndexExpr {
+		static constexpr NodeKind Kind = NodeKind::IndexExpr;
+		Symbols::Symbol Array;
+		NodeId Index;
 	};
 
 	// <stmts>
 	//		::= <stmt> [<stmts>]
-	class CompoundStmt : public Stmt {
-	public:
-		CompoundStmt(std::vector<StmtPtr> stmts);
-
-		void AddStmt(StmtPtr stmt) { m_statements.push_back(std::move(stmt)); }
-
-		// Overrides begin/end operators so statements can be iterated by a for-range loop
-		std::vector<StmtPtr>::iterator begin() { return m_statements.begin(); }
-		std::vector<StmtPtr>::iterator end() { return m_statements.end(); }
-
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		std::vector<StmtPtr> m_statements;
+	// Functions that fall off the end of a block return the value of its last statement that
+	// has one, see HasBlockValue, or 0
+	struct CompoundStmt {
+		static constexpr NodeKind Kind = NodeKind::CompoundStmt;
+		llvm::ArrayRef<NodeId> Statements;
 	};
-	using CompoundStmtPtr = std::unique_ptr<CompoundStmt>;
 
+	// Expressions, and assignments with the value they assign. Branches and loops end their
+	// block, and the code after them starts a new one
+	inline bool HasBlockValue(NodeKind kind) {
+		return kind == NodeKind::NumberExpr || kind == NodeKind::VariableExpr || kind == NodeKind::BinaryExpr ||
+		       kind == NodeKind::CallExpr || kind == NodeKind::IndexExpr || kind == NodeKind::AssignStmt;
+	}
 
 	// <assign_stmt>
-	//		::= <variable> = [{ <variable> = }] <expr>
-	class AssignStmt : public Stmt {
-	public:
-		AssignStmt(std::vector<VariableExprPtr> lhs, ExprPtr rhs);
-
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		std::vector<VariableExprPtr> m_lhs;
-		ExprPtr m_rhs;
+	//		::= <lvalue> = [{ <lvalue> = }] <expr>
+	//	<lvalue>
+	//		::= <variable> | <index_expr>
+	struct AssignStmt {
+		static constexpr NodeKind Kind = NodeKind::AssignStmt;
+		llvm::ArrayRef<NodeId> Lhs; // VariableExpr or IndexExpr nodes
+		NodeId Rhs;
 	};
-	using AssignStmtPtr = std::unique_ptr<AssignStmt>;
 
 	// <return>
 	//		::= 'return' <expr>
-	class ReturnStmt : public Stmt {
-	public:
-		ReturnStmt(ExprPtr returnExpr);
-
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		ExprPtr m_returnExpr;
+	struct ReturnStmt {
+		static constexpr NodeKind Kind = NodeKind::ReturnStmt;
+		NodeId ReturnExpr;
 	};
-	using ReturnStmtPtr = std::unique_ptr<ReturnStmt>;
 
 	//  <if>
 	//		::= 'if' (<cond>) <expr> ['else if' <expr>] ['else' <expr>]
-	class IfStmt : public Stmt {
-	public:
-		IfStmt(ExprPtr cond, CompoundStmtPtr body, CompoundStmtPtr elseStmt=nullptr);
-
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-		// Generates code for sequential else if/else statements
-		llvm::Value *GenerateCodeSequence(llvm::BasicBlock* exit);
-
-
-		inline void SetElse(StmtPtr elseStmt) { m_else = std::move(elseStmt); } 
-
-	private:
-		ExprPtr m_condition;
-		CompoundStmtPtr m_body;
-		StmtPtr m_else; // 'else if' is just a special case of 'else'
+	struct IfStmt {
+		static constexpr NodeKind Kind = NodeKind::IfStmt;
+		NodeId Condition;
+		NodeId Body;
+		NodeId Else; // 'else if' is just an IfStmt in place of the else CompoundStmt. Optional
 	};
-	using IfStmtPtr = std::unique_ptr<IfStmt>;
 
 	//  <for>
 	//		::= for(<expr>;<cond>;<number>) <stmts>
-	class ForStmt : public Stmt {
-	public:
-		ForStmt(const std::string& loopVarName, ExprPtr value, ExprPtr cond, ExprPtr step, CompoundStmtPtr body);
-
-		virtual llvm::Value *GenerateCode() override;
-		virtual void Dump(int depth) const override;
-
-	private:
-		std::string m_loopVarName;
-		ExprPtr m_value, m_condition, m_step;
-		CompoundStmtPtr m_body;
+	struct ForStmt {
+		static constexpr NodeKind Kind = NodeKind::ForStmt;
+		Symbols::Symbol LoopVarName;
+		NodeId Value, Condition, Step;
+		NodeId Body;
 	};
-	using ForStmtPtr = std::unique_ptr<ForStmt>;
 
+	// Floating-point semantics of the code of a function
+	enum class FPMode : uint8_t {
+		Default,  // The one of the session
+		Strict,	  // IEEE arithmetic, every operation rounded on its own
+		Contract, // Multiplies and adds may be fused into FMAs
+		Fast,	  // Also reassociates and assumes no NaNs, infinities or signed zeros, so reductions vectorize
+	};
 
 	// prototypes
-	//		::= fn <id>(<args>)
-	class PrototypeDecl {
-	public:
-		PrototypeDecl(std::string name, std::vector<std::string> params);
-
-		inline std::string GetName() const { return m_name; }
-
-		llvm::Function *GenerateCode();
-		void Dump(int depth) const;
-
-	private:
-		std::string m_name;
-		std::vector<std::string> m_params;
+	//		::= fn <id>(<args>) [<mode>]
+	//	<args>
+	//		::= <id> | <id>[] [, <args>]
+	//	<mode>
+	//		::= strict | contract | fast
+	struct PrototypeDecl {
+		static constexpr NodeKind Kind = NodeKind::PrototypeDecl;
+		Symbols::Symbol Name;
+		llvm::ArrayRef<Symbols::Symbol> Params;
+		uint32_t ArrayParams = 0; // Bit i is set when parameter i is a double[] array
+		FPMode Mode = FPMode::Default; // Only definitions have a mode of their own
+
+		bool IsArrayParam(size_t i) const { return i < 32 && (ArrayParams >> i) & 1; }
 	};
-	using PrototypeASTPtr = std::unique_ptr<PrototypeDecl>;
 
 	// declarations
 	//		::= <prototype> <stmts>
-	class FunctionDecl {
-	public:
-		FunctionDecl(PrototypeASTPtr prototype, CompoundStmtPtr body);
+	struct FunctionDecl {
+		static constexpr NodeKind Kind = NodeKind::FunctionDecl;
+		NodeId Prototype;
+		NodeId Body;
+	};
 
-		llvm::Function *GenerateCode();
-		void Dump(int depth) const;
+	// #### Node pool
+	// Every node is stored with the same 24-byte layout: a kind tag, a symbol and either a
+	// number or up to four child slots. Lists of children are stored contiguously in a
+	// separate array and referenced by (begin, size) slots.
+	struct Node {
+		NodeKind Kind;
+		char Op;
+		Symbols::Symbol Name;
+		union {
+			double Value;
+			uint32_t Slots[4];
+		};
+	};
+	static_assert(sizeof(Node) == 24, "AST nodes should stay compact");
+
+	// Owns every node and child list of a translation unit. Nodes are only ever appended,
+	// and the parser creates children before their parents, so a child always has a
+	// smaller index than its parent: walking the pool in order visits nodes bottom-up.
+	class ASTContext {
+	public:
+		void Reserve(size_t nodeCount) { Grow(m_nodes, nodeCount - std::min(nodeCount, m_nodes.size()), true); }
+
+		NodeId Add(const NumberExpr &expr) {
+			Node node = MakeNode(NodeKind::NumberExpr);
+			node.Value = expr.Value;
+			return Push(node);
+		}
+
+		NodeId Add(const VariableExpr &expr) {
+			Node node = MakeNode(NodeKind::VariableExpr);
+			node.Name = expr.Name;
+			return Push(node);
+		}
+
+		NodeId Add(const BinaryExpr &expr) {
+			Node node = MakeNode(NodeKind::BinaryExpr);
+			node.Op = expr.Op;
+			SetChildren(node, {expr.Lhs, expr.Rhs});
+			return Push(node);
+		}
+
+		NodeId Add(const CallExpr &expr) {
+			Node node = MakeNode(NodeKind::CallExpr);
+			node.Name = expr.Callee;
+			SetList(node, m_lists, expr.Args);
+			return Push(node);
+		}
+
+		NodeId Add(const IndexExpr &expr) {
+			Node node = MakeNode(NodeKind::IndexExpr);
+			node.Name = expr.Array;
+			SetChildren(node, {expr.Index});
+			return Push(node);
+		}
+
+		NodeId Add(const CompoundStmt &stmt) {
+			Node node = MakeNode(NodeKind::CompoundStmt);
+			SetList(node, m_lists, stmt.Statements);
+			return Push(node);
+		}
+
+		NodeId Add(const AssignStmt &stmt) {
+			Node node = MakeNode(NodeKind::AssignStmt);
+			SetList(node, m_lists, stmt.Lhs);
+			node.Slots[2] = stmt.Rhs.GetIndex();
+			return Push(node);
+		}
+
+		NodeId Add(const ReturnStmt &stmt) {
+			Node node = MakeNode(NodeKind::ReturnStmt);
+			SetChildren(node, {stmt.ReturnExpr});
+			return Push(node);
+		}
+
+		NodeId Add(const IfStmt &stmt) {
+			Node node = MakeNode(NodeKind::IfStmt);
+			SetChildren(node, {stmt.Condition, stmt.Body, stmt.Else});
+			return Push(node);
+		}
+
+		NodeId Add(const ForStmt &stmt) {
+			Node node = MakeNode(NodeKind::ForStmt);
+			node.Name = stmt.LoopVarName;
+			SetChildren(node, {stmt.Value, stmt.Condition, stmt.Step, stmt.Body});
+			return Push(node);
+		}
+
+		NodeId Add(const PrototypeDecl &decl) {
+			Node node = MakeNode(NodeKind::PrototypeDecl);
+			node.Name = decl.Name;
+			SetList(node, m_symbolLists, decl.Params);
+			node.Slots[2] = decl.ArrayParams;
+			node.Slots[3] = uint32_t(decl.Mode);
+			return Push(node);
+		}
+
+		NodeId Add(const FunctionDecl &decl) {
+			Node node = MakeNode(NodeKind::FunctionDecl);
+			SetChildren(node, {decl.Prototype, decl.Body});
+			return Push(node);
+		}
+
+		NodeKind GetKind(NodeId id) const { return GetNode(id).Kind; }
+		const Node &GetNode(NodeId id) const {
+			assert(id && id.GetIndex() < m_nodes.size() && "Invalid node id");
+			return m_nodes[id.GetIndex()];
+		}
+
+		// Decodes a node of kind T::Kind
+		template <typename T>
+		T Get(NodeId id) const {
+			const Node &node = GetNode(id);
+			assert(node.Kind == T::Kind && "Unexpected node kind");
+			T view;
+			Decode(node, view);
+			return view;
+		}
+
+		size_t GetNodeCount() const { return m_nodes.size(); }
+
+		// Appends all nodes of another context, keeping their order. Returns the offset
+		// added to the indices of the appended nodes.
+		uint32_t Append(const ASTContext &other);
+
+		struct Stats {
+			size_t Nodes;
+			size_t ListEntries;
+			size_t BytesUsed;		// Taken by nodes and lists
+			size_t BytesReserved;	// Reserved by the pool
+			size_t Allocations;		// Buffers taken by the node and list arrays as they grew
+		};
+
+		Stats GetStats() const {
+			size_t listEntries = m_lists.size() + m_symbolLists.size();
+			size_t bytesUsed = m_nodes.size() * sizeof(Node) + m_lists.size() * sizeof(NodeId) + m_symbolLists.size() * sizeof(Symbols::Symbol);
+			size_t bytesReserved = m_nodes.capacity() * sizeof(Node) + m_lists.capacity() * sizeof(NodeId) + m_symbolLists.capacity() * sizeof(Symbols::Symbol);
+			return {m_nodes.size(), listEntries, bytesUsed, bytesReserved, m_allocations};
+		}
 
 	private:
-		PrototypeASTPtr m_prototype;
-		CompoundStmtPtr m_body;
+		static Node MakeNode(NodeKind kind) {
+			Node node;
+			node.Kind = kind;
+			node.Op = 0;
+			node.Name = Symbols::InvalidSymbol;
+			node.Slots[0] = node.Slots[1] = node.Slots[2] = node.Slots[3] = NodeId().GetIndex();
+			return node;
+		}
+
+		static void SetChildren(Node &node, std::initializer_list<NodeId> children) {
+			unsigned slot = 0;
+			for (NodeId child : children)
+				node.Slots[slot++] = child.GetIndex();
+		}
+
+		// Makes room for count more items, counting each buffer an array takes. Grows
+		// geometrically like push_back, unless the final size is known
+		template <typename T>
+		void Grow(std::vector<T> &storage, size_t count, bool exact = false) {
+			size_t size = storage.size() + count;
+			if (size <= storage.capacity())
+				return;
+			storage.reserve(exact ? size : std::max(size, 2 * storage.capacity()));
+			m_allocations++;
+		}
+
+		// Lists take the first two slots
+		template <typename T>
+		void SetList(Node &node, std::vector<T> &storage, llvm::ArrayRef<T> items) {
+			Grow(storage, items.size());
+			node.Slots[0] = uint32_t(storage.size());
+			node.Slots[1] = uint32_t(items.size());
+			storage.insert(storage.end(), items.begin(), items.end());
+		}
+
+		template <typename T>
+		static llvm::ArrayRef<T> GetList(const Node &node, const std::vector<T> &storage) {
+			return llvm::ArrayRef<T>(storage.data() + node.Slots[0], node.Slots[1]);
+		}
+
+		static NodeId GetChild(const Node &node, unsigned slot) { return NodeId(node.Slots[slot]); }
+
+		NodeId Push(const Node &node) {
+			Grow(m_nodes, 1);
+			m_nodes.push_back(node);
+			return NodeId(uint32_t(m_nodes.size() - 1));
+		}
+
+		void Decode(const Node &node, NumberExpr &view) const { view.Value = node.Value; }
+		void Decode(const Node &node, VariableExpr &view) const { view.Name = node.Name; }
+		void Decode(const Node &node, BinaryExpr &view) const { view = {node.Op, GetChild(node, 0), GetChild(node, 1)}; }
+		void Decode(const Node &node, CallExpr &view) const { view = {node.Name, GetList(node, m_lists)}; }
+		void Decode(const Node &node, IndexExpr &view) const { view = {node.Name, GetChild(node, 0)}; }
+		void Decode(const Node &node, CompoundStmt &view) const { view = {GetList(node, m_lists)}; }
+		void Decode(const Node &node, AssignStmt &view) const { view = {GetList(node, m_lists), GetChild(node, 2)}; }
+		void Decode(const Node &node, ReturnStmt &view) const { view = {GetChild(node, 0)}; }
+		void Decode(const Node &node, IfStmt &view) const { view = {GetChild(node, 0), GetChild(node, 1), GetChild(node, 2)}; }
+		void Decode(const Node &node, ForStmt &view) const {
+			view = {node.Name, GetChild(node, 0), GetChild(node, 1), GetChild(node, 2), GetChild(node, 3)};
+		}
+		void Decode(const Node &node, PrototypeDecl &view) const { view = {node.Name, GetList(node, m_symbolLists), node.Slots[2], FPMode(node.Slots[3])}; }
+		void Decode(const Node &node, FunctionDecl &view) const { view = {GetChild(node, 0), GetChild(node, 1)}; }
+
+		std::vector<Node> m_nodes;
+		std::vector<NodeId> m_lists;
+		std::vector<Symbols::Symbol> m_symbolLists;
+		size_t m_allocations = 0;
+	};
+
+	// #### Visitor
+	// Dispatches on the kind of a node and calls Derived::Visit<Kind>(id, view), similar to
+	// llvm::InstVisitor. Kinds that Derived doesn't handle return a default RetTy.
+	template <typename Derived, typename RetTy = void>
+	class ASTVisitor {
+	public:
+		explicit ASTVisitor(const ASTContext &context) : m_context(context) {}
+
+		RetTy Visit(NodeId id) {
+			Derived &derived = static_cast<Derived &>(*this);
+			switch (m_context.GetKind(id)) {
+				case NodeKind::NumberExpr:
+					return derived.VisitNumberExpr(id, m_context.Get<NumberExpr>(id));
+				case NodeKind::VariableExpr:
+					return derived.VisitVariableExpr(id, m_context.Get<VariableExpr>(id));
+				case NodeKind::BinaryExpr:
+					return derived.VisitBinaryExpr(id, m_context.Get<BinaryExpr>(id));
+				case NodeKind::CallExpr:
+					return derived.VisitCallExpr(id, m_context.Get<CallExpr>(id));
+				case NodeKind::IndexExpr:
+					return derived.VisitIndexExpr(id, m_context.Get<IndexExpr>(id));
+				case NodeKind::CompoundStmt:
+					return derived.VisitCompoundStmt(id, m_context.Get<CompoundStmt>(id));
+				case NodeKind::AssignStmt:
+					return derived.VisitAssignStmt(id, m_context.Get<AssignStmt>(id));
+				case NodeKind::ReturnStmt:
+					return derived.VisitReturnStmt(id, m_context.Get<ReturnStmt>(id));
+				case NodeKind::IfStmt:
+					return derived.VisitIfStmt(id, m_context.Get<IfStmt>(id));
+				case NodeKind::ForStmt:
+					return derived.VisitForStmt(id, m_context.Get<ForStmt>(id));
+				case NodeKind::PrototypeDecl:
+					return derived.VisitPrototypeDecl(id, m_context.Get<PrototypeDecl>(id));
+				case NodeKind::FunctionDecl:
+					return derived.VisitFunctionDecl(id, m_context.Get<FunctionDecl>(id));
+			}
+			return RetTy();
+		}
+
+		// Visits every node of the context in index order, so children before parents
+		void VisitAll() {
+			for (uint32_t index = 0; index < m_context.GetNodeCount(); index++)
+				Visit(NodeId(index));
+		}
+
+		RetTy VisitNumberExpr(NodeId, const NumberExpr &) { return RetTy(); }
+		RetTy VisitVariableExpr(NodeId, const VariableExpr &) { return RetTy(); }
+		RetTy VisitBinaryExpr(NodeId, const BinaryExpr &) { return RetTy(); }
+		RetTy VisitCallExpr(NodeId, const CallExpr &) { return RetTy(); }
+		RetTy VisitIndexExpr(NodeId, const IndexExpr &) { return RetTy(); }
+		RetTy VisitCompoundStmt(NodeId, const CompoundStmt &) { return RetTy(); }
+		RetTy VisitAssignStmt(NodeId, const AssignStmt &) { return RetTy(); }
+		RetTy VisitReturnStmt(NodeId, const ReturnStmt &) { return RetTy(); }
+		RetTy VisitIfStmt(NodeId, const IfStmt &) { return RetTy(); }
+		RetTy VisitForStmt(NodeId, const ForStmt &) { return RetTy(); }
+		RetTy VisitPrototypeDecl(NodeId, const PrototypeDecl &) { return RetTy(); }
+		RetTy VisitFunctionDecl(NodeId, const FunctionDecl &) { return RetTy(); }
+
+	protected:
+		const ASTContext &m_context;
 	};
-	using FunctionDeclPtr = std::unique_ptr<FunctionDecl>;
 
 	class TranslationUnitDecl {
 	public:
-		TranslationUnitDecl(const std::string &name, std::vector<PrototypeASTPtr> protos, std::vector<FunctionDeclPtr> funcs);
-		void GenerateCode();
+		TranslationUnitDecl(const std::string &name, ASTContext context, std::vector<NodeId> protos, std::vector<NodeId> funcs);
 		void Dump() const;
 
+		const ASTContext &GetContext() const { return m_context; }
+		llvm::ArrayRef<NodeId> GetPrototypes() const { return m_prototypes; }
+		llvm::ArrayRef<NodeId> GetFunctions() const { return m_functions; }
+
 	private:
 		std::string m_name;
-		std::vector<FunctionDeclPtr> m_functions;
-		std::vector<PrototypeASTPtr> m_prototypes;
+		ASTContext m_context; // Owns all nodes below
+		std::vector<NodeId> m_functions;
+		std::vector<NodeId> m_prototypes;
 	};
 	using TranslationUnitASTPtr = std::unique_ptr<TranslationUnitDecl>;
-}
\ No newline at end of file
+}
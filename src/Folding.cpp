@@ -0,0 +1,525 @@
+#include "Folding.h"
+
+#include <cmath>
+
+#include <llvm/Support/MathExtras.h>
+
+namespace Folding {
+
+	using namespace Parser;
+	using Types::ValueType;
+
+	// Steps a single evaluation may take, about one per node visited. Beyond that, running the
+	// compiled code is cheaper than interpreting it
+	static constexpr uint64_t s_stepBudget = 1 << 18;
+	// Nested calls an evaluation may make, bounded by the stack of the compiler
+	static constexpr unsigned s_maxCallDepth = 256;
+
+	static Constant MakeInteger(ValueType type, int64_t value) {
+		Constant constant;
+		constant.Type = type;
+		constant.Integer = value;
+		return constant;
+	}
+
+	static Constant MakeDouble(double value) {
+		Constant constant;
+		constant.Real = value;
+		return constant;
+	}
+
+	// Same conversions as generated code. Fails where it would produce poison
+	static bool Convert(Constant &value, ValueType type) {
+		if (value.Type == type)
+			return true;
+
+		switch (type) {
+			case ValueType::Bool:
+				// Unordered comparison, so NaN is true
+				value.Integer = value.Type == ValueType::Double ? value.Real != 0.0 : value.Integer != 0;
+				break;
+			case ValueType::Integer:
+				if (value.Type == ValueType::Double) {
+					if (!(value.Real >= -0x1p63 && value.Real < 0x1p63))
+						return false;
+					value.Integer = int64_t(value.Real);
+				}
+				break;
+			default:
+				value.Real = double(value.Integer);
+				break;
+		}
+
+		value.Type = type;
+		return true;
+	}
+
+	// Type of the storage of variables of a type, as generated code allocates it
+	static ValueType GetStorageType(ValueType type) {
+		return type == ValueType::Bool || type == ValueType::Integer ? type : ValueType::Double;
+	}
+
+	static bool Arithmetic(char op, Constant lhs, Constant rhs, Constant &result) {
+		ValueType type = Types::GetBinaryType(op, lhs.Type, rhs.Type);
+		if (!Convert(lhs, type) || !Convert(rhs, type))
+			return false;
+
+		switch (op) {
+			case '+': result = MakeDouble(lhs.Real + rhs.Real); return true;
+			case '-': result = MakeDouble(lhs.Real - rhs.Real); return true;
+			case '*': result = MakeDouble(lhs.Real * rhs.Real); return true;
+			case '/': result = MakeDouble(lhs.Real / rhs.Real); return true;
+			default: return false;
+		}
+	}
+
+	// Doubles compare unordered, and integers compare with the bound of doubles, see
+	// Types::GetIntegerBound
+	static bool Compare(char op, Constant lhs, Constant rhs, Constant &result) {
+		bool lhsDouble = lhs.Type == ValueType::Double, rhsDouble = rhs.Type == ValueType::Double;
+		if (lhsDouble && rhsDouble) {
+			bool value = op == '<' ? !(lhs.Real >= rhs.Real) : !(lhs.Real <= rhs.Real);
+			result = MakeInteger(ValueType::Bool, value);
+			return true;
+		}
+
+		bool less = op == '<';
+		if (lhsDouble) {
+			std::swap(lhs, rhs);
+			less = !less;
+		}
+
+		Convert(lhs, ValueType::Integer);
+		int64_t bound;
+		if (rhsDouble) {
+			bound = Types::GetIntegerBound(rhs.Real, less);
+		} else {
+			Convert(rhs, ValueType::Integer);
+			bound = rhs.Integer;
+		}
+
+		result = MakeInteger(ValueType::Bool, less ? lhs.Integer < bound : lhs.Integer > bound);
+		return true;
+	}
+
+	// Functions that fall off the end of a block return the value of its last statement that has
+	// one, so the interpreter keeps track of blocks the way code generation creates them: every
+	// branch of an if, the code after it, each iteration of a loop and the code after it start a
+	// block of their own.
+	// Visits return false when the code can't be evaluated. Expressions leave their value in
+	// m_value, and statements stop once the function returned.
+	class Interpreter : public ASTVisitor<Interpreter, bool> {
+	public:
+		Interpreter(Evaluator &evaluator) : ASTVisitor(evaluator.m_nodes), m_evaluator(evaluator) {}
+
+		// Value a function returns for arguments known at compile time
+		llvm::Optional<double> Evaluate(NodeId functionDecl, llvm::ArrayRef<Constant> args) {
+			double result;
+			if (!Call(functionDecl, args, result))
+				return llvm::None;
+			return result;
+		}
+
+		llvm::Optional<double> Run(NodeId functionDecl) {
+			if (m_context.GetKind(functionDecl) != NodeKind::FunctionDecl)
+				return llvm::None;
+
+			double result;
+			if (!Call(functionDecl, {}, result))
+				return llvm::None;
+			return result;
+		}
+
+		llvm::ArrayRef<Symbols::Symbol> GetCalledFunctions() const { return m_calledFunctions.getArrayRef(); }
+
+		bool VisitNumberExpr(NodeId, const NumberExpr &expr) {
+			ValueType type = Types::GetLiteralType(expr.Value);
+			m_value = type == ValueType::Integer ? MakeInteger(type, int64_t(expr.Value)) : MakeDouble(expr.Value);
+			return Step();
+		}
+
+		bool VisitVariableExpr(NodeId, const VariableExpr &expr) {
+			auto variable = m_frame->Variables.find(expr.Name);
+			if (variable == m_frame->Variables.end())
+				return false;
+
+			m_value = variable->second;
+			return Step();
+		}
+
+		bool VisitBinaryExpr(NodeId, const BinaryExpr &expr) {
+			if (!Step() || !Visit(expr.Lhs))
+				return false;
+			Constant lhs = m_value;
+			if (!Visit(expr.Rhs))
+				return false;
+			Constant rhs = m_value;
+
+			return expr.Op == '<' || expr.Op == '>' ? Compare(expr.Op, lhs, rhs, m_value) : Arithmetic(expr.Op, lhs, rhs, m_value);
+		}
+
+		// Only calls to definitions parsed in this run. Externs, builtins and arrays have
+		// effects or inputs the compiler doesn't know
+		bool VisitCallExpr(NodeId, const CallExpr &expr) {
+			if (!Step())
+				return false;
+
+			auto function = m_evaluator.m_functions.find(expr.Callee);
+			if (function == m_evaluator.m_functions.end())
+				return false;
+
+			std::vector<Constant> args;
+			for (NodeId arg : expr.Args) {
+				if (!Visit(arg))
+					return false;
+				args.push_back(m_value);
+			}
+
+			double result;
+			if (!Call(function->second, args, result))
+				return false;
+
+			m_calledFunctions.insert(expr.Callee);
+			m_value = MakeDouble(result);
+			return true;
+		}
+
+		bool VisitCompoundStmt(NodeId, const CompoundStmt &stmt) {
+			if (stmt.Statements.empty())
+				return false;
+
+			for (NodeId child : stmt.Statements) {
+				if (!Visit(child))
+					return false;
+				if (m_frame->Returned)
+					break;
+				if (HasBlockValue(m_context.GetKind(child)))
+					m_frame->LastValue = m_value.ToDouble();
+			}
+			return true;
+		}
+
+		bool VisitAssignStmt(NodeId, const AssignStmt &stmt) {
+			if (!Step() || !Visit(stmt.Rhs))
+				return false;
+
+			for (NodeId lhs : stmt.Lhs) {
+				if (m_context.GetKind(lhs) != NodeKind::VariableExpr)
+					return false;
+
+				// Variables keep the type they were created with
+				Symbols::Symbol name = m_context.Get<VariableExpr>(lhs).Name;
+				auto variable = m_frame->Variables.find(name);
+				ValueType type = variable != m_frame->Variables.end() ? variable->second.Type : GetVariableType(name);
+				Constant value = m_value;
+				if (!Convert(value, type))
+					return false;
+				m_frame->Variables[name] = value;
+			}
+			return true;
+		}
+
+		bool VisitReturnStmt(NodeId, const ReturnStmt &stmt) {
+			if (!Step() || !Visit(stmt.ReturnExpr))
+				return false;
+
+			Constant value = m_value;
+			Convert(value, ValueType::Double);
+			m_frame->Returned = true;
+			m_frame->ReturnValue = value.Real;
+			return true;
+		}
+
+		// Branches that don't return fall off the end of the function
+		bool VisitIfStmt(NodeId, const IfStmt &stmt) {
+			if (!Step() || !Visit(stmt.Condition))
+				return false;
+
+			Constant condition = m_value;
+			Convert(condition, ValueType::Bool);
+			StartBlock();
+			if (condition.Integer) {
+				if (!Visit(stmt.Body))
+					return false;
+				FallOff();
+				return true;
+			}
+
+			if (!stmt.Else)
+				return true;
+			// Following else ifs are part of the same sequence, but blocks only matter to the interpreter
+			if (m_context.GetKind(stmt.Else) == NodeKind::IfStmt)
+				return Visit(stmt.Else);
+			if (!Visit(stmt.Else))
+				return false;
+			FallOff();
+			return true;
+		}
+
+		// The body runs before the condition is checked, as in generated code
+		bool VisitForStmt(NodeId, const ForStmt &stmt) {
+			if (!Step() || !Visit(stmt.Value))
+				return false;
+
+			ValueType type = GetVariableType(stmt.LoopVarName);
+			Constant start = m_value;
+			if (!Convert(start, type))
+				return false;
+			m_frame->Variables[stmt.LoopVarName] = start;
+
+			while (true) {
+				StartBlock();
+				if (!Visit(stmt.Body))
+					return false;
+				if (m_frame->Returned)
+					return true;
+
+				if (!Visit(stmt.Step))
+					return false;
+				Constant step = m_value;
+
+				auto variable = m_frame->Variables.find(stmt.LoopVarName);
+				if (variable == m_frame->Variables.end())
+					return false;
+				// Integer loop variables are bounded, so stepping them doesn't overflow in generated
+				// code. The compiler checks anyway
+				Constant next;
+				if (variable->second.Type == ValueType::Integer) {
+					int64_t sum;
+					if (!Convert(step, ValueType::Integer) || llvm::AddOverflow(variable->second.Integer, step.Integer, sum))
+						return false;
+					next = MakeInteger(ValueType::Integer, sum);
+				} else if (!Arithmetic('+', variable->second, step, next) || !Convert(next, variable->second.Type)) {
+					return false;
+				}
+				variable->second = next;
+
+				if (!Visit(stmt.Condition))
+					return false;
+				Constant condition = m_value;
+				Convert(condition, ValueType::Bool);
+				if (!condition.Integer)
+					break;
+			}
+
+			StartBlock();
+			m_frame->Variables.erase(stmt.LoopVarName);
+			return true;
+		}
+
+	private:
+		struct Frame {
+			llvm::DenseMap<Symbols::Symbol, Constant> Variables;
+			const Types::VariableTypes *Types = nullptr;
+			llvm::Optional<double> LastValue; // Of the current block
+			bool Returned = false;
+			double ReturnValue = 0;
+		};
+
+		bool Call(NodeId functionDecl, llvm::ArrayRef<Constant> args, double &result) {
+			FunctionDecl decl = m_context.Get<FunctionDecl>(functionDecl);
+			PrototypeDecl prototype = m_context.Get<PrototypeDecl>(decl.Prototype);
+			if (prototype.ArrayParams || prototype.Params.size() != args.size() || m_depth >= s_maxCallDepth)
+				return false;
+
+			auto types = m_evaluator.m_variableTypes.find(functionDecl.GetIndex());
+			if (types == m_evaluator.m_variableTypes.end())
+				types = m_evaluator.m_variableTypes.emplace(functionDecl.GetIndex(), Types::InferVariableTypes(m_context, functionDecl)).first;
+
+			// Arguments are passed as doubles
+			Frame frame;
+			frame.Types = &types->second;
+			for (size_t i = 0; i < args.size(); i++) {
+				Constant arg = args[i];
+				Convert(arg, ValueType::Double);
+				frame.Variables[prototype.Params[i]] = arg;
+			}
+
+			Frame *caller = m_frame;
+			m_frame = &frame;
+			m_depth++;
+			bool success = Visit(decl.Body);
+			m_depth--;
+			m_frame = caller;
+			if (!success)
+				return false;
+
+			result = frame.Returned ? frame.ReturnValue : frame.LastValue.getValueOr(0.0);
+			return true;
+		}
+
+		ValueType GetVariableType(Symbols::Symbol name) const {
+			return GetStorageType(m_frame->Types ? m_frame->Types->lookup(name) : ValueType::Unknown);
+		}
+
+		void StartBlock() {
+			m_frame->LastValue = llvm::None;
+		}
+
+		void FallOff() {
+			if (m_frame->Returned)
+				return;
+			m_frame->Returned = true;
+			m_frame->ReturnValue = m_frame->LastValue.getValueOr(0.0);
+		}
+
+		bool Step() {
+			return ++m_steps <= s_stepBudget;
+		}
+
+		Evaluator &m_evaluator;
+		Frame *m_frame = nullptr;
+		Constant m_value;
+		uint64_t m_steps = 0;
+		unsigned m_depth = 0;
+		llvm::SetVector<Symbols::Symbol> m_calledFunctions;
+	};
+
+	// Visits every node of a function once, children before their parents. Expressions return
+	// whether they folded, with their value recorded in the evaluator, so their parents fold from
+	// those values without visiting them again. Only calls run the interpreter, on the body of the
+	// function they call
+	class ConstantFolder : public ASTVisitor<ConstantFolder, bool> {
+	public:
+		ConstantFolder(Evaluator &evaluator) : ASTVisitor(evaluator.m_nodes), m_evaluator(evaluator) {}
+
+		bool VisitNumberExpr(NodeId id, const NumberExpr &expr) {
+			ValueType type = Types::GetLiteralType(expr.Value);
+			return Record(id, type == ValueType::Integer ? MakeInteger(type, int64_t(expr.Value)) : MakeDouble(expr.Value));
+		}
+
+		bool VisitBinaryExpr(NodeId id, const BinaryExpr &expr) {
+			bool lhsFolded = Visit(expr.Lhs);
+			bool rhsFolded = Visit(expr.Rhs);
+			if (!lhsFolded || !rhsFolded)
+				return false;
+
+			Constant lhs = m_evaluator.m_folded[expr.Lhs.GetIndex()], rhs = m_evaluator.m_folded[expr.Rhs.GetIndex()], result;
+			bool success = expr.Op == '<' || expr.Op == '>' ? Compare(expr.Op, lhs, rhs, result) : Arithmetic(expr.Op, lhs, rhs, result);
+			return success && Record(id, result);
+		}
+
+		// Only calls to definitions parsed in this run, see Interpreter::VisitCallExpr
+		bool VisitCallExpr(NodeId id, const CallExpr &expr) {
+			std::vector<Constant> args;
+			for (NodeId arg : expr.Args) {
+				if (Visit(arg))
+					args.push_back(m_evaluator.m_folded[arg.GetIndex()]);
+			}
+
+			auto function = m_evaluator.m_functions.find(expr.Callee);
+			if (args.size() != expr.Args.size() || function == m_evaluator.m_functions.end())
+				return false;
+
+			Interpreter interpreter(m_evaluator);
+			llvm::Optional<double> result = interpreter.Evaluate(function->second, args);
+			if (!result)
+				return false;
+
+			m_evaluator.m_calledFunctions.insert(expr.Callee);
+			m_evaluator.m_calledFunctions.insert(interpreter.GetCalledFunctions().begin(), interpreter.GetCalledFunctions().end());
+			return Record(id, MakeDouble(*result));
+		}
+
+		bool VisitIndexExpr(NodeId, const IndexExpr &expr) {
+			Visit(expr.Index);
+			return false;
+		}
+
+		bool VisitCompoundStmt(NodeId, const CompoundStmt &stmt) {
+			for (NodeId child : stmt.Statements)
+				Visit(child);
+			return false;
+		}
+
+		bool VisitAssignStmt(NodeId, const AssignStmt &stmt) {
+			for (NodeId lhs : stmt.Lhs)
+				Visit(lhs);
+			Visit(stmt.Rhs);
+			return false;
+		}
+
+		bool VisitReturnStmt(NodeId, const ReturnStmt &stmt) {
+			Visit(stmt.ReturnExpr);
+			return false;
+		}
+
+		bool VisitIfStmt(NodeId, const IfStmt &stmt) {
+			Visit(stmt.Condition);
+			Visit(stmt.Body);
+			if (stmt.Else)
+				Visit(stmt.Else);
+			return false;
+		}
+
+		bool VisitForStmt(NodeId, const ForStmt &stmt) {
+			Visit(stmt.Value);
+			Visit(stmt.Condition);
+			Visit(stmt.Step);
+			Visit(stmt.Body);
+			return false;
+		}
+
+		bool VisitFunctionDecl(NodeId, const FunctionDecl &decl) {
+			Visit(decl.Body);
+			return false;
+		}
+
+	private:
+		bool Record(NodeId expr, Constant value) {
+			m_evaluator.m_folded[expr.GetIndex()] = value;
+			return true;
+		}
+
+		Evaluator &m_evaluator;
+	};
+
+	void Evaluator::FoldFunction(NodeId functionDecl) {
+		ConstantFolder(*this).Visit(functionDecl);
+	}
+
+	llvm::Optional<Constant> Evaluator::GetFolded(NodeId expr) const {
+		auto folded = m_folded.find(expr.GetIndex());
+		if (folded == m_folded.end())
+			return llvm::None;
+		return folded->second;
+	}
+
+	llvm::Optional<double> Evaluator::Run(NodeId functionDecl) {
+		Interpreter interpreter(*this);
+		llvm::Optional<double> value = interpreter.Run(functionDecl);
+		if (value)
+			m_calledFunctions.insert(interpreter.GetCalledFunctions().begin(), interpreter.GetCalledFunctions().end());
+		return value;
+	}
+
+	NodeId Simplify(const ASTContext &nodes, const BinaryExpr &expr, const Types::VariableTypes &variables) {
+		auto IsLiteral = [&](NodeId id, double value) {
+			return nodes.GetKind(id) == NodeKind::NumberExpr && nodes.Get<NumberExpr>(id).Value == value;
+		};
+
+		NodeId kept = nullptr;
+		switch (expr.Op) {
+			case '-':
+				kept = IsLiteral(expr.Rhs, 0) ? expr.Lhs : nullptr;
+				break;
+			case '*':
+				kept = IsLiteral(expr.Rhs, 1) ? expr.Lhs : IsLiteral(expr.Lhs, 1) ? expr.Rhs : nullptr;
+				break;
+			case '/':
+				kept = IsLiteral(expr.Rhs, 1) ? expr.Lhs : nullptr;
+				break;
+			default:
+				break;
+		}
+		if (!kept)
+			return nullptr;
+
+		ValueType type = Types::GetExpressionType(nodes, kept, variables);
+		ValueType lhsType = kept == expr.Lhs ? type : Types::ValueType::Integer;
+		ValueType rhsType = kept == expr.Rhs ? type : Types::ValueType::Integer;
+		if (type != Types::GetBinaryType(expr.Op, lhsType, rhsType))
+			return nullptr;
+		return kept;
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/SetVector.h>
+
+#include <unordered_map>
+
+#include "AST.h"
+#include "Types.h"
+
+namespace Folding {
+
+	// Value of an expression known before code generation, with the type generated code
+	// would give it. Bools are 0 or 1
+	struct Constant {
+		Types::ValueType Type = Types::ValueType::Double;
+		double Real = 0;	 // Doubles
+		int64_t Integer = 0; // Bools and integers
+
+		double ToDouble() const { return Type == Types::ValueType::Double ? Real : double(Integer); }
+	};
+
+	// Definitions the evaluator may run, by name. Only functions parsed in the current run
+	// have an AST, calls to any other function can't be evaluated
+	using FunctionTable = llvm::DenseMap<Symbols::Symbol, Parser::NodeId>;
+
+	// Runs code at compile time, with the semantics of the code generated for it. Gives up on
+	// anything with effects or inputs, like externs, arrays and variables of the caller, and once
+	// a run takes more steps than its budget.
+	class Evaluator {
+	public:
+		Evaluator(const Parser::ASTContext &nodes, const FunctionTable &functions) : m_nodes(nodes), m_functions(functions) {}
+
+		// Folds every expression of a function without variables, including calls to user functions
+		// with arguments that fold. One pass from the leaves up, before code is generated for it
+		void FoldFunction(Parser::NodeId functionDecl);
+		// Value of an expression of a function folded before, if it folded
+		llvm::Optional<Constant> GetFolded(Parser::NodeId expr) const;
+		// Value a function without parameters returns, as top-level statements are run
+		llvm::Optional<double> Run(Parser::NodeId functionDecl);
+
+		// Functions run by successful evaluations, whose code their results depend on
+		llvm::ArrayRef<Symbols::Symbol> GetCalledFunctions() const { return m_calledFunctions.getArrayRef(); }
+
+	private:
+		const Parser::ASTContext &m_nodes;
+		const FunctionTable &m_functions;
+		llvm::DenseMap<uint32_t, Constant> m_folded; // Only expressions that folded
+		// By function, inferred on first call. Frames of running calls point into it
+		std::unordered_map<uint32_t, Types::VariableTypes> m_variableTypes;
+		llvm::SetVector<Symbols::Symbol> m_calledFunctions;
+
+		friend class Interpreter;
+		friend class ConstantFolder;
+	};
+
+	// Operand a binary expression can be replaced with, when the other one is an identity
+	// literal and the replacement has the type of the whole expression. Only identities that
+	// hold for every double are used: x - 0, x * 1 and x / 1, but not x + 0, since -0 + 0 is +0
+	Parser::NodeId Simplify(const Parser::ASTContext &nodes, const Parser::BinaryExpr &expr, const Types::VariableTypes &variables);
+}
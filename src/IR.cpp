@@ -1,402 +1,1262 @@
 #include "IR.h"
+#include "Multiversioning.h"
 
-#include <unordered_map>
-
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/Constants.h>
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/Verifier.h>
-
 #include <llvm/IR/LegacyPassManager.h>
-#include <llvm/Transforms/Utils.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-
-#include "KailedoscopeJIT.h"
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Object/ArchiveWriter.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FileUtilities.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Transforms/IPO/DeadArgumentElimination.h>
+#include <llvm/Transforms/IPO/FunctionAttrs.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/IPO/SCCP.h>
+#include <llvm/Transforms/Scalar/InductiveRangeCheckElimination.h>
+#include <llvm/Transforms/Scalar/TailRecursionElimination.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
 
 namespace IR {
 
 	static llvm::ExitOnError ExitOnErr;
 
-	struct Context {
-		std::unique_ptr<llvm::LLVMContext> LLVMContext;
-		std::unique_ptr<llvm::Module> Module;
-		std::unique_ptr<llvm::IRBuilder<>> Builder;
-		std::unordered_map<std::string, llvm::AllocaInst *> ValueMap; // Maps variables declared in current scope
+	static thread_local Context *s_ir = nullptr;
 
-		// Defines optimization passes for IR
-		std::unique_ptr<llvm::legacy::FunctionPassManager> OptimizationPasses;
+	Context *SetContext(Context *context) {
+		Context *previous = s_ir;
+		s_ir = context;
+		return previous;
+	}
 
-		// Vanilla JIT compiler
-		std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT;
+	Context &GetContext() {
+		assert(s_ir && "No IR context bound to this thread");
+		return *s_ir;
+	}
 
-		void Init() {
-			JIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
-			ResetModule();
+	static llvm::CodeGenOpt::Level GetCodeGenLevel(OptLevel level) {
+		switch (level) {
+			case OptLevel::O0: return llvm::CodeGenOpt::None;
+			case OptLevel::O1: return llvm::CodeGenOpt::Less;
+			case OptLevel::O2: return llvm::CodeGenOpt::Default;
+			case OptLevel::O3: return llvm::CodeGenOpt::Aggressive;
 		}
+		llvm_unreachable("Unknown optimization level");
+	}
 
-		void ResetModule() {
-			LLVMContext = std::make_unique<llvm::LLVMContext>();
-			Module = std::make_unique<llvm::Module>("KaleidoscopeDefaultModule", *LLVMContext);
-			Module->setDataLayout(JIT->getDataLayout()); // this doesn't bind the module to the JIT
+	static void OptimizeOnFirstCall(Context &session, llvm::Module &module);
+
+	// Programs emitted to files run on other machines, so unless the host is asked for, they're
+	// compiled for the baseline of its architecture or the CPU named
+	static llvm::Expected<llvm::orc::JITTargetMachineBuilder> GetTargetBuilder(const Context &ir) {
+		llvm::orc::JITTargetMachineBuilder builder = ir.JIT->getTargetMachineBuilder();
+		if (!ir.Emitting || ir.TargetCPU == "native")
+			return builder;
+
+		// Code generation aborts on CPUs it doesn't know, so they're rejected up front
+		const llvm::Triple &triple = builder.getTargetTriple();
+		if (!ir.TargetCPU.empty()) {
+			std::string error;
+			const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple.str(), error);
+			std::unique_ptr<llvm::MCSubtargetInfo> info(target ? target->createMCSubtargetInfo(triple.str(), "", "") : nullptr);
+			if (!info || !info->isCPUStringValid(ir.TargetCPU))
+				return llvm::make_error<llvm::StringError>("Unknown CPU '" + ir.TargetCPU + "' for " + triple.str(), llvm::inconvertibleErrorCode());
+		}
 
-			Builder = std::make_unique<llvm::IRBuilder<>>(*LLVMContext);
+		builder.setCPU(!ir.TargetCPU.empty() ? ir.TargetCPU : triple.getArch() == llvm::Triple::x86_64 ? "x86-64" : "generic");
+		builder.getFeatures() = llvm::SubtargetFeatures();
+		return builder;
+	}
+
+	bool Context::Init() {
+		if (!JIT) {
+			llvm::orc::KaleidoscopeJIT::ObjectCacheCreator createCache;
+			if (!ObjectCacheDirectory.empty()) {
+				ObjectCache = std::make_unique<ObjectCaching::DiskCache>(ObjectCacheDirectory, ObjectCacheSize);
+				createCache = [this](std::function<std::string()> describeTarget) {
+					return ObjectCache->CreateObjectCache(std::move(describeTarget));
+				};
+			}
+
+			if (JITLinkSlabSize)
+				JITLinkMemory = std::make_unique<JITMemory::SlabMemoryManager>(JITLinkSlabSize);
 
-			OptimizationPasses = std::make_unique<llvm::legacy::FunctionPassManager>(Module.get());
-			OptimizationPasses->add(llvm::createPromoteMemoryToRegisterPass());	 // mem2reg pass, promotes allocas to registers
-			OptimizationPasses->add(llvm::createInstructionCombiningPass());
-			OptimizationPasses->add(llvm::createReassociatePass());
-			OptimizationPasses->add(llvm::createGVNPass());
-			OptimizationPasses->add(llvm::createCFGSimplificationPass());
-			OptimizationPasses->doInitialization();
+			JIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(std::move(createCache), JITLinkMemory.get()));
+			DataLayout = JIT->getDataLayout().getStringRepresentation();
+
+			// glibc ships its vector math library separately. Once loaded, the JIT resolves calls
+			// to it like any other symbol of the process
+			const llvm::Triple &triple = JIT->getTargetMachineBuilder().getTargetTriple();
+			if (triple.isOSLinux() && triple.getArch() == llvm::Triple::x86_64 &&
+			    !llvm::sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1"))
+				VectorLibrary = llvm::TargetLibraryInfoImpl::LIBMVEC_X86;
 		}
 
-		void Dump() {
-			Module->print(llvm::errs(), nullptr);
+		// Pipelines are built for the target they tune code for
+		llvm::Expected<llvm::orc::JITTargetMachineBuilder> target = GetTargetBuilder(*this);
+		if (!target) {
+			llvm::logAllUnhandledErrors(target.takeError(), llvm::errs(), ">> ERROR: ");
+			return false;
+		}
+		if (!TargetMachine || TargetMachine->getTargetCPU() != target->getCPU() ||
+		    TargetMachine->getTargetFeatureString() != target->getFeatures().getString()) {
+			TargetMachine = ExitOnErr(target->createTargetMachine());
+			OptimizationPasses.reset();
+		}
+
+		// Tier 1 has a target machine and pipelines of its own, only used by its background thread
+		if (TieredCompilation && !Tiers) {
+			std::shared_ptr<llvm::TargetMachine> targetMachine = ExitOnErr(JIT->getTargetMachineBuilder().createTargetMachine());
+			targetMachine->setOptLevel(llvm::CodeGenOpt::Aggressive);
+			auto pipeline = std::make_shared<OptimizationPipeline>(OptLevel::O3, targetMachine.get(), VectorLibrary);
+			Tiers = std::make_unique<Tiering::TieredCompiler>(*JIT, [targetMachine, pipeline](llvm::Module &module) {
+				pipeline->Run(module, pipeline->Passes);
+			});
 		}
-	};
 
-	static Context s_ir;
+		JIT->setCodeGenOptLevel(GetCodeGenLevel(OptimizationLevel));
+		JIT->setLazyTransform([this](llvm::orc::ThreadSafeModule module, llvm::orc::MaterializationResponsibility &) {
+			module.withModuleDo([this](llvm::Module &m) { OptimizeOnFirstCall(*this, m); });
+			return llvm::Expected<llvm::orc::ThreadSafeModule>(std::move(module));
+		});
+		TargetMachine->setOptLevel(GetCodeGenLevel(OptimizationLevel));
+		return true;
+	}
 
-	Context &GetContext() { return s_ir; }
+	void Context::InitWorker(const Context &session) {
+		Signatures = session.Signatures;
+		Functions = session.Functions;
+		DataLayout = session.DataLayout;
+		OptimizationLevel = session.OptimizationLevel;
+		FPMode = session.FPMode;
+		Multiversioning = session.Multiversioning;
+		LazyCompilation = session.LazyCompilation;
+		VectorLibrary = session.VectorLibrary;
+
+		const llvm::TargetMachine &target = *session.TargetMachine;
+		TargetMachine.reset(target.getTarget().createTargetMachine(
+		    target.getTargetTriple().str(), target.getTargetCPU(), target.getTargetFeatureString(), target.Options,
+		    target.getRelocationModel(), target.getCodeModel(), target.getOptLevel()));
+	}
 
-	void GenerateCode(Parser::TranslationUnitASTPtr unit) {
-		s_ir.Init();
-		unit->GenerateCode();
-		s_ir.Dump();
+	void Context::ResetModule() {
+		// Everything below belongs to the old LLVM context, so it goes first
+		Builder.reset();
+		Module.reset();
+
+		LLVMContext = std::make_unique<llvm::LLVMContext>();
+		Builder = std::make_unique<llvm::IRBuilder<>>(*LLVMContext);
+		StartModule();
+	}
+
+	void Context::StartModule() {
+		Module = std::make_unique<llvm::Module>("KaleidoscopeDefaultModule", *LLVMContext);
+		Module->setDataLayout(DataLayout); // this doesn't bind the module to the JIT
+		if (TargetMachine)
+			Module->setTargetTriple(TargetMachine->getTargetTriple().str());
+		FunctionMap.clear();
+	}
+
+	static llvm::PassBuilder::OptimizationLevel GetPassBuilderLevel(OptLevel level) {
+		switch (level) {
+			case OptLevel::O0: return llvm::PassBuilder::OptimizationLevel::O0;
+			case OptLevel::O1: return llvm::PassBuilder::OptimizationLevel::O1;
+			case OptLevel::O2: return llvm::PassBuilder::OptimizationLevel::O2;
+			case OptLevel::O3: return llvm::PassBuilder::OptimizationLevel::O3;
+		}
+		llvm_unreachable("Unknown optimization level");
 	}
 
-	// BEWARE: JIT compilation invalidates the module, so you need to reset it everytime you compile something
-	void JITCompile() {
+	OptimizationPipeline::OptimizationPipeline(OptLevel level, llvm::TargetMachine *targetMachine,
+	                                           llvm::TargetLibraryInfoImpl::VectorLibrary vectorLibrary)
+	    : Level(level) {
+		// Same choices as clang: loops are unrolled and vectorized from -O2 on
+		llvm::PipelineTuningOptions tuning;
+		tuning.LoopUnrolling = level >= OptLevel::O2;
+		tuning.LoopInterleaving = level >= OptLevel::O2;
+		tuning.LoopVectorization = level >= OptLevel::O2;
+		tuning.SLPVectorization = level >= OptLevel::O2;
+
+		// The target machine gives loop and vectorization passes the costs of the real target
+		llvm::PassBuilder builder(false, targetMachine, tuning);
+
+		// Lets the loop vectorizer replace math intrinsics with calls to the SIMD variants of the
+		// vector library. Registered first, so the default one isn't
+		llvm::TargetLibraryInfoImpl libraryInfo(targetMachine->getTargetTriple());
+		libraryInfo.addVectorizableFunctionsFromVecLib(vectorLibrary);
+		FunctionAnalyses.registerPass([libraryInfo] { return llvm::TargetLibraryAnalysis(libraryInfo); });
+
+		builder.registerModuleAnalyses(ModuleAnalyses);
+		builder.registerCGSCCAnalyses(CGSCCAnalyses);
+		builder.registerFunctionAnalyses(FunctionAnalyses);
+		builder.registerLoopAnalyses(LoopAnalyses);
+		builder.crossRegisterProxies(LoopAnalyses, FunctionAnalyses, CGSCCAnalyses, ModuleAnalyses);
+
+		// -O0 still promotes variables to registers, which keeps the generated code readable, and
+		// turns self-recursive tail calls into loops. It doesn't optimize across functions
+		if (level == OptLevel::O0) {
+			llvm::FunctionPassManager functionPasses;
+			functionPasses.addPass(llvm::PromotePass());
+			functionPasses.addPass(llvm::TailCallElimPass());
+			Passes.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(functionPasses)));
+			return;
+		}
+
+		// Removes bounds checks from the loops they're redundant in, before loops are vectorized
+		builder.registerScalarOptimizerLateEPCallback([](llvm::FunctionPassManager &passes, llvm::PassBuilder::OptimizationLevel) {
+			passes.addPass(llvm::IRCEPass());
+		});
+
+		Passes = builder.buildPerModuleDefaultPipeline(GetPassBuilderLevel(level));
+
+		// Functions were already simplified on their own, this only cleans up after inlining
+		InterproceduralPasses.addPass(llvm::IPSCCPPass());
+		InterproceduralPasses.addPass(llvm::DeadArgumentEliminationPass());
+		InterproceduralPasses.addPass(builder.buildInlinerPipeline(GetPassBuilderLevel(level), llvm::ThinOrFullLTOPhase::None));
+		InterproceduralPasses.addPass(llvm::ReversePostOrderFunctionAttrsPass());
+		InterproceduralPasses.addPass(llvm::GlobalDCEPass());
+	}
+
+	void OptimizationPipeline::Run(llvm::Module &module, llvm::ModulePassManager &passes) {
+		passes.run(module, ModuleAnalyses);
+
+		// Results are cached by address, and the next module may be allocated at the same one
+		LoopAnalyses.clear();
+		FunctionAnalyses.clear();
+		CGSCCAnalyses.clear();
+		ModuleAnalyses.clear();
+	}
+
+	void Context::Dump(llvm::raw_ostream &out) {
+		Module->print(out, nullptr);
+	}
+
+	void WriteModule(std::string &bitcode) {
+		llvm::raw_string_ostream stream(bitcode);
+		llvm::WriteBitcodeToFile(*GetContext().Module, stream);
+		stream.flush();
+	}
+
+	bool ReadModule(llvm::StringRef bitcode) {
+		Context &ir = GetContext();
+		llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, "cached"), *ir.LLVMContext);
+		if (!module) {
+			llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), ">> ERROR: ");
+			return false;
+		}
+
+		ir.Module = std::move(*module);
+		return true;
+	}
+
+	bool LinkModule(llvm::Module &destination) {
+		Context &ir = GetContext();
+		ir.FunctionMap.clear();
+
+		// Reports its own errors
+		return !llvm::Linker::linkModules(destination, std::move(ir.Module));
+	}
+
+	llvm::orc::ThreadSafeModule TakeModule() {
+		Context &ir = GetContext();
+		ir.FunctionMap.clear();
+		ir.Builder.reset();
+		return llvm::orc::ThreadSafeModule(std::move(ir.Module), std::move(ir.LLVMContext));
+	}
+
+	llvm::orc::ThreadSafeContext TakeContext() {
+		Context &ir = GetContext();
+		ir.FunctionMap.clear();
+		ir.Builder.reset();
+		ir.Module.reset();
+		return llvm::orc::ThreadSafeContext(std::move(ir.LLVMContext));
+	}
+
+	llvm::orc::ResourceTrackerSP AddModule(llvm::orc::ThreadSafeModule module, bool lazy) {
+		Context &ir = GetContext();
+
 		// IR builder uses target architecture's data layout to allocate memory with proper
 		// allignment, guaranteeing allocations are optimized for the platform.
-		llvm::orc::ResourceTrackerSP resourceTracker = s_ir.JIT->getMainJITDylib().createResourceTracker();
+		llvm::orc::ResourceTrackerSP resourceTracker = ir.JIT->getMainJITDylib().createResourceTracker();
+		if (lazy && ir.TieredCompilation)
+			module.withModuleDo([&](llvm::Module &m) { ir.Tiers->Track(*resourceTracker, m); });
+
+		// Transfers module ownership to JIT compiler, the tracker keeps the compiled code alive
+		llvm::Error error = lazy ? ir.JIT->addLazyModule(std::move(module), resourceTracker)
+		                         : ir.JIT->addModule(std::move(module), resourceTracker);
+		if (error) {
+			if (ir.Tiers)
+				ir.Tiers->Forget(*resourceTracker);
+			llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), ">> ERROR: ");
+			return nullptr;
+		}
+
+		return resourceTracker;
+	}
 
-		// Transfers module ownership to JIT compiler, so it's discarded after compilation
-		llvm::orc::ThreadSafeModule safeModule{std::move(s_ir.Module), std::move(s_ir.LLVMContext)};
-		ExitOnErr(s_ir.JIT->addModule(std::move(safeModule), resourceTracker));
+	void RemoveModule(llvm::orc::ResourceTracker &tracker) {
+		Context &ir = GetContext();
+		if (ir.Tiers)
+			ir.Tiers->Forget(tracker);
+		ExitOnErr(ir.JIT->removeModule(tracker));
+	}
 
-		if (auto exprSymbol = ExitOnErr(s_ir.JIT->lookup(ANON_EXPR_NAME))) {
-			double (*funcPointer)() = (double (*)())(intptr_t)exprSymbol.getAddress();
-			fprintf(stderr, "Evaluated to %f\n", funcPointer());
+	uint64_t Lookup(llvm::StringRef name) {
+		llvm::Expected<llvm::JITEvaluatedSymbol> symbol = GetContext().JIT->lookup(name);
+		if (!symbol) {
+			llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), ">> ERROR: ");
+			return 0;
 		}
+		return symbol->getAddress();
+	}
+
+	bool Evaluate(llvm::StringRef name) {
+		uint64_t address = Lookup(name);
+		if (!address)
+			return false;
+
+		double (*funcPointer)() = (double (*)())(intptr_t)address;
+		PrintValue(funcPointer());
+		return true;
+	}
 
-		ExitOnErr(resourceTracker->remove());
+	void PrintValue(double value) {
+		fprintf(stderr, "Evaluated to %f\n", value);
 	}
 
 	// Creates stack allocation for a variable. Allocas must ALWAYS
 	// be declared in the function's entry point, so that mem2reg optimization
 	// is able to optimize local variables into phi nodes.
-	llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* function, const std::string& varName) {
+	llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* function, Symbols::Symbol varName, llvm::Type *type) {
 		// Creates temporary builder on start of entry block
 		llvm::BasicBlock *entryBlock = &function->getEntryBlock();
 		llvm::IRBuilder<> tempBuilder { entryBlock, entryBlock->begin() };
 		
-		return tempBuilder.CreateAlloca(llvm::Type::getDoubleTy(*s_ir.LLVMContext), 0, varName.c_str());
+		return tempBuilder.CreateAlloca(type, 0, Symbols::GetName(varName));
+	}
+
+	llvm::Type *GetType(Context &ir, Types::ValueType type) {
+		switch (type) {
+			case Types::ValueType::Bool:
+				return llvm::Type::getInt1Ty(*ir.LLVMContext);
+			case Types::ValueType::Integer:
+				return llvm::Type::getInt64Ty(*ir.LLVMContext);
+			default:
+				return llvm::Type::getDoubleTy(*ir.LLVMContext);
+		}
+	}
+
+	// Converts between booleans, integers and doubles. Booleans are 0 or 1 as numbers, and
+	// numbers are true when they're not 0
+	llvm::Value *Convert(Context &ir, llvm::Value *value, llvm::Type *type) {
+		llvm::Type *sourceType = value->getType();
+		if (sourceType == type)
+			return value;
+
+		auto &builder = ir.Builder;
+		if (type->isIntegerTy(1)) {
+			if (sourceType->isDoubleTy())
+				return builder->CreateFCmpUNE(value, llvm::ConstantFP::get(sourceType, 0.0), "tobool");
+			return builder->CreateICmpNE(value, llvm::ConstantInt::get(sourceType, 0), "tobool");
+		}
+
+		if (type->isDoubleTy()) {
+			if (sourceType->isIntegerTy(1))
+				return builder->CreateUIToFP(value, type, "todouble");
+			return builder->CreateSIToFP(value, type, "todouble");
+		}
+
+		if (sourceType->isIntegerTy(1))
+			return builder->CreateZExt(value, type, "toint");
+		return builder->CreateFPToSI(value, type, "toint");
+	}
+
+	llvm::Value *ConvertToDouble(Context &ir, llvm::Value *value) {
+		return Convert(ir, value, llvm::Type::getDoubleTy(*ir.LLVMContext));
+	}
+
+	llvm::Function *DeclareFunction(Context &ir, Symbols::Symbol name, const Signature &signature) {
+		// Creates vector of parameter types. Scalars are doubles, arrays a pointer and a length
+		std::vector<llvm::Type *> parameters;
+		for (unsigned i = 0; i < signature.ParamCount; i++) {
+			if (i < 32 && (signature.ArrayParams >> i) & 1) {
+				parameters.push_back(llvm::Type::getDoublePtrTy(*ir.LLVMContext));
+				parameters.push_back(llvm::Type::getInt64Ty(*ir.LLVMContext));
+			} else {
+				parameters.push_back(llvm::Type::getDoubleTy(*ir.LLVMContext));
+			}
+		}
+
+		// Creates function type
+		llvm::FunctionType *functionType = llvm::FunctionType::get(
+		    llvm::Type::getDoubleTy(*ir.LLVMContext), parameters, false);
+
+		// Creates function prototype and adds it to the module
+		llvm::Function *function = llvm::Function::Create(functionType, llvm::Function::ExternalLinkage, Symbols::GetName(name), ir.Module.get());
+
+		// Arrays passed to a call must not overlap, which lets loops over them vectorize without
+		// runtime checks
+		for (llvm::Argument &arg : function->args()) {
+			if (arg.getType()->isPointerTy()) {
+				arg.addAttr(llvm::Attribute::NoAlias);
+				arg.addAttr(llvm::Attribute::NoCapture);
+			}
+		}
+
+		ir.FunctionMap[name] = function;
+		return function;
+	}
+
+	// Math functions of the C library that have an intrinsic. Calls to them are constant folded,
+	// hoisted out of loops and vectorized, where calls to the external function aren't
+	struct MathBuiltin {
+		const char *Name;
+		unsigned ParamCount;
+		llvm::Intrinsic::ID Intrinsic;
+	};
+
+	static const MathBuiltin s_mathBuiltins[] = {
+	    {"sqrt", 1, llvm::Intrinsic::sqrt},
+	    {"fabs", 1, llvm::Intrinsic::fabs},
+	    {"sin", 1, llvm::Intrinsic::sin},
+	    {"cos", 1, llvm::Intrinsic::cos},
+	    {"exp", 1, llvm::Intrinsic::exp},
+	    {"log", 1, llvm::Intrinsic::log},
+	    {"floor", 1, llvm::Intrinsic::floor},
+	    {"ceil", 1, llvm::Intrinsic::ceil},
+	    {"pow", 2, llvm::Intrinsic::pow},
+	    {"min", 2, llvm::Intrinsic::minnum},
+	    {"max", 2, llvm::Intrinsic::maxnum},
+	    {"fmin", 2, llvm::Intrinsic::minnum},
+	    {"fmax", 2, llvm::Intrinsic::maxnum},
+	    {"fma", 3, llvm::Intrinsic::fma},
+	};
+
+	// Intrinsic a call lowers to, or not_intrinsic. Only calls to externs are lowered, since
+	// definitions in the program take precedence
+	llvm::Intrinsic::ID GetMathBuiltin(const Context &ir, Symbols::Symbol name, unsigned argCount) {
+		static const llvm::DenseMap<Symbols::Symbol, const MathBuiltin *> builtins = [] {
+			llvm::DenseMap<Symbols::Symbol, const MathBuiltin *> map;
+			for (const MathBuiltin &builtin : s_mathBuiltins)
+				map[Symbols::Intern(builtin.Name)] = &builtin;
+			return map;
+		}();
+
+		const MathBuiltin *builtin = builtins.lookup(name);
+		if (!builtin || builtin->ParamCount != argCount)
+			return llvm::Intrinsic::not_intrinsic;
+
+		if (!ir.Signatures)
+			return llvm::Intrinsic::not_intrinsic;
+
+		auto signature = ir.Signatures->find(name);
+		bool isExtern = signature != ir.Signatures->end() && signature->second.External && !signature->second.ArrayParams;
+		return isExtern ? builtin->Intrinsic : llvm::Intrinsic::not_intrinsic;
+	}
+
+	// Recovers the signature of a declared function from its parameter types
+	Signature GetSignature(llvm::Function *function) {
+		Signature signature;
+		for (unsigned i = 0; i < function->arg_size(); i++, signature.ParamCount++) {
+			if (function->getArg(i)->getType()->isPointerTy()) {
+				signature.ArrayParams |= 1u << signature.ParamCount;
+				i++; // Skips the length
+			}
+		}
+		return signature;
+	}
+
+	// Functions defined by other items are declared in the current module on first use
+	llvm::Function *GetFunction(Symbols::Symbol name) {
+		Context &ir = GetContext();
+		if (llvm::Function *function = ir.FunctionMap.lookup(name))
+			return function;
+
+		if (!ir.Signatures)
+			return nullptr;
+
+		auto signature = ir.Signatures->find(name);
+		return signature != ir.Signatures->end() ? DeclareFunction(ir, name, signature->second) : nullptr;
 	}
 }
 
-namespace Parser {
+// #### Code generation
+namespace IR {
 
-	llvm::Value *NumberExpr::GenerateCode() {
-		return llvm::ConstantFP::get(*IR::GetContext().LLVMContext, llvm::APFloat{m_value});
+	using namespace Parser;
+
+	// Flags of floating-point instructions generated in a mode. Loop vectorization of LLVM 12 only
+	// reorders reductions whose instructions have every fast-math flag, so fast mode sets them all,
+	// including contraction and approximate math functions
+	llvm::FastMathFlags GetFastMathFlags(FPMode mode) {
+		llvm::FastMathFlags flags;
+		if (mode == FPMode::Fast)
+			flags.setFast();
+		else if (mode == FPMode::Contract)
+			flags.setAllowContract();
+		return flags;
 	}
 
-	llvm::Value *VariableExpr::GenerateCode() {
-		auto &ctx = IR::GetContext();
-		auto &varAlloca = ctx.ValueMap[m_name];
-		if (varAlloca)
-			return ctx.Builder->CreateLoad(varAlloca, m_name);
+	// Marks a call whose value is returned right away as a tail call. Calls to functions of the
+	// caller's own type are musttail, which guarantees they don't grow the stack even without
+	// optimizations, so deep recursion runs in constant stack space. Self-recursive ones are
+	// turned into loops by tail call elimination
+	void MarkTailCall(Context &ir, llvm::Value *value) {
+		auto *call = llvm::dyn_cast<llvm::CallInst>(value);
+		if (!call || llvm::isa<llvm::IntrinsicInst>(call) || call->getParent() != ir.Builder->GetInsertBlock() || call->getNextNode())
+			return;
+
+		llvm::Function *caller = call->getFunction();
+		bool sameType = call->getFunctionType() == caller->getFunctionType() && call->getCallingConv() == caller->getCallingConv();
+		call->setTailCallKind(sameType ? llvm::CallInst::TCK_MustTail : llvm::CallInst::TCK_Tail);
+	}
 
-		printf(">> ERROR: Unknown variable name\n");
-		return nullptr;
+	llvm::ReturnInst *CreateReturn(Context &ir, llvm::Value *value) {
+		value = ConvertToDouble(ir, value);
+		MarkTailCall(ir, value);
+		return ir.Builder->CreateRet(value);
 	}
 
-	llvm::Value *BinaryExpr::GenerateCode() {
-		llvm::Value *lhsValue = m_lhs->GenerateCode(), *rhsValue = m_rhs->GenerateCode();
+	// Adds default return value when block has no control flow instruction. Blocks return the
+	// value of their last statement that has one, see Parser::HasBlockValue
+	void AddDefaultReturn(Context &ir, llvm::Function *function, const llvm::DenseMap<llvm::BasicBlock *, llvm::Value *> &lastValues) {
+		for (auto &block : function->getBasicBlockList()) {
+			bool noControlFlow = true;
+			for (auto &stmt : block.getInstList()) {
+				if (llvm::isa<llvm::ReturnInst>(stmt) || llvm::isa<llvm::BranchInst>(stmt) || llvm::isa<llvm::UnreachableInst>(stmt)) {
+					noControlFlow = false;
+					break;
+				}
+			}
+
+			if (noControlFlow) {
+				ir.Builder->SetInsertPoint(&block);
+
+				// Functions always return doubles, so blocks without a value return 0
+				if (llvm::Value *lastValue = lastValues.lookup(&block)) {
+					CreateReturn(ir, lastValue);
+				} else {
+					ir.Builder->CreateRet(llvm::ConstantFP::get(ir.Builder->getDoubleTy(), 0.0));
+				}
+			}
+		}
+	}
 
-		if (!lhsValue || !rhsValue) {
+	// Emits IR for a translation unit into the current module. Statements return the value
+	// or block they produced, or nullptr on errors.
+	class CodeGenerator : public ASTVisitor<CodeGenerator, llvm::Value *> {
+	public:
+		CodeGenerator(const ASTContext &nodes, Context &ir)
+		    : ASTVisitor(nodes), m_ir(ir), m_evaluator(nodes, ir.Functions ? *ir.Functions : s_noFunctions) {}
+
+		llvm::ArrayRef<Symbols::Symbol> GetFoldedFunctions() const { return m_evaluator.GetCalledFunctions(); }
+		bool HasLoops() const { return m_hasLoops; }
+
+		llvm::Value *VisitNumberExpr(NodeId, const NumberExpr &expr) {
+			if (Types::GetLiteralType(expr.Value) == Types::ValueType::Integer)
+				return llvm::ConstantInt::get(llvm::Type::getInt64Ty(*m_ir.LLVMContext), int64_t(expr.Value), true);
+			return llvm::ConstantFP::get(*m_ir.LLVMContext, llvm::APFloat{expr.Value});
+		}
+
+		llvm::Value *VisitVariableExpr(NodeId, const VariableExpr &expr) {
+			if (llvm::AllocaInst *varAlloca = m_ir.ValueMap.lookup(expr.Name))
+				return m_ir.Builder->CreateLoad(varAlloca->getAllocatedType(), varAlloca, Symbols::GetName(expr.Name));
+
+			if (m_ir.ArrayMap.count(expr.Name)) {
+				printf(">> ERROR: Array '%s' can only be indexed or passed to functions\n", Symbols::GetName(expr.Name).data());
+				return nullptr;
+			}
+
+			printf(">> ERROR: Unknown variable name\n");
 			return nullptr;
 		}
 
-		auto &ctx = IR::GetContext();
-		switch (m_op) {
-			case '+':
-				return ctx.Builder->CreateFAdd(lhsValue, rhsValue, "addtmp"); // name parameter is optional but helps reading
-			case '-':
-				return ctx.Builder->CreateFSub(lhsValue, rhsValue, "subtmp");
-			case '*':
-				return ctx.Builder->CreateFMul(lhsValue, rhsValue, "multmp");
-			case '/':
-				return ctx.Builder->CreateFDiv(lhsValue, rhsValue, "divtmp");
-			case '<':
-				// Converts float operation to integer boolean
-				lhsValue = ctx.Builder->CreateFCmpULT(lhsValue, rhsValue, "lttmp"); // ULT = unordered less than
-				return ctx.Builder->CreateFPToUI(lhsValue, llvm::Type::getInt1Ty(*IR::GetContext().LLVMContext), "booltmp");
-			case '>':
-				lhsValue = ctx.Builder->CreateFCmpUGT(lhsValue, rhsValue, "gttmp"); // UGT = unordered greater than
-				return ctx.Builder->CreateFPToUI(lhsValue, llvm::Type::getInt1Ty(*IR::GetContext().LLVMContext), "booltmp");
-			default:
-				printf(">> ERROR: Unknown binary operator\n");
+		// Constant operands are folded before generating any code, and identity operands like
+		// the 1 of x * 1 are dropped
+		llvm::Value *VisitBinaryExpr(NodeId id, const BinaryExpr &expr) {
+			if (llvm::Optional<Folding::Constant> value = m_evaluator.GetFolded(id))
+				return GenerateConstant(*value);
+			if (NodeId operand = Folding::Simplify(m_context, expr, m_ir.VariableTypes))
+				return Visit(operand);
+
+			llvm::Value *lhsValue = Visit(expr.Lhs), *rhsValue = Visit(expr.Rhs);
+
+			if (!lhsValue || !rhsValue) {
 				return nullptr;
+			}
+
+			switch (expr.Op) {
+				case '+':
+				case '-':
+				case '*':
+				case '/':
+					return GenerateArithmetic(expr.Op, lhsValue, rhsValue);
+				case '<':
+				case '>':
+					return GenerateComparison(expr.Op, lhsValue, rhsValue);
+				default:
+					printf(">> ERROR: Unknown binary operator\n");
+					return nullptr;
+			}
+			return nullptr;
 		}
-		return nullptr;
-	}
 
-	llvm::Value *CallExpr::GenerateCode() {
-		// Checks if function is defined and arguments are valid
-		auto &ctx = IR::GetContext();
-		if (llvm::Function *calledFunction = ctx.Module->getFunction(m_calleeName)) {
-			if (m_args.size() == calledFunction->arg_size()) {
+		// Calls to pure functions with constant arguments are evaluated at compile time
+		llvm::Value *VisitCallExpr(NodeId id, const CallExpr &expr) {
+			if (llvm::Optional<Folding::Constant> value = m_evaluator.GetFolded(id))
+				return GenerateConstant(*value);
+
+			if (expr.Callee == Types::GetLengthBuiltin() && expr.Args.size() == 1) {
+				if (const ArrayValue *array = FindArray(expr.Args[0]))
+					return array->Length;
+			}
+
+			if (llvm::Intrinsic::ID intrinsic = GetMathBuiltin(m_ir, expr.Callee, unsigned(expr.Args.size()))) {
 				std::vector<llvm::Value *> arguments;
-				for (const auto &arg : m_args) {
-					if (llvm::Value *argValue = arg->GenerateCode()) {
-						arguments.push_back(argValue);
-					} else {
-						printf(">> ERROR: Invalid function argument\n");
+				for (NodeId arg : expr.Args) {
+					llvm::Value *argValue = Visit(arg);
+					if (!argValue)
 						return nullptr;
+					arguments.push_back(ConvertToDouble(m_ir, argValue));
+				}
+				return m_ir.Builder->CreateIntrinsic(intrinsic, {m_ir.Builder->getDoubleTy()}, arguments, nullptr, "calltmp");
+			}
+
+			// Checks if function is defined and arguments are valid
+			if (llvm::Function *calledFunction = GetFunction(expr.Callee)) {
+				Signature signature = GetSignature(calledFunction);
+				if (expr.Args.size() == signature.ParamCount) {
+					std::vector<llvm::Value *> arguments;
+					for (size_t i = 0; i < expr.Args.size(); i++) {
+						bool isArrayParam = i < 32 && (signature.ArrayParams >> i) & 1;
+						if (isArrayParam) {
+							const ArrayValue *array = FindArray(expr.Args[i]);
+							if (!array) {
+								printf(">> ERROR: Expected an array argument\n");
+								return nullptr;
+							}
+
+							arguments.push_back(array->Data);
+							arguments.push_back(array->Length);
+						} else if (llvm::Value *argValue = Visit(expr.Args[i])) {
+							arguments.push_back(ConvertToDouble(m_ir, argValue));
+						} else {
+							printf(">> ERROR: Invalid function argument\n");
+							return nullptr;
+						}
 					}
+
+					return m_ir.Builder->CreateCall(calledFunction, arguments, "calltmp");
 				}
 
-				return ctx.Builder->CreateCall(calledFunction, arguments, "calltmp");
+				printf(">> ERROR: Called function with wrong number of arguments\n");
+				return nullptr;
 			}
 
-			printf(">> ERROR: Called function with wrong number of arguments\n");
+			printf(">> ERROR: %s definition not found\n", Symbols::GetName(expr.Callee).data());
 			return nullptr;
 		}
 
-		printf(">> ERROR: %s definition not found\n", m_calleeName.c_str());
-		return nullptr;
-	}
+		llvm::Value *VisitIndexExpr(NodeId, const IndexExpr &expr) {
+			if (llvm::Value *element = GenerateElementAddress(expr))
+				return m_ir.Builder->CreateAlignedLoad(m_ir.Builder->getDoubleTy(), element, llvm::MaybeAlign(sizeof(double)), "element");
+			return nullptr;
+		}
+
+		llvm::Value *VisitReturnStmt(NodeId, const ReturnStmt &stmt) {
+			// Sets function return type
+			if (llvm::Value *returnValue = Visit(stmt.ReturnExpr)) {
+				CreateReturn(m_ir, returnValue);
+				return returnValue;
+			}
 
-	llvm::Value *ReturnStmt::GenerateCode() {
-		// Sets function return type
-		if (llvm::Value *returnValue = m_returnExpr->GenerateCode()) {
-			IR::GetContext().Builder->CreateRet(returnValue);
-			return returnValue;
+			printf(">> ERROR: Could not evaluate return statement.\n");
+			return nullptr;
 		}
 
-		printf(">> ERROR: Could not evaluate return statement.\n");
-		return nullptr;
-	}
+		llvm::Value *VisitIfStmt(NodeId, const IfStmt &stmt) {
+			auto &builder = m_ir.Builder;
+
+			llvm::Function *function = builder->GetInsertBlock()->getParent();
 
-	llvm::Value *IfStmt::GenerateCode() {
-		auto &ctx = IR::GetContext();
-		auto &builder = ctx.Builder;
+			llvm::BasicBlock *exitBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "ifend");
 
-		llvm::Function *function = builder->GetInsertBlock()->getParent();
+			llvm::Value *value = GenerateIfSequence(stmt, exitBlock);
 
-		llvm::BasicBlock *exitBlock = llvm::BasicBlock::Create(*ctx.LLVMContext, "ifend");
+			function->getBasicBlockList().push_back(exitBlock);
+			builder->SetInsertPoint(exitBlock);
 
-		llvm::Value *value = GenerateCodeSequence(exitBlock);
+			return value;
+		}
 
-		function->getBasicBlockList().push_back(exitBlock);
-		builder->SetInsertPoint(exitBlock);
+		llvm::Value *VisitForStmt(NodeId, const ForStmt &stmt) {
+			auto &builder = m_ir.Builder;
+			m_hasLoops = true;
 
-		return value;
-	}
+			llvm::BasicBlock *entryBlock = builder->GetInsertBlock();
+			llvm::Function *function = entryBlock->getParent();
 
-	llvm::Value *IfStmt::GenerateCodeSequence(llvm::BasicBlock *exit) {
-		auto &ctx = IR::GetContext();
-		auto &builder = ctx.Builder;
+			// Creates alloca for loop induction var. This eliminates the need for a Phi instruction.
+			// Loops counting in whole steps from a whole number get an integer induction var
+			llvm::AllocaInst *loopVarAlloca = CreateEntryBlockAlloca(function, stmt.LoopVarName, GetVariableType(stmt.LoopVarName));
+			m_ir.ValueMap[stmt.LoopVarName] = loopVarAlloca;
+			llvm::Value *startVal = Visit(stmt.Value);
+			if (!startVal)
+				return nullptr;
+			builder->CreateStore(Convert(m_ir, startVal, loopVarAlloca->getAllocatedType()), loopVarAlloca);
 
-		if (llvm::Value *conditionValue = m_condition->GenerateCode()) {
-			llvm::BasicBlock *parentBlock = builder->GetInsertBlock();
-			llvm::Function *function = parentBlock->getParent();
+			// Generates loop block
+			llvm::BasicBlock *loopBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "loop", function);
+			builder->CreateBr(loopBlock);			// Branches from entry to loop
+			builder->SetInsertPoint(loopBlock);
 
-			// Creates block for if statement
-			llvm::BasicBlock *ifBlock = llvm::BasicBlock::Create(*ctx.LLVMContext, "ifbb", function);
-			builder->SetInsertPoint(ifBlock);
-			m_body->GenerateCode();
+			// Generates loop body
+			Visit(stmt.Body);
 
-			// Creates block for else/else-if statement (optional)
-			if (m_else) {
-				llvm::BasicBlock *elseBlock = llvm::BasicBlock::Create(*ctx.LLVMContext, "elsebb", function);
-				builder->SetInsertPoint(parentBlock);
-				builder->CreateCondBr(conditionValue, ifBlock, elseBlock); // branches from parent to if/else
-				builder->SetInsertPoint(elseBlock);
+			// Increments loop variable by step
+			llvm::Value *step = Visit(stmt.Step);
+			if (!step)
+				return nullptr;
+			llvm::StringRef loopVarName = Symbols::GetName(stmt.LoopVarName);
+			llvm::Value *currentLoopValue = builder->CreateLoad(loopVarAlloca->getAllocatedType(), loopVarAlloca, loopVarName);
+			// Integer loop variables are bounded, see Types::MaxIntegerBound, so stepping them can't overflow
+			llvm::Value *newLoopValue = currentLoopValue->getType()->isIntegerTy(64)
+			                                ? builder->CreateNSWAdd(currentLoopValue, Convert(m_ir, step, currentLoopValue->getType()), "nextvar")
+			                                : GenerateArithmetic('+', currentLoopValue, step);
+			builder->CreateStore(Convert(m_ir, newLoopValue, loopVarAlloca->getAllocatedType()), loopVarAlloca);
+
+			// Generates loop exit
+			llvm::BasicBlock *loopEndBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "loopend", function);
+			llvm::Value *endCondition = Visit(stmt.Condition);
+			if (!endCondition)
+				return nullptr;
+			builder->CreateCondBr(Convert(m_ir, endCondition, builder->getInt1Ty()), loopBlock, loopEndBlock);
 
-				if (IfStmt *elseIfStmt = dynamic_cast<IfStmt *>(m_else.get())) {
-					elseIfStmt->GenerateCodeSequence(exit);
-				} else {
-					// Generates else code
-					m_else->GenerateCode();
-				}
-			} else {
-				builder->SetInsertPoint(parentBlock);
-				builder->CreateCondBr(conditionValue, ifBlock, exit); // branches from parent to if or exit
+			builder->SetInsertPoint(loopEndBlock);
+			m_ir.ValueMap.erase(stmt.LoopVarName);		// Removes loop induction var
+
+			return loopEndBlock;
+		}
+
+		llvm::Value *VisitCompoundStmt(NodeId, const CompoundStmt &stmt) {
+			// CompoundStmt requires at least one statement
+			if (stmt.Statements.empty())
+				return nullptr;
+
+			llvm::BasicBlock *parentBlock = m_ir.Builder->GetInsertBlock();
+
+			// Statements that split their block, like bounds checks, end in the block their value is for
+			for (NodeId child : stmt.Statements) {
+				llvm::Value *value = Visit(child);
+				if (value && HasBlockValue(m_context.GetKind(child)))
+					m_lastValues[m_ir.Builder->GetInsertBlock()] = value;
 			}
 
-			return ifBlock;
+			return parentBlock;
 		}
-		return nullptr;
-	}
 
-	llvm::Value *ForStmt::GenerateCode() {
-		auto &ctx = IR::GetContext();
-		auto &builder = ctx.Builder;
+		llvm::Value *VisitAssignStmt(NodeId, const AssignStmt &stmt) {
+			auto &builder = m_ir.Builder;
+			llvm::Function *function = builder->GetInsertBlock()->getParent();
 
-		llvm::BasicBlock *entryBlock = builder->GetInsertBlock();
-		llvm::Function *function = entryBlock->getParent();
+			// Assignment statements will work like Python. If the variable
+			// exists, its values are modified. Otherwise, it's instantiated.
+			llvm::Value *result = Visit(stmt.Rhs);
+			if (!result)
+				return nullptr;
 
-		// Creates alloca for loop induction var. This eliminates the need for a Phi instruction.
-		auto &loopVarAlloca = ctx.ValueMap[m_loopVarName];
-		loopVarAlloca = IR::CreateEntryBlockAlloca(function, m_loopVarName);
-		llvm::Value *startVal = m_value->GenerateCode();
-		builder->CreateStore(startVal, loopVarAlloca);
+			for (NodeId lhs : stmt.Lhs) {
+				if (m_context.GetKind(lhs) == NodeKind::IndexExpr) {
+					llvm::Value *element = GenerateElementAddress(m_context.Get<IndexExpr>(lhs));
+					if (!element)
+						return nullptr;
 
-		// Generates loop block
-		llvm::BasicBlock *loopBlock = llvm::BasicBlock::Create(*ctx.LLVMContext, "loop", function);
-		builder->CreateBr(loopBlock);			// Branches from entry to loop
-		builder->SetInsertPoint(loopBlock);
+					builder->CreateAlignedStore(ConvertToDouble(m_ir, result), element, llvm::MaybeAlign(sizeof(double)));
+					continue;
+				}
 
-		// Generates loop body
-		m_body->GenerateCode();
+				Symbols::Symbol name = m_context.Get<VariableExpr>(lhs).Name;
+				if (m_ir.ArrayMap.count(name)) {
+					printf(">> ERROR: Array '%s' can't be assigned\n", Symbols::GetName(name).data());
+					return nullptr;
+				}
 
-		// Increments loop variable by step
-		llvm::Value *step = m_step->GenerateCode();
-		llvm::Value *currentLoopValue = builder->CreateLoad(loopVarAlloca, m_loopVarName);
-		llvm::Value *newLoopValue = builder->CreateFAdd(currentLoopValue, step, m_loopVarName);
-		builder->CreateStore(newLoopValue, loopVarAlloca);
+				auto &varAlloca = m_ir.ValueMap[name];
+				if (!varAlloca) {
+					varAlloca = CreateEntryBlockAlloca(function, name, GetVariableType(name));
+				}
 
-		// Generates loop exit
-		llvm::BasicBlock *loopEndBlock = llvm::BasicBlock::Create(*ctx.LLVMContext, "loopend", function);
-		llvm::Value *endCondition = m_condition->GenerateCode();
-		builder->CreateCondBr(endCondition, loopBlock, loopEndBlock);
+				builder->CreateStore(Convert(m_ir, result, varAlloca->getAllocatedType()), varAlloca);
+			}
 
-		builder->SetInsertPoint(loopEndBlock);
-		ctx.ValueMap.erase(m_loopVarName);		// Removes loop induction var
+			return result;
+		}
 
-		return loopEndBlock;
-	}
+		llvm::Value *VisitPrototypeDecl(NodeId, const PrototypeDecl &decl) {
+			llvm::Function *function = DeclareFunction(m_ir, decl.Name, {unsigned(decl.Params.size()), decl.ArrayParams});
+
+			// Sets names of all function parameters
+			unsigned int idx = 0;
+			for (size_t i = 0; i < decl.Params.size(); i++) {
+				llvm::StringRef name = Symbols::GetName(decl.Params[i]);
+				function->getArg(idx++)->setName(name);
+				if (decl.IsArrayParam(i))
+					function->getArg(idx++)->setName(name + ".len");
+			}
+
+			return function;
+		}
+
+		llvm::Value *VisitFunctionDecl(NodeId id, const FunctionDecl &decl) {
+			m_ir.VariableTypes = Types::InferVariableTypes(m_context, id);
+			m_evaluator.FoldFunction(id);
+
+			// Looks for function prototype
+			PrototypeDecl prototype = m_context.Get<PrototypeDecl>(decl.Prototype);
+			llvm::Function *function = m_ir.FunctionMap.lookup(prototype.Name);
+			function = function ? function : llvm::cast<llvm::Function>(Visit(decl.Prototype));
+
+			auto &builder = m_ir.Builder;
+			if (function) {
+				builder->setFastMathFlags(GetFastMathFlags(prototype.Mode != FPMode::Default ? prototype.Mode : m_ir.FPMode));
+
+				// Creates new block
+				llvm::BasicBlock *entryBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "entry", function);
+				builder->SetInsertPoint(entryBlock);
+
+				// Inserts variables inside block to current scope. Arrays can't be reassigned, so they
+				// don't need an alloca
+				m_ir.ValueMap.clear();
+				m_ir.ArrayMap.clear();
+				m_lastValues.clear();
+				m_trapBlock = nullptr;
+				unsigned argIndex = 0;
+				for (size_t i = 0; i < prototype.Params.size(); i++) {
+					Symbols::Symbol argName = prototype.Params[i];
+					llvm::Argument *arg = function->getArg(argIndex++);
+					if (prototype.IsArrayParam(i)) {
+						m_ir.ArrayMap[argName] = {arg, function->getArg(argIndex++)};
+						continue;
+					}
+
+					auto &varAlloca = m_ir.ValueMap[argName];
+					varAlloca = CreateEntryBlockAlloca(function, argName, arg->getType());
+					builder->CreateStore(arg, varAlloca);
+				}
+
+				if (llvm::Value *body = Visit(decl.Body)) {
+					// BEWARE: This changes insert point to block with no control flow
+					AddDefaultReturn(m_ir, function, m_lastValues);
+
+					// Verifies correctness of function
+					llvm::verifyFunction(*function);
+					return function;
+				}
 
-	llvm::Value *CompoundStmt::GenerateCode() {
-		// CompoundStmt requires at least one statement
-		if (m_statements.size() == 0)
+				m_ir.FunctionMap.erase(prototype.Name);
+				function->eraseFromParent();
+				printf(">> ERROR: Function has no body\n");
+				return nullptr;
+			}
+
+			printf(">> ERROR: Invalid function prototype\n");
 			return nullptr;
+		}
 
-		llvm::BasicBlock *parentBlock = IR::GetContext().Builder->GetInsertBlock();
+	private:
+		// Array named by an argument, or nullptr if it isn't one
+		const ArrayValue *FindArray(NodeId node) {
+			if (m_context.GetKind(node) != NodeKind::VariableExpr)
+				return nullptr;
 
-		for (auto &stmt : m_statements)
-			stmt->GenerateCode();
+			auto array = m_ir.ArrayMap.find(m_context.Get<VariableExpr>(node).Name);
+			return array != m_ir.ArrayMap.end() ? &array->second : nullptr;
+		}
 
-		return parentBlock;
-	}
+		// Indexes are converted to integers, rounding toward zero
+		llvm::Value *GenerateElementAddress(const IndexExpr &expr) {
+			auto array = m_ir.ArrayMap.find(expr.Array);
+			if (array == m_ir.ArrayMap.end()) {
+				printf(">> ERROR: '%s' is not an array\n", Symbols::GetName(expr.Array).data());
+				return nullptr;
+			}
+
+			llvm::Value *index = Visit(expr.Index);
+			if (!index)
+				return nullptr;
+
+			auto &builder = m_ir.Builder;
+			if (index->getType()->isDoubleTy())
+				index = builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat, {builder->getInt64Ty(), index->getType()}, {index}, nullptr, "index");
+			else
+				index = Convert(m_ir, index, builder->getInt64Ty());
 
-	llvm::Value* AssignStmt::GenerateCode() {
-		auto &ctx = IR::GetContext();
-		auto &builder = ctx.Builder;
-		llvm::Function *function = ctx.Builder->GetInsertBlock()->getParent();
+			GenerateBoundsCheck(index, array->second.Length);
+			return builder->CreateInBoundsGEP(builder->getDoubleTy(), array->second.Data, index, "elementptr");
+		}
 
-		// Assignment statements will work like Python. If the variable
-		// exists, its values are modified. Otherwise, it's instantiated.
-		llvm::Value *result = m_rhs->GenerateCode();
-		for (const auto &lhs : m_lhs) {
-			auto &varAlloca = ctx.ValueMap[lhs->GetName()];
-			if (!varAlloca) {
-				varAlloca = IR::CreateEntryBlockAlloca(function, lhs->GetName());
+		// Traps unless 0 <= index < length. The check is a plain compare and branch to a cold block,
+		// which IRCE splits out of loops whose range proves it redundant
+		void GenerateBoundsCheck(llvm::Value *index, llvm::Value *length) {
+			auto &builder = m_ir.Builder;
+			llvm::Function *function = builder->GetInsertBlock()->getParent();
+			if (!m_trapBlock) {
+				m_trapBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "outofbounds", function);
+				llvm::IRBuilder<> trapBuilder(m_trapBlock);
+				trapBuilder.CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+				trapBuilder.CreateUnreachable();
 			}
 
-			builder->CreateStore(result, varAlloca);
+			llvm::Value *inBounds = builder->CreateICmpULT(index, length, "inbounds");
+			llvm::BasicBlock *accessBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "access", function);
+			llvm::MDNode *weights = llvm::MDBuilder(*m_ir.LLVMContext).createBranchWeights(1u << 20, 1);
+			builder->CreateCondBr(inBounds, accessBlock, m_trapBlock, weights);
+			builder->SetInsertPoint(accessBlock);
 		}
 
-		return result;
-	}
+		llvm::Constant *GenerateConstant(const Folding::Constant &value) {
+			auto &builder = m_ir.Builder;
+			switch (value.Type) {
+				case Types::ValueType::Bool:
+					return builder->getInt1(value.Integer != 0);
+				case Types::ValueType::Integer:
+					return builder->getInt64(uint64_t(value.Integer));
+				default:
+					return llvm::ConstantFP::get(builder->getDoubleTy(), value.Real);
+			}
+		}
 
-	llvm::Function *PrototypeDecl::GenerateCode() {
-		// Creates vector of parameter types. Currently, all parameters are of type 'double'
-		std::vector<llvm::Type *> parameters{m_params.size(), llvm::Type::getDoubleTy(*IR::GetContext().LLVMContext)};
+		llvm::Type *GetVariableType(Symbols::Symbol name) {
+			return GetType(m_ir, m_ir.VariableTypes.lookup(name));
+		}
 
-		// Creates function type
-		llvm::FunctionType *functionType = llvm::FunctionType::get(
-		    llvm::Type::getDoubleTy(*IR::GetContext().LLVMContext), parameters, false);
+		// Arithmetic is on doubles, integers and booleans are converted first
+		llvm::Value *GenerateArithmetic(char op, llvm::Value *lhsValue, llvm::Value *rhsValue) {
+			lhsValue = ConvertToDouble(m_ir, lhsValue);
+			rhsValue = ConvertToDouble(m_ir, rhsValue);
+
+			auto &builder = m_ir.Builder;
+			switch (op) {
+				case '+':
+					return builder->CreateFAdd(lhsValue, rhsValue, "addtmp"); // name parameter is optional but helps reading
+				case '-':
+					return builder->CreateFSub(lhsValue, rhsValue, "subtmp");
+				case '*':
+					return builder->CreateFMul(lhsValue, rhsValue, "multmp");
+				default:
+					return builder->CreateFDiv(lhsValue, rhsValue, "divtmp");
+			}
+		}
 
-		// Creates function prototype and adds it to the module
-		llvm::Function *function = llvm::Function::Create(functionType, llvm::Function::ExternalLinkage, m_name, IR::GetContext().Module.get());
+		llvm::Value *GenerateComparison(char op, llvm::Value *lhsValue, llvm::Value *rhsValue) {
+			auto &builder = m_ir.Builder;
+			bool lhsDouble = lhsValue->getType()->isDoubleTy(), rhsDouble = rhsValue->getType()->isDoubleTy();
 
-		// Sets names of all function parameters
-		unsigned int idx = 0;
-		for (auto &arg : function->args())
-			arg.setName(m_params[idx++]);
+			// Integer constants doubles represent exactly compare the same as doubles, without rounding
+			auto *integerConstant = llvm::dyn_cast<llvm::ConstantInt>(lhsDouble ? rhsValue : lhsValue);
+			if (lhsDouble != rhsDouble && integerConstant && integerConstant->getValue().abs().ule(uint64_t(1) << 53)) {
+				lhsValue = ConvertToDouble(m_ir, lhsValue);
+				rhsValue = ConvertToDouble(m_ir, rhsValue);
+				lhsDouble = rhsDouble = true;
+			}
 
-		return function;
-	}
+			if (lhsDouble && rhsDouble) {
+				if (op == '<')
+					return builder->CreateFCmpULT(lhsValue, rhsValue, "lttmp"); // ULT = unordered less than
+				return builder->CreateFCmpUGT(lhsValue, rhsValue, "gttmp"); // UGT = unordered greater than
+			}
 
-	// Adds default return value when block has no control flow instruction
-	void AddDefaultReturn(llvm::Function *function) {
-		for (auto &block : function->getBasicBlockList()) {
-			llvm::Value *lastDoubleInst = nullptr;
-			bool noControlFlow = true;
-			for (auto &stmt : block.getInstList()) {
-				if (stmt.getType()->isDoubleTy()) {
-					lastDoubleInst = &stmt;
-				}
-				if (llvm::isa<llvm::ReturnInst>(stmt) || llvm::isa<llvm::BranchInst>(stmt)) {
-					noControlFlow = false;
-					break;
-				}
+			// Integers are compared against doubles rounded toward them, so loops counting up to a
+			// double still have an integer exit condition that LLVM can compute trip counts from
+			bool less = op == '<';
+			if (lhsDouble) {
+				std::swap(lhsValue, rhsValue);
+				less = !less;
 			}
 
-			if (noControlFlow) {
-				IR::GetContext().Builder->SetInsertPoint(&block);
+			llvm::Type *integerType = builder->getInt64Ty();
+			lhsValue = Convert(m_ir, lhsValue, integerType);
+			rhsValue = rhsDouble ? GetIntegerBound(rhsValue, less) : Convert(m_ir, rhsValue, integerType);
+			if (less)
+				return builder->CreateICmpSLT(lhsValue, rhsValue, "lttmp");
+			return builder->CreateICmpSGT(lhsValue, rhsValue, "gttmp");
+		}
+
+		// Types::GetIntegerBound of a double computed at runtime
+		llvm::Value *GetIntegerBound(llvm::Value *value, bool less) {
+			auto &builder = m_ir.Builder;
+			llvm::Type *integerType = builder->getInt64Ty();
+			llvm::Value *farLimit = llvm::ConstantFP::get(value->getType(), double(less ? Types::MaxIntegerBound : -Types::MaxIntegerBound));
+			llvm::Value *nearLimit = llvm::ConstantFP::get(value->getType(), double(less ? -Types::MaxIntegerBound : Types::MaxIntegerBound));
+			llvm::Intrinsic::ID clampFar = less ? llvm::Intrinsic::minnum : llvm::Intrinsic::maxnum;
+			llvm::Intrinsic::ID clampNear = less ? llvm::Intrinsic::maxnum : llvm::Intrinsic::minnum;
+
+			// The far limit is applied first, and turns NaN into itself
+			llvm::Value *rounded = builder->CreateUnaryIntrinsic(less ? llvm::Intrinsic::ceil : llvm::Intrinsic::floor, value);
+			llvm::Value *clamped = builder->CreateBinaryIntrinsic(clampNear, builder->CreateBinaryIntrinsic(clampFar, rounded, farLimit), nearLimit);
+			return builder->CreateFPToSI(clamped, integerType, "bound");
+		}
 
-				if (lastDoubleInst) {
-					IR::GetContext().Builder->CreateRet(lastDoubleInst);
+		// Generates code for sequential else if/else statements
+		llvm::Value *GenerateIfSequence(const IfStmt &stmt, llvm::BasicBlock *exit) {
+			auto &builder = m_ir.Builder;
+
+			if (llvm::Value *conditionValue = Visit(stmt.Condition)) {
+				conditionValue = Convert(m_ir, conditionValue, builder->getInt1Ty());
+				llvm::BasicBlock *parentBlock = builder->GetInsertBlock();
+				llvm::Function *function = parentBlock->getParent();
+
+				// Creates block for if statement
+				llvm::BasicBlock *ifBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "ifbb", function);
+				builder->SetInsertPoint(ifBlock);
+				Visit(stmt.Body);
+
+				// Creates block for else/else-if statement (optional)
+				if (stmt.Else) {
+					llvm::BasicBlock *elseBlock = llvm::BasicBlock::Create(*m_ir.LLVMContext, "elsebb", function);
+					builder->SetInsertPoint(parentBlock);
+					builder->CreateCondBr(conditionValue, ifBlock, elseBlock); // branches from parent to if/else
+					builder->SetInsertPoint(elseBlock);
+
+					if (m_context.GetKind(stmt.Else) == NodeKind::IfStmt) {
+						GenerateIfSequence(m_context.Get<IfStmt>(stmt.Else), exit);
+					} else {
+						// Generates else code
+						Visit(stmt.Else);
+					}
 				} else {
-					IR::GetContext().Builder->CreateRetVoid();
+					builder->SetInsertPoint(parentBlock);
+					builder->CreateCondBr(conditionValue, ifBlock, exit); // branches from parent to if or exit
 				}
+
+				return ifBlock;
 			}
+			return nullptr;
 		}
+
+		static const Folding::FunctionTable s_noFunctions;
+
+		Context &m_ir;
+		Folding::Evaluator m_evaluator;
+		// Value of the last statement of each block of the current function that has one
+		llvm::DenseMap<llvm::BasicBlock *, llvm::Value *> m_lastValues;
+		llvm::BasicBlock *m_trapBlock = nullptr; // Shared by all bounds checks of the current function
+		bool m_hasLoops = false;
+	};
+
+	const Folding::FunctionTable CodeGenerator::s_noFunctions;
+
+	static OptimizationPipeline &GetOptimizationPipeline(Context &ir) {
+		if (!ir.OptimizationPasses || ir.OptimizationPasses->Level != ir.OptimizationLevel)
+			ir.OptimizationPasses = std::make_unique<OptimizationPipeline>(ir.OptimizationLevel, ir.TargetMachine.get(), ir.VectorLibrary);
+		return *ir.OptimizationPasses;
 	}
 
-	llvm::Function *FunctionDecl::GenerateCode() {
-		// Looks for function prototype
-		llvm::Function *function = IR::GetContext().Module->getFunction(m_prototype->GetName());
-		function = function ? function : m_prototype->GenerateCode();
+	llvm::Function *GenerateCode(const Parser::ASTContext &nodes, Parser::NodeId decl) {
+		Context &ir = GetContext();
+		CodeGenerator generator(nodes, ir);
+		llvm::Function *function = llvm::cast_or_null<llvm::Function>(generator.Visit(decl));
+		if (!function)
+			return nullptr;
+
+		ir.FoldedFunctions.assign(generator.GetFoldedFunctions().begin(), generator.GetFoldedFunctions().end());
 
-		auto &ctx = IR::GetContext();
-		auto &builder = ctx.Builder;
-		if (function) {
-			// Creates new block
-			llvm::BasicBlock *entryBlock = llvm::BasicBlock::Create(*IR::GetContext().LLVMContext, "entry", function);
-			builder->SetInsertPoint(entryBlock);
+		// Only loops get faster with wider vectors, and top-level statements only run once
+		if (ir.Multiversioning && generator.HasLoops() && function->getName() != ANON_EXPR_NAME)
+			Multiversioning::CreateVariants(*function);
 
-			// Inserts variables inside block to current scope
-			ctx.ValueMap.clear();
-			for (auto &arg : function->args()) {
-				auto &varAlloca = ctx.ValueMap[arg.getName().str()];
-				varAlloca = IR::CreateEntryBlockAlloca(function, arg.getName().str());
-				builder->CreateStore(&arg, varAlloca);
-			}
+		// Top-level statements are called right away, so they're compiled eagerly even in lazy mode
+		if (!ir.LazyCompilation || function->getName() == ANON_EXPR_NAME) {
+			OptimizationPipeline &pipeline = GetOptimizationPipeline(ir);
+			pipeline.Run(*ir.Module, pipeline.Passes);
+		}
+		return function;
+	}
 
-			if (llvm::Value *body = m_body->GenerateCode()) {
-				// BEWARE: This changes insert point to block with no control flow
-				AddDefaultReturn(function);
+	static void OptimizeOnFirstCall(Context &session, llvm::Module &module) {
+		std::lock_guard<std::mutex> lock(session.LazyOptimizationMutex);
+		if (session.TieredCompilation)
+			session.Tiers->Instrument(module);
+		OptimizationPipeline &pipeline = GetOptimizationPipeline(session);
+		pipeline.Run(module, pipeline.Passes);
+	}
 
-				// Verifies correctness of function
-				llvm::verifyFunction(*function);
+	void OptimizeModule(llvm::ArrayRef<Symbols::Symbol> internalFunctions) {
+		Context &ir = GetContext();
+		if (ir.OptimizationLevel == OptLevel::O0)
+			return;
 
-				// Optimizes function in place, before compiling the rest of the module
-				ctx.OptimizationPasses->run(*function);
+		for (Symbols::Symbol name : internalFunctions) {
+			llvm::Function *function = ir.Module->getFunction(Symbols::GetName(name));
+			if (function && !function->isDeclaration())
+				function->setLinkage(llvm::GlobalValue::InternalLinkage);
+		}
 
-				return function;
+		OptimizationPipeline &pipeline = GetOptimizationPipeline(ir);
+		pipeline.Run(*ir.Module, pipeline.InterproceduralPasses);
+	}
+
+	static const char *s_initFunctionName = "ks_init";
+
+	// Runs the top-level statements in order, and returns the value of the last one or 0
+	static void GenerateInitFunction(llvm::Module &module, llvm::ArrayRef<TopLevelStatement> statements) {
+		llvm::LLVMContext &context = module.getContext();
+		llvm::IRBuilder<> builder(context);
+		auto *type = llvm::FunctionType::get(builder.getDoubleTy(), false);
+		auto *init = llvm::Function::Create(type, llvm::Function::ExternalLinkage, s_initFunctionName, module);
+		builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", init));
+
+		llvm::Value *value = llvm::ConstantFP::get(builder.getDoubleTy(), 0.0);
+		for (const TopLevelStatement &statement : statements) {
+			if (statement.Value) {
+				value = llvm::ConstantFP::get(builder.getDoubleTy(), *statement.Value);
+				continue;
 			}
 
-			function->eraseFromParent();
-			printf(">> ERROR: Function has no body\n");
-			return nullptr;
+			// Only the init function calls them, so they're inlined into it
+			llvm::Function *function = module.getFunction(statement.Function);
+			function->setLinkage(llvm::GlobalValue::InternalLinkage);
+			value = builder.CreateCall(function, {});
 		}
+		builder.CreateRet(value);
+	}
 
-		printf(">> ERROR: Invalid function prototype\n");
-		return nullptr;
+	// Position-independent, so it can be linked into shared libraries too
+	static bool CompileObject(llvm::Module &module, llvm::SmallVectorImpl<char> &object) {
+		Context &ir = GetContext();
+		llvm::orc::JITTargetMachineBuilder builder = ExitOnErr(GetTargetBuilder(ir));
+		builder.setRelocationModel(llvm::Reloc::PIC_);
+		builder.setCodeGenOptLevel(GetCodeGenLevel(ir.OptimizationLevel));
+		llvm::Expected<std::unique_ptr<llvm::TargetMachine>> targetMachine = builder.createTargetMachine();
+		if (!targetMachine) {
+			llvm::logAllUnhandledErrors(targetMachine.takeError(), llvm::errs(), ">> ERROR: ");
+			return false;
+		}
+		module.setPICLevel(llvm::PICLevel::BigPIC);
+
+		llvm::raw_svector_ostream stream(object);
+		llvm::legacy::PassManager passes;
+		if ((*targetMachine)->addPassesToEmitFile(passes, stream, nullptr, llvm::CGFT_ObjectFile)) {
+			fprintf(stderr, ">> ERROR: Target can't emit object files\n");
+			return false;
+		}
+		passes.run(module);
+		return true;
+	}
+
+	static bool WriteFile(llvm::StringRef path, llvm::ArrayRef<char> contents) {
+		std::error_code error;
+		llvm::raw_fd_ostream out(path, error, llvm::sys::fs::OF_None);
+		if (!error) {
+			out.write(contents.data(), contents.size());
+			out.close();
+			error = out.error();
+		}
+		if (error) {
+			fprintf(stderr, ">> ERROR: Could not write '%s': %s\n", path.str().c_str(), error.message().c_str());
+			return false;
+		}
+		return true;
 	}
 
-	void TranslationUnitDecl::GenerateCode() {
-		for (const auto &proto : m_prototypes)
-			proto->GenerateCode();
+	// Links with the C compiler on Unix, which finds the C library and libm for externs, and with
+	// the MSVC linker on Windows, where the exported functions must be listed
+	static bool LinkSharedLibrary(const llvm::Triple &triple, llvm::StringRef objectPath, llvm::StringRef path,
+	                              llvm::ArrayRef<std::string> exports) {
+		std::vector<std::string> args;
+		llvm::ErrorOr<std::string> linker = std::make_error_code(std::errc::no_such_file_or_directory);
+		if (triple.isOSWindows()) {
+			linker = llvm::sys::findProgramByName("link");
+			args = {"/DLL", "/NOENTRY", "/OUT:" + path.str(), objectPath.str(), "ucrt.lib"};
+			for (const std::string &name : exports)
+				args.push_back("/EXPORT:" + name);
+		} else {
+			linker = llvm::sys::findProgramByName("cc");
+			args = {"-shared", "-o", path.str(), objectPath.str(), "-lm"};
+		}
 
-		for (const auto &func : m_functions)
-			func->GenerateCode();
+		if (!linker) {
+			fprintf(stderr, ">> ERROR: No linker found for shared libraries, an object file or archive can be emitted instead\n");
+			return false;
+		}
+
+		std::vector<llvm::StringRef> argRefs = {*linker};
+		argRefs.insert(argRefs.end(), args.begin(), args.end());
+		std::string message;
+		if (llvm::sys::ExecuteAndWait(*linker, argRefs, llvm::None, {}, 0, 0, &message) != 0) {
+			fprintf(stderr, ">> ERROR: Could not link '%s'%s%s\n", path.str().c_str(), message.empty() ? "" : ": ", message.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool EmitProgram(std::vector<llvm::orc::ThreadSafeModule> modules, llvm::ArrayRef<TopLevelStatement> statements,
+	                 llvm::StringRef path, OutputKind kind) {
+		Context &ir = GetContext();
+		// Units were built in LLVM contexts of their own, so they go through bitcode to be linked together
+		ir.ResetModule();
+		std::unique_ptr<llvm::Module> program = std::move(ir.Module);
+		for (llvm::orc::ThreadSafeModule &module : modules) {
+			std::string bitcode;
+			module.withModuleDo([&](llvm::Module &m) {
+				llvm::raw_string_ostream stream(bitcode);
+				llvm::WriteBitcodeToFile(m, stream);
+			});
+			if (!ReadModule(bitcode) || !LinkModule(*program))
+				return false;
+		}
+		ir.Module = std::move(program);
+
+		GenerateInitFunction(*ir.Module, statements);
+		if (llvm::verifyModule(*ir.Module, &llvm::errs()))
+			return false;
+		OptimizeModule({});
+
+		std::vector<std::string> exports;
+		for (const llvm::Function &function : *ir.Module) {
+			if (!function.isDeclaration() && !function.hasLocalLinkage())
+				exports.push_back(function.getName().str());
+		}
+
+		llvm::SmallVector<char, 0> object;
+		if (!CompileObject(*ir.Module, object))
+			return false;
+
+		switch (kind) {
+			case OutputKind::Object:
+				return WriteFile(path, object);
+			case OutputKind::Archive: {
+				llvm::Triple triple(ir.Module->getTargetTriple());
+				std::string memberName = llvm::sys::path::stem(path).str() + (triple.isOSWindows() ? ".obj" : ".o");
+				llvm::NewArchiveMember member(llvm::MemoryBufferRef(llvm::StringRef(object.data(), object.size()), memberName));
+				llvm::object::Archive::Kind format = triple.isOSDarwin()    ? llvm::object::Archive::K_DARWIN
+				                                     : triple.isOSWindows() ? llvm::object::Archive::K_COFF
+				                                                            : llvm::object::Archive::K_GNU;
+				if (llvm::Error error = llvm::writeArchive(path, llvm::makeArrayRef(member), true, format, true, false)) {
+					llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), ">> ERROR: ");
+					return false;
+				}
+				return true;
+			}
+			case OutputKind::SharedLibrary: {
+				llvm::SmallString<128> objectPath;
+				if (std::error_code error = llvm::sys::fs::createTemporaryFile("kaleidoscope", "o", objectPath)) {
+					fprintf(stderr, ">> ERROR: Could not create a temporary object file: %s\n", error.message().c_str());
+					return false;
+				}
+				llvm::FileRemover remover(objectPath);
+				return WriteFile(objectPath, object) && LinkSharedLibrary(llvm::Triple(ir.Module->getTargetTriple()), objectPath, path, exports);
+			}
+		}
+		llvm_unreachable("Unknown output kind");
 	}
-}
\ No newline at end of file
+}
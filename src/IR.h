@@ -1,8 +1,195 @@
 #pragma once
 
 #include "AST.h"
+#include "Folding.h"
+#include "JITMemory.h"
+#include "ObjectCache.h"
+#include "Tiering.h"
+#include "Types.h"
+
+#include <mutex>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "KailedoscopeJIT.h"
 
 namespace IR {
-	void GenerateCode(Parser::TranslationUnitASTPtr unit);
-	void JITCompile();
-}
\ No newline at end of file
+
+	// Parameters of a function. Array parameters are passed as a pointer to their first element
+	// and a length, so 'fn f(values[], x)' is called as 'double f(double *values, int64_t length, double x)'
+	struct Signature {
+		unsigned ParamCount = 0;
+		uint32_t ArrayParams = 0; // Bit i is set when parameter i is an array
+		bool External = false;	  // Declared by an extern and not defined, so calls may map to builtins
+
+		bool operator==(const Signature &other) const {
+			return ParamCount == other.ParamCount && ArrayParams == other.ArrayParams && External == other.External;
+		}
+		bool operator!=(const Signature &other) const { return !(*this == other); }
+	};
+	using SignatureMap = llvm::DenseMap<Symbols::Symbol, Signature>;
+
+	// Array parameter of the current function
+	struct ArrayValue {
+		llvm::Value *Data;
+		llvm::Value *Length;
+	};
+
+	enum class OptLevel { O0, O1, O2, O3 };
+
+	// New pass manager pipelines of one optimization level. Analyses are dropped after every
+	// module, so the same pipelines optimize all modules of a context
+	struct OptimizationPipeline {
+		OptimizationPipeline(OptLevel level, llvm::TargetMachine *targetMachine, llvm::TargetLibraryInfoImpl::VectorLibrary vectorLibrary);
+		void Run(llvm::Module &module, llvm::ModulePassManager &passes);
+
+		OptLevel Level;
+		llvm::LoopAnalysisManager LoopAnalyses;
+		llvm::FunctionAnalysisManager FunctionAnalyses;
+		llvm::CGSCCAnalysisManager CGSCCAnalyses;
+		llvm::ModuleAnalysisManager ModuleAnalyses;
+		llvm::ModulePassManager Passes;				// Run on the module of each function
+		llvm::ModulePassManager InterproceduralPasses;	// Run once functions are linked together
+	};
+
+	// Code generation state of a compilation. Like the lexer and parser states, it is
+	// bound to the calling thread by CompilerSession. Workers generating code in parallel
+	// bind contexts of their own, which share the program-wide parts of the session's.
+	struct Context {
+		std::unique_ptr<llvm::LLVMContext> LLVMContext;
+		std::unique_ptr<llvm::Module> Module;
+		std::unique_ptr<llvm::IRBuilder<>> Builder;
+		llvm::DenseMap<Symbols::Symbol, llvm::AllocaInst *> ValueMap; // Maps variables declared in current scope
+		Types::VariableTypes VariableTypes; // Inferred types of the variables of the current function
+		llvm::DenseMap<Symbols::Symbol, ArrayValue> ArrayMap; // Maps array parameters of the current function
+		llvm::DenseMap<Symbols::Symbol, llvm::Function *> FunctionMap; // Maps functions declared in current module
+
+		// Signatures of all functions in the program. Each top-level item is compiled into
+		// a module of its own, which declares the functions it calls on first use
+		std::shared_ptr<const SignatureMap> Signatures;
+		// Definitions calls with constant arguments may be evaluated with while generating code.
+		// Owned by the session, which sets it while it builds
+		const Folding::FunctionTable *Functions = nullptr;
+		// Functions evaluated by the last GenerateCode, whose code the generated one depends on
+		std::vector<Symbols::Symbol> FoldedFunctions;
+
+		// Level generated code is optimized at. Workers take the one of their session
+		OptLevel OptimizationLevel = OptLevel::O2;
+		// Floating-point mode of functions that don't name one
+		Parser::FPMode FPMode = Parser::FPMode::Strict;
+		// Compiles functions with loops for several ISA levels, picked at runtime. Otherwise code
+		// is tuned for the CPU of the target
+		bool Multiversioning = false;
+		// Hands modules to the JIT behind stubs, so each function is only optimized and compiled on
+		// its first call. Workers take the mode of their session
+		bool LazyCompilation = false;
+		// Compiles lazily compiled functions at -O0 with counters first, and again at -O3 in the
+		// background once they're hot. Only used by session contexts
+		bool TieredCompilation = false;
+		// Generates code for the target programs are emitted for, instead of the one of the JIT.
+		// Only read by Init
+		bool Emitting = false;
+		// CPU programs are emitted for. Empty picks a generic one of the JIT's architecture without
+		// optional features, and "native" the host with all of its features
+		std::string TargetCPU;
+		// Target the optimizer tunes code for, matching the one of the JIT or the one programs are
+		// emitted for. Not thread-safe, so each context creates its own
+		std::unique_ptr<llvm::TargetMachine> TargetMachine;
+		// SIMD math library loaded into the process, which vectorized loops call for math builtins
+		llvm::TargetLibraryInfoImpl::VectorLibrary VectorLibrary = llvm::TargetLibraryInfoImpl::NoLibrary;
+		// Created on the first module generated at the current level
+		std::unique_ptr<OptimizationPipeline> OptimizationPasses;
+		// Lazily compiled functions are optimized with the pipelines of the session, on the thread
+		// making their first call
+		std::mutex LazyOptimizationMutex;
+
+		// Directory the JIT keeps compiled objects in across runs and processes, with the size
+		// it's kept under in bytes. Only read when the JIT is created, no objects are kept without one
+		std::string ObjectCacheDirectory;
+		uint64_t ObjectCacheSize = 0;
+		// Created with the JIT when there's a directory, and destroyed after it
+		std::unique_ptr<ObjectCaching::DiskCache> ObjectCache;
+		// Links objects with JITLink into slabs of this size in bytes, instead of with RuntimeDyld
+		// into pages mapped for each object. Only read when the JIT is created, 0 keeps RuntimeDyld
+		size_t JITLinkSlabSize = 0;
+		// Created with the JIT when there's a slab size, and destroyed after it
+		std::unique_ptr<JITMemory::SlabMemoryManager> JITLinkMemory;
+
+		// Vanilla JIT compiler. Worker contexts don't have one
+		std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT;
+		// Created with the JIT on the first run with tiered compilation, and destroyed before it
+		std::unique_ptr<Tiering::TieredCompiler> Tiers;
+		// Layout of the JIT target, which all modules are generated for
+		std::string DataLayout;
+
+		// Creates the JIT on first use. It keeps compiled modules until they're removed. Instruction
+		// selection and scheduling take the optimization level of the context. Returns false if
+		// the CPU programs are emitted for is unknown
+		bool Init();
+		// Prepares a worker context, which generates code for the program of a session context
+		void InitWorker(const Context &session);
+
+		// Starts a module in a new LLVM context
+		void ResetModule();
+		// Starts a module in the current LLVM context, so it can be linked with the previous ones
+		void StartModule();
+		void Dump(llvm::raw_ostream &out = llvm::errs());
+	};
+
+	// Binds the context of the calling thread and returns the previous one
+	Context *SetContext(Context *context);
+	Context &GetContext();
+
+	// Generates code for a top-level declaration into the current module and optimizes the
+	// module at the level of the context, unless the JIT optimizes it lazily. Returns nullptr on errors
+	llvm::Function *GenerateCode(const Parser::ASTContext &nodes, Parser::NodeId decl);
+
+	// Serializes the current module, so it can be handed to the JIT again without generating it
+	void WriteModule(std::string &bitcode);
+	// Replaces the current module with a serialized one
+	bool ReadModule(llvm::StringRef bitcode);
+	// Links the current module into another one of the same LLVM context, consuming it
+	bool LinkModule(llvm::Module &destination);
+	// Optimizes the current module across its functions, once they're all linked into it: inlines
+	// calls between them, propagates constants and removes unused arguments and functions. The
+	// given functions are internalized first, so nothing outside the module may call them
+	void OptimizeModule(llvm::ArrayRef<Symbols::Symbol> internalFunctions);
+
+	// Moves the current module out of the context, together with its LLVM context
+	llvm::orc::ThreadSafeModule TakeModule();
+	// Moves the LLVM context out, for modules taken from the context before
+	llvm::orc::ThreadSafeContext TakeContext();
+	// Hands a module over to the JIT, which compiles it on first lookup, or each function on its
+	// first call when it's lazy. Lazy modules must have been generated with lazy compilation.
+	// Returns the tracker that unloads it again, or nullptr on errors
+	llvm::orc::ResourceTrackerSP AddModule(llvm::orc::ThreadSafeModule module, bool lazy);
+	void RemoveModule(llvm::orc::ResourceTracker &tracker);
+
+	// Address of a compiled function, or 0 on errors. Compiles it first if needed
+	uint64_t Lookup(llvm::StringRef name);
+	// Runs a compiled top-level expression and prints its value
+	bool Evaluate(llvm::StringRef name);
+	// Prints the value of a top-level expression evaluated by the compiler
+	void PrintValue(double value);
+
+	enum class OutputKind { Object, Archive, SharedLibrary };
+
+	// Top-level statement of a program compiled ahead of time. Statements evaluated by the
+	// compiler only have their value
+	struct TopLevelStatement {
+		std::string Function;
+		llvm::Optional<double> Value;
+	};
+
+	// Links the modules of a whole program into one and compiles it to a file for the emit target of
+	// the context, instead of running it. Functions keep their names and signatures, and top-level statements
+	// become 'double ks_init(void)', which runs them in source order and returns the value of the last
+	// one. Shared libraries are linked by the C compiler of the system. Returns false on errors
+	bool EmitProgram(std::vector<llvm::orc::ThreadSafeModule> modules, llvm::ArrayRef<TopLevelStatement> statements,
+	                 llvm::StringRef path, OutputKind kind);
+}
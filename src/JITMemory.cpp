@@ -0,0 +1,160 @@
+#include "JITMemory.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Process.h>
+
+namespace JITMemory {
+
+	using llvm::sys::Memory;
+	using llvm::sys::MemoryBlock;
+
+	// Pages of one object, which go back to the slabs once it's unloaded, or if it fails to link
+	class SlabMemoryManager::SlabAllocation : public llvm::jitlink::JITLinkMemoryManager::Allocation {
+	public:
+		SlabAllocation(SlabMemoryManager &manager, MemoryBlock pages, llvm::DenseMap<unsigned, MemoryBlock> segments)
+		    : m_manager(manager), m_pages(pages), m_segments(std::move(segments)) {}
+
+		~SlabAllocation() override { llvm::consumeError(deallocate()); }
+
+		// Objects are linked in place, in the pages they run from
+		llvm::MutableArrayRef<char> getWorkingMemory(ProtectionFlags segment) override {
+			MemoryBlock &memory = m_segments[segment];
+			return {static_cast<char *>(memory.base()), memory.allocatedSize()};
+		}
+
+		llvm::JITTargetAddress getTargetMemory(ProtectionFlags segment) override {
+			return llvm::pointerToJITTargetAddress(m_segments[segment].base());
+		}
+
+		void finalizeAsync(FinalizeContinuation onFinalize) override {
+			for (auto &segment : m_segments) {
+				if (!segment.second.allocatedSize())
+					continue;
+				if (std::error_code error = Memory::protectMappedMemory(segment.second, segment.first)) {
+					onFinalize(llvm::errorCodeToError(error));
+					return;
+				}
+				if (segment.first & Memory::MF_EXEC)
+					Memory::InvalidateInstructionCache(segment.second.base(), segment.second.allocatedSize());
+			}
+			onFinalize(llvm::Error::success());
+		}
+
+		// Pages go back writable, so the next objects can be linked into them
+		llvm::Error deallocate() override {
+			if (!m_pages.allocatedSize())
+				return llvm::Error::success();
+			if (std::error_code error = Memory::protectMappedMemory(m_pages, Memory::MF_READ | Memory::MF_WRITE))
+				return llvm::errorCodeToError(error);
+
+			m_manager.Give(static_cast<char *>(m_pages.base()), m_pages.allocatedSize());
+			m_pages = MemoryBlock();
+			return llvm::Error::success();
+		}
+
+	private:
+		SlabMemoryManager &m_manager;
+		MemoryBlock m_pages;
+		llvm::DenseMap<unsigned, MemoryBlock> m_segments; // By their protection flags
+	};
+
+	SlabMemoryManager::SlabMemoryManager(size_t slabSize)
+	    : m_slabSize(slabSize), m_pageSize(llvm::sys::Process::getPageSizeEstimate()) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (std::error_code error = Reserve(m_slabSize))
+			fprintf(stderr, ">> ERROR: Could not reserve %zu bytes for the JIT: %s\n", m_slabSize, error.message().c_str());
+	}
+
+	SlabMemoryManager::~SlabMemoryManager() {
+		for (MemoryBlock &slab : m_slabs)
+			Memory::releaseMappedMemory(slab);
+	}
+
+	llvm::Expected<std::unique_ptr<llvm::jitlink::JITLinkMemoryManager::Allocation>>
+	SlabMemoryManager::allocate(const llvm::jitlink::JITLinkDylib *, const SegmentsRequestMap &request) {
+		size_t size = 0;
+		for (auto &segment : request) {
+			if (segment.second.getAlignment() > m_pageSize)
+				return llvm::make_error<llvm::StringError>("Cannot request higher than page alignment", llvm::inconvertibleErrorCode());
+			size += llvm::alignTo(segment.second.getContentSize() + segment.second.getZeroFillSize(), m_pageSize);
+		}
+
+		llvm::Expected<char *> pages = Take(size);
+		if (!pages)
+			return pages.takeError();
+
+		llvm::DenseMap<unsigned, MemoryBlock> segments;
+		char *next = *pages;
+		for (auto &segment : request) {
+			size_t segmentSize = llvm::alignTo(segment.second.getContentSize() + segment.second.getZeroFillSize(), m_pageSize);
+			segments[segment.first] = MemoryBlock(next, segmentSize);
+
+			// Pages of unloaded objects still hold their code and data
+			memset(next + segment.second.getContentSize(), 0, segment.second.getZeroFillSize());
+			next += segmentSize;
+		}
+
+		return std::make_unique<SlabAllocation>(*this, MemoryBlock(*pages, size), std::move(segments));
+	}
+
+	std::error_code SlabMemoryManager::Reserve(size_t size) {
+		std::error_code error;
+		MemoryBlock slab = Memory::allocateMappedMemory(size, nullptr, Memory::MF_READ | Memory::MF_WRITE, error);
+		if (error)
+			return error;
+
+		m_slabs.push_back(slab);
+		m_reserved += slab.allocatedSize();
+		m_freeRanges[static_cast<char *>(slab.base())] = slab.allocatedSize();
+		return std::error_code();
+	}
+
+	llvm::Expected<char *> SlabMemoryManager::Take(size_t size) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto range = std::find_if(m_freeRanges.begin(), m_freeRanges.end(),
+		                          [size](const std::pair<char *const, size_t> &free) { return free.second >= size; });
+		if (range == m_freeRanges.end()) {
+			if (std::error_code error = Reserve(std::max(m_slabSize, size)))
+				return llvm::errorCodeToError(error);
+			range = m_freeRanges.find(static_cast<char *>(m_slabs.back().base()));
+		}
+
+		char *address = range->first;
+		size_t rest = range->second - size;
+		m_freeRanges.erase(range);
+		if (rest)
+			m_freeRanges[address + size] = rest;
+
+		m_committed += size;
+		return address;
+	}
+
+	void SlabMemoryManager::Give(char *address, size_t size) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_freed += size;
+
+		// Neighbours only merge within a slab, even if another one was mapped right after it
+		auto IsSlabStart = [this](char *address) {
+			return llvm::any_of(m_slabs, [address](const MemoryBlock &slab) { return slab.base() == address; });
+		};
+
+		auto next = m_freeRanges.lower_bound(address);
+		if (next != m_freeRanges.end() && next->first == address + size && !IsSlabStart(next->first)) {
+			size += next->second;
+			next = m_freeRanges.erase(next);
+		}
+		if (next != m_freeRanges.begin()) {
+			auto previous = std::prev(next);
+			if (previous->first + previous->second == address && !IsSlabStart(address)) {
+				previous->second += size;
+				return;
+			}
+		}
+		m_freeRanges.emplace_hint(next, address, size);
+	}
+}
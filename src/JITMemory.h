@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h>
+#include <llvm/Support/Memory.h>
+
+namespace JITMemory {
+
+	// Memory JITLink links objects into, carved out of large slabs reserved up front instead of
+	// mapping the pages of each object on its own. The pages of an object go back to the slabs
+	// when its resource tracker is removed, and are handed out again to the next objects linked.
+	class SlabMemoryManager : public llvm::jitlink::JITLinkMemoryManager {
+	public:
+		// Reserves the first slab. Objects that don't fit in the slabs reserve another one, at
+		// least as large as them
+		explicit SlabMemoryManager(size_t slabSize);
+		~SlabMemoryManager() override;
+
+		// Segments of an object are contiguous, in pages of their own. Thread-safe, like JITLink requires
+		llvm::Expected<std::unique_ptr<Allocation>> allocate(const llvm::jitlink::JITLinkDylib *dylib, const SegmentsRequestMap &request) override;
+
+		size_t GetReservedBytes() const { return m_reserved; }	 // Of all slabs
+		size_t GetCommittedBytes() const { return m_committed; } // Handed out to objects, including the ones freed since
+		size_t GetFreedBytes() const { return m_freed; }		 // Given back by objects unloaded
+
+	private:
+		class SlabAllocation;
+
+		// First fit of a range of pages, in a new slab if none of the others has one
+		llvm::Expected<char *> Take(size_t size);
+		void Give(char *address, size_t size);
+		// Maps a slab of free pages. Called with the mutex locked
+		std::error_code Reserve(size_t size);
+
+		size_t m_slabSize;
+		size_t m_pageSize;
+
+		std::mutex m_mutex;
+		std::vector<llvm::sys::MemoryBlock> m_slabs;
+		std::map<char *, size_t> m_freeRanges; // Free pages of the slabs, by address so neighbours merge
+
+		std::atomic<size_t> m_reserved{0};
+		std::atomic<size_t> m_committed{0};
+		std::atomic<size_t> m_freed{0};
+	};
+}
@@ -13,54 +13,175 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/TargetProcessControl.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 namespace llvm {
 	namespace orc {
 
 		class KaleidoscopeJIT {
+		public:
+			// Creates the object cache of a compiler, given a description of the target and level
+			// it compiles for at the time, which objects must be keyed by too
+			using ObjectCacheCreator = std::function<std::unique_ptr<ObjectCache>(std::function<std::string()> DescribeTarget)>;
+
+			// Compiles with a target machine per thread, created for its first module. Lazy modules
+			// are compiled by whichever thread calls them first, so they can't share one machine
+			class PerThreadCompiler : public IRCompileLayer::IRCompiler {
+			public:
+				PerThreadCompiler(JITTargetMachineBuilder JTMB, ObjectCache *Cache)
+				    : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())), JTMB(std::move(JTMB)), Cache(Cache) {}
+
+				Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+					auto TM = getTargetMachine();
+					if (!TM)
+						return TM.takeError();
+
+					// Fast instruction selection is only used without optimizations, like in llc
+					CodeGenOpt::Level Level = OptLevel;
+					(*TM)->setOptLevel(Level);
+					(*TM)->setFastISel(Level == CodeGenOpt::None);
+					return SimpleCompiler(**TM, Cache)(M);
+				}
+
+				// Applies to modules compiled from now on, on any thread
+				void setOptLevel(CodeGenOpt::Level Level) { OptLevel = Level; }
+				CodeGenOpt::Level getOptLevel() const { return OptLevel; }
+
+			private:
+				Expected<TargetMachine *> getTargetMachine() {
+					std::lock_guard<std::mutex> Lock(Mutex);
+					std::unique_ptr<TargetMachine> &TM = Machines[std::this_thread::get_id()];
+					if (!TM) {
+						auto Created = JTMB.createTargetMachine();
+						if (!Created)
+							return Created.takeError();
+						TM = std::move(*Created);
+					}
+					return TM.get();
+				}
+
+				JITTargetMachineBuilder JTMB;
+				std::atomic<CodeGenOpt::Level> OptLevel{CodeGenOpt::Default};
+				ObjectCache *Cache;
+				std::mutex Mutex;
+				std::map<std::thread::id, std::unique_ptr<TargetMachine>> Machines;
+			};
+
 		private:
 			std::unique_ptr<TargetProcessControl> TPC;
 			std::unique_ptr<ExecutionSession> ES;
 
+			JITTargetMachineBuilder JTMB;
 			DataLayout DL;
 			MangleAndInterner Mangle;
 
-			RTDyldObjectLinkingLayer ObjectLayer;
+			std::unique_ptr<ObjectLayer> LinkingLayer;
+			std::unique_ptr<ObjectCache> Cache;			 // Of CompileLayer, if any
+			std::unique_ptr<ObjectCache> OptimizedCache; // Of OptimizedCompileLayer, if any
+			PerThreadCompiler *Compiler; // Of CompileLayer, which owns it
 			IRCompileLayer CompileLayer;
+			IRTransformLayer LazyTransformLayer; // Runs on lazy modules before they're compiled
+			IRCompileLayer OptimizedCompileLayer; // Compiles hot functions again, on any thread
 
 			JITDylib &MainJD;
 
+			// Modules added lazily are compiled in ImplJD, while MainJD only gets stubs for their
+			// functions, which compile them on first call. Created on first use
+			JITDylib &ImplJD;
+			std::unique_ptr<LazyCallThroughManager> LCTMgr;
+			std::unique_ptr<IndirectStubsManager> ISM;
+			// Code of lazy modules, by the tracker of their stubs
+			DenseMap<ResourceTracker *, ResourceTrackerSP> ImplTrackers;
+
+			static void reportLazyCompileFailure() {
+				report_fatal_error("Could not compile a function on its first call");
+			}
+
+			static JITTargetMachineBuilder withOptLevel(JITTargetMachineBuilder JTMB, CodeGenOpt::Level Level) {
+				JTMB.setCodeGenOptLevel(Level);
+				return JTMB;
+			}
+
+			// Links objects with JITLink into the given memory, or with RuntimeDyld into memory
+			// mapped for each object without one
+			static std::unique_ptr<ObjectLayer> createLinkingLayer(ExecutionSession &ES, jitlink::JITLinkMemoryManager *LinkMemory) {
+				if (LinkMemory)
+					return std::make_unique<ObjectLinkingLayer>(ES, *LinkMemory);
+
+				auto Layer = std::make_unique<RTDyldObjectLinkingLayer>(
+				    ES, []() { return std::make_unique<SectionMemoryManager>(); });
+				// Should set both those attributes to true when compiling for Windows
+				Layer->setAutoClaimResponsibilityForObjectSymbols(true);
+				Layer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+				return Layer;
+			}
+
+			static std::string describeTarget(const Triple &TT, StringRef CPU, StringRef Features, CodeGenOpt::Level Level) {
+				return TT.str() + " " + CPU.str() + " " + Features.str() + " " + std::to_string(int(Level));
+			}
+
 		public:
 			KaleidoscopeJIT(std::unique_ptr<TargetProcessControl> TPC,
 			                std::unique_ptr<ExecutionSession> ES,
-			                JITTargetMachineBuilder JTMB, DataLayout DL)
-			    : TPC(std::move(TPC)), ES(std::move(ES)), DL(std::move(DL)),
+			                JITTargetMachineBuilder JTMB, DataLayout DL,
+			                ObjectCacheCreator CreateCache = nullptr,
+			                jitlink::JITLinkMemoryManager *LinkMemory = nullptr)
+			    : TPC(std::move(TPC)), ES(std::move(ES)), JTMB(JTMB), DL(std::move(DL)),
 			      Mangle(*this->ES, this->DL),
-			      ObjectLayer(*this->ES,
-			                  []() { return std::make_unique<SectionMemoryManager>(); }),
-			      CompileLayer(*this->ES, ObjectLayer,
-			                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-			      MainJD(this->ES->createBareJITDylib("<main>")) {
-				// Should set both those attributes to true when compiling for Windows
-				ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
-				ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-
+			      LinkingLayer(createLinkingLayer(*this->ES, LinkMemory)),
+			      // The level of CompileLayer changes between modules, the one of OptimizedCompileLayer doesn't
+			      Cache(CreateCache ? CreateCache([this] {
+				      return describeTarget(this->JTMB.getTargetTriple(), this->JTMB.getCPU(),
+				                            this->JTMB.getFeatures().getString(), Compiler->getOptLevel());
+			      })
+			                        : nullptr),
+			      OptimizedCache(CreateCache ? CreateCache([Target = describeTarget(JTMB.getTargetTriple(), JTMB.getCPU(),
+			                                                                        JTMB.getFeatures().getString(), CodeGenOpt::Aggressive)] {
+				      return Target;
+			      })
+			                                 : nullptr),
+			      // Sessions add a module per unit of up to 32 items, compiled by the thread driving the
+			      // session, or lazily by the threads calling them. Each thread keeps its target machine
+			      // instead of creating one per module
+			      CompileLayer(*this->ES, *LinkingLayer, createCompiler(this->JTMB, Compiler, Cache.get())),
+			      LazyTransformLayer(*this->ES, CompileLayer),
+			      // Creates a target machine per module instead, so background threads can use it
+			      OptimizedCompileLayer(*this->ES, *LinkingLayer,
+			                            std::make_unique<ConcurrentIRCompiler>(withOptLevel(this->JTMB, CodeGenOpt::Aggressive),
+			                                                                   OptimizedCache.get())),
+			      MainJD(this->ES->createBareJITDylib("<main>")),
+			      ImplJD(this->ES->createBareJITDylib("<main>.impl")) {
 				MainJD.addGenerator(
 				    cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
 				        DL.getGlobalPrefix())));
+
+				// Calls between lazy modules go through the stubs too, so callees are only
+				// compiled once they're called
+				ImplJD.setLinkOrder({{&MainJD, JITDylibLookupFlags::MatchAllSymbols}}, false);
 			}
 
 			~KaleidoscopeJIT() {
@@ -68,7 +189,10 @@ namespace llvm {
 					ES->reportError(std::move(Err));
 			}
 
-			static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+			// Objects are compiled again every time without a cache creator. The memory manager, if
+			// any, links them with JITLink and must outlive the JIT
+			static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(ObjectCacheCreator CreateCache = nullptr,
+			                                                         jitlink::JITLinkMemoryManager *LinkMemory = nullptr) {
 				auto SSP = std::make_shared<SymbolStringPool>();
 				auto TPC = SelfTargetProcessControl::Create(SSP);
 				if (!TPC)
@@ -76,26 +200,111 @@ namespace llvm {
 
 				auto ES = std::make_unique<ExecutionSession>(std::move(SSP));
 
-				JITTargetMachineBuilder JTMB((*TPC)->getTargetTriple());
+				// Code is tuned for the CPU it runs on, and may use all of its instruction set extensions
+				auto JTMB = JITTargetMachineBuilder::detectHost();
+				if (!JTMB)
+					return JTMB.takeError();
+
+				// Formats and architectures JITLink can link
+				const Triple &TT = JTMB->getTargetTriple();
+				if (LinkMemory && !(TT.getArch() == Triple::x86_64 && (TT.isOSBinFormatELF() || TT.isOSBinFormatMachO())) &&
+				    !(TT.getArch() == Triple::aarch64 && TT.isOSBinFormatMachO()))
+					return make_error<StringError>("JITLink can't link objects for " + TT.str(), inconvertibleErrorCode());
 
-				auto DL = JTMB.getDefaultDataLayoutForTarget();
+				auto DL = JTMB->getDefaultDataLayoutForTarget();
 				if (!DL)
 					return DL.takeError();
 
 				return std::make_unique<KaleidoscopeJIT>(std::move(*TPC), std::move(ES),
-				                                         std::move(JTMB), std::move(*DL));
+				                                         std::move(*JTMB), std::move(*DL), std::move(CreateCache), LinkMemory);
+			}
+
+			static std::unique_ptr<IRCompileLayer::IRCompiler> createCompiler(JITTargetMachineBuilder &JTMB, PerThreadCompiler *&Compiler, ObjectCache *Cache) {
+				auto Owned = std::make_unique<PerThreadCompiler>(JTMB, Cache);
+				Compiler = Owned.get();
+				return Owned;
 			}
 
 			const DataLayout &getDataLayout() const { return DL; }
 
+			// Describes the target code is compiled for, so IR can be optimized for the same one
+			const JITTargetMachineBuilder &getTargetMachineBuilder() const { return JTMB; }
+
 			JITDylib &getMainJITDylib() { return MainJD; }
 
+			// Applies to modules compiled from now on, including lazy ones added before
+			void setCodeGenOptLevel(CodeGenOpt::Level Level) { Compiler->setOptLevel(Level); }
+
 			Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
 				if (!RT)
 					RT = MainJD.getDefaultResourceTracker();
 				return CompileLayer.add(RT, std::move(TSM));
 			}
 
+			// Compiles each function of the module on its first call, on the thread making it. Lookups
+			// return the address of a stub, so they don't compile anything
+			Error addLazyModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+				if (!LCTMgr) {
+					auto Manager = createLocalLazyCallThroughManager(
+					    JTMB.getTargetTriple(), *ES, pointerToJITTargetAddress(&reportLazyCompileFailure));
+					if (!Manager)
+						return Manager.takeError();
+					LCTMgr = std::move(*Manager);
+					ISM = createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())();
+				}
+
+				SymbolAliasMap Callables;
+				TSM.withModuleDo([&](Module &M) {
+					for (Function &F : M) {
+						if (F.isDeclaration() || F.hasLocalLinkage())
+							continue;
+						auto Name = Mangle(F.getName());
+						Callables[Name] = SymbolAliasMapEntry(Name, JITSymbolFlags::fromGlobalValue(F) | JITSymbolFlags::Callable);
+					}
+				});
+
+				auto ImplRT = ImplJD.createResourceTracker();
+				if (auto Err = LazyTransformLayer.add(ImplRT, std::move(TSM)))
+					return Err;
+				if (auto Err = RT->getJITDylib().define(lazyReexports(*LCTMgr, *ISM, ImplJD, std::move(Callables)), RT)) {
+					cantFail(ImplRT->remove());
+					return Err;
+				}
+
+				ImplTrackers[RT.get()] = std::move(ImplRT);
+				return Error::success();
+			}
+
+			void setLazyTransform(IRTransformLayer::TransformFunction Transform) {
+				LazyTransformLayer.setTransform(std::move(Transform));
+			}
+
+			// Unloads a module added with either of the functions above
+			Error removeModule(ResourceTracker &RT) {
+				if (auto Err = RT.remove())
+					return Err;
+
+				auto Impl = ImplTrackers.find(&RT);
+				if (Impl == ImplTrackers.end())
+					return Error::success();
+
+				ResourceTrackerSP ImplRT = std::move(Impl->second);
+				ImplTrackers.erase(Impl);
+				return ImplRT->remove();
+			}
+
+			// Compiles a module at the highest level, on the thread that looks it up first. Meant for
+			// new code of lazily compiled functions, which their stubs can be redirected to
+			Error addOptimizedModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+				return OptimizedCompileLayer.add(RT, std::move(TSM));
+			}
+
+			// Points the stub of a lazily compiled function to other code, with a single store. Calls
+			// already running keep running the old code
+			Error redirect(StringRef Name, JITTargetAddress Address) {
+				return ISM->updatePointer(*Mangle(Name.str()), Address);
+			}
+
 			Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
 				return ES->lookup({&MainJD}, Mangle(Name.str()));
 			}
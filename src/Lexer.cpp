@@ -1,120 +1,385 @@
 #include "Lexer.h"
+#include "NumberParser.h"
+#include "Scanner.h"
 
+#include <cassert>
+#include <cctype>
+#include <chrono>
 #include <cstdio>
-#include <ctype.h>
+#include <cstdlib>
+#include <initializer_list>
+#include <memory>
+#include <string>
 
-namespace Lexer {
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/xxhash.h>
 
-	struct State {
-		int LastChar = ' ';
-        std::string Identifier = "";
-        double NumberValue = 0;
+namespace Lexer {
 
-		std::string::iterator Iter;
+	// Scanner position. Cur always points to the next char to be scanned
+	struct Cursor {
+		const char *Cur = nullptr;
+		const char *End = nullptr;
+		const char *TokenStart = nullptr;
+		TokenValue Value = {};
+		const Scanner *Scan = nullptr;
 	};
 
-	static std::string s_source;
+	static thread_local State *s_state = nullptr;
 
-    int ReadNext(State& state) {
-        if(state.Iter == s_source.end())
-            return '\0';
-        return *(state.Iter++);
-    }
+	State::State() : ActiveScanner(&GetHostScanner()) {}
 
-	int FindIdentifier(State& state) {
-		state.Identifier = state.LastChar;
+	State *SetState(State *state) {
+		State *previous = s_state;
+		s_state = state;
+		return previous;
+	}
 
-		while (isalnum((state.LastChar = ReadNext(state)))) {
-			state.Identifier += state.LastChar;
-		}
+	State &GetState() {
+		assert(s_state && "No lexer state bound to this thread");
+		return *s_state;
+	}
 
-		if (state.Identifier == "fn")
-			return Token_Definition;
-		if (state.Identifier == "extern")
-			return Token_Extern;
-		if (state.Identifier == "return")
-			return Token_Return;
-		if (state.Identifier == "if")
-			return Token_If;
-		if (state.Identifier == "else")
-			return Token_Else;
-		if (state.Identifier == "for")
-			return Token_For;
-		return Token_Identifier;
+	inline bool HasNext(const Cursor &cursor) {
+		return cursor.Cur != cursor.End;
 	}
 
-	int FindNumber(State &state) {
-		std::string numberStr = "";
-		bool foundDot = false;
-		do {
-			numberStr += state.LastChar;
+	struct Keyword {
+		llvm::StringRef Text;
+		int Token;
+	};
+
+	// Perfect hash of all keywords: every keyword lands on its own slot, so lookups
+	// need a single comparison. Must be updated together with s_keywords.
+	inline unsigned HashKeyword(llvm::StringRef text) {
+		return (text.front() + text.back() + 2 * text.size()) & 7;
+	}
 
-			if (state.LastChar == '.' && foundDot) {
-				return Token_Unknown; // invalid number formatting. ex: 3.2.333
+	struct KeywordTable {
+		Keyword Slots[8] = {};
+
+		KeywordTable(std::initializer_list<Keyword> keywords) {
+			for (const Keyword &keyword : keywords) {
+				assert(Slots[HashKeyword(keyword.Text)].Text.empty() && "Keyword hash collision");
+				Slots[HashKeyword(keyword.Text)] = keyword;
 			}
-			foundDot = state.LastChar == '.';
-			state.LastChar = ReadNext(state);
-		} while (isdigit(state.LastChar) || state.LastChar == '.');
+		}
 
-		state.NumberValue = strtod(numberStr.c_str(), 0);
+		int Find(llvm::StringRef text) const {
+			if (text.size() < 2 || text.size() > 6)
+				return Token_Identifier;
 
-		return Token_Number;
+			const Keyword &candidate = Slots[HashKeyword(text)];
+			return candidate.Text == text ? candidate.Token : Token_Identifier;
+		}
+	};
+
+	static const KeywordTable s_keywords{
+	    {"fn", Token_Definition},
+	    {"extern", Token_Extern},
+	    {"return", Token_Return},
+	    {"if", Token_If},
+	    {"else", Token_Else},
+	    {"for", Token_For},
+	};
+
+	int FindIdentifier(Cursor &cursor) {
+		cursor.Cur = cursor.Scan->SkipAlnum(cursor.Cur, cursor.End);
+
+		llvm::StringRef identifier(cursor.TokenStart, cursor.Cur - cursor.TokenStart);
+		int token = s_keywords.Find(identifier);
+		if (token == Token_Identifier)
+			cursor.Value.Symbol = Symbols::Intern(identifier);
+		return token;
 	}
 
-	int GetToken(State& state) {
-        state.Identifier = "";
+	int FindNumber(Cursor &cursor) {
+		NumberLiteral literal = ParseNumber(cursor.Cur, cursor.End, *cursor.Scan);
+		cursor.Cur = literal.End;
+		if (!literal.Valid)
+			return Token_Unknown; // invalid number formatting. ex: 3.2.333
 
-		while (isspace(state.LastChar) || iscr(state.LastChar) || isnewline(state.LastChar)) {
-            state.LastChar = ReadNext(state);
-		}
+		cursor.Value.Number = literal.Value;
+		return Token_Number;
+	}
 
-        // skips comments
-		if (state.LastChar == '#') {
-			do {
-				state.LastChar = ReadNext(state);
-			} while (!isnewline(state.LastChar) && !iscr(state.LastChar));
+	int GetToken(Cursor &cursor) {
+		while (true) {
+			cursor.Cur = cursor.Scan->SkipWhitespace(cursor.Cur, cursor.End);
+
+			// skips comments
+			if (HasNext(cursor) && *cursor.Cur == '#') {
+				cursor.Cur = cursor.Scan->SkipToNewline(cursor.Cur + 1, cursor.End);
+				continue;
+			}
 
-			return GetToken(state);
+			break;
 		}
 
+		cursor.TokenStart = cursor.Cur;
+		if (!HasNext(cursor) || *cursor.Cur == '\0')
+			return Token_EndOfFile;
+
         // parses identifiers and keywords
-        if(isalpha(state.LastChar))
-            return FindIdentifier(state);
+        if(IsAlpha(*cursor.Cur))
+            return FindIdentifier(cursor);
 
         // parses numbers
-        if(isdigit(state.LastChar))
-            return FindNumber(state);
-        
-        if(state.LastChar == '\0')
-            return Token_EndOfFile;
-        
+        if(IsDigit(*cursor.Cur))
+            return FindNumber(cursor);
+
         // returns the value itself
-        int currentChar = state.LastChar;
-        state.LastChar = ReadNext(state);
-		return currentChar;
+		return (unsigned char)*(cursor.Cur++);
+	}
+
+	void Tokenize(State &state) {
+		TokenBuffer &tokens = state.Tokens;
+		tokens.Clear();
+		// Rough estimate, generated scripts average a few bytes per token
+		tokens.Reserve(state.Source.size() / 4 + 1);
+
+		Cursor cursor;
+		cursor.Cur = state.Source.begin();
+		cursor.End = state.Source.end();
+		cursor.Scan = state.ActiveScanner;
+
+		int token;
+		do {
+			token = GetToken(cursor);
+			tokens.Push(token, uint32_t(cursor.TokenStart - state.Source.begin()), uint32_t(cursor.Cur - cursor.TokenStart), cursor.Value);
+			cursor.Value = {};
+		} while (token != Token_EndOfFile);
+	}
+
+	void Init(llvm::StringRef source) {
+		State &state = GetState();
+		state.Source = source;
+		state.Mapping.reset();
+		Tokenize(state);
+	}
+
+	bool InitFromFile(const std::string &path) {
+		llvm::Expected<llvm::sys::fs::file_t> file = llvm::sys::fs::openNativeFileForRead(path);
+		if (!file) {
+			llvm::consumeError(file.takeError());
+			fprintf(stderr, ">> ERROR: Could not open '%s'\n", path.c_str());
+			return false;
+		}
+
+		llvm::sys::fs::file_status status;
+		std::error_code error = llvm::sys::fs::status(*file, status);
+		if (error) {
+			llvm::sys::fs::closeFile(*file);
+			fprintf(stderr, ">> ERROR: Could not read '%s'\n", path.c_str());
+			return false;
+		}
+
+		// Empty files can't be mapped
+		if (status.getSize() == 0) {
+			llvm::sys::fs::closeFile(*file);
+			Init(llvm::StringRef());
+			return true;
+		}
+
+		// The mapping stays valid after the file handle is closed
+		auto mapping = std::make_unique<llvm::sys::fs::mapped_file_region>(
+		    *file, llvm::sys::fs::mapped_file_region::readonly, status.getSize(), 0, error);
+		llvm::sys::fs::closeFile(*file);
+		if (error) {
+			fprintf(stderr, ">> ERROR: Could not map '%s': %s\n", path.c_str(), error.message().c_str());
+			return false;
+		}
+
+		Init(llvm::StringRef(mapping->const_data(), mapping->size()));
+		GetState().Mapping = std::move(mapping);
+		return true;
 	}
 
-	static State s_internal;
+	uint64_t TokenBuffer::Fingerprint(size_t begin, size_t end) const {
+		// Values of other tokens are zeroed, so equal token runs always hash the same
+		uint64_t kinds = llvm::xxHash64({reinterpret_cast<const uint8_t *>(&Kinds[begin]), (end - begin) * sizeof(Kinds[0])});
+		uint64_t values = llvm::xxHash64({reinterpret_cast<const uint8_t *>(&Values[begin]), (end - begin) * sizeof(Values[0])});
+		return kinds ^ (values * 0x9E3779B97F4A7C15ull + (kinds << 6) + (kinds >> 2));
+	}
 
-	void Init(const std::string &source) {
-		s_source = source;
-		s_internal.Iter = s_source.begin();
+	const TokenBuffer &GetTokens() {
+		return GetState().Tokens;
 	}
 
-	int GetToken() {
-		return GetToken(s_internal);
+	llvm::StringRef GetSource() {
+		return GetState().Source;
 	}
+}
+
+// #### Benchmark
+namespace Lexer {
 
-	int PeekToken() {
-		State peekState = s_internal;
-		return GetToken(peekState);
+	using BenchClock = std::chrono::steady_clock;
+
+	static double ElapsedSeconds(BenchClock::time_point start) {
+		return std::chrono::duration<double>(BenchClock::now() - start).count();
 	}
 
-	const std::string& GetIdentifier() {
-		return s_internal.Identifier;
+	// The lexer before the token buffer, kept as the baseline of the benchmark. Identifiers
+	// and numbers are built char by char in strings, and the parser peeked by lexing the
+	// next token on a copy of the whole state
+	namespace Streaming {
+		struct StreamState {
+			int LastChar = ' ';
+			std::string Identifier = "";
+			double NumberValue = 0;
+
+			const char *Iter;
+			const char *End;
+		};
+
+		static int ReadNext(StreamState &state) {
+			if (state.Iter == state.End)
+				return '\0';
+			return *(state.Iter++);
+		}
+
+		static int FindIdentifier(StreamState &state) {
+			state.Identifier = state.LastChar;
+
+			while (isalnum((state.LastChar = ReadNext(state))))
+				state.Identifier += state.LastChar;
+
+			if (state.Identifier == "fn")
+				return Token_Definition;
+			if (state.Identifier == "extern")
+				return Token_Extern;
+			if (state.Identifier == "return")
+				return Token_Return;
+			if (state.Identifier == "if")
+				return Token_If;
+			if (state.Identifier == "else")
+				return Token_Else;
+			if (state.Identifier == "for")
+				return Token_For;
+			return Token_Identifier;
+		}
+
+		static int FindNumber(StreamState &state) {
+			std::string numberStr = "";
+			bool foundDot = false;
+			do {
+				numberStr += state.LastChar;
+
+				if (state.LastChar == '.' && foundDot)
+					return Token_Unknown;
+				foundDot = state.LastChar == '.';
+				state.LastChar = ReadNext(state);
+			} while (isdigit(state.LastChar) || state.LastChar == '.');
+
+			state.NumberValue = strtod(numberStr.c_str(), 0);
+			return Token_Number;
+		}
+
+		static int GetToken(StreamState &state) {
+			state.Identifier = "";
+
+			while (isspace(state.LastChar))
+				state.LastChar = ReadNext(state);
+
+			if (state.LastChar == '#') {
+				do {
+					state.LastChar = ReadNext(state);
+				} while (state.LastChar != '\n' && state.LastChar != '\r' && state.LastChar != '\0');
+
+				return GetToken(state);
+			}
+
+			if (isalpha(state.LastChar))
+				return FindIdentifier(state);
+			if (isdigit(state.LastChar))
+				return FindNumber(state);
+			if (state.LastChar == '\0')
+				return Token_EndOfFile;
+
+			int currentChar = state.LastChar;
+			state.LastChar = ReadNext(state);
+			return currentChar;
+		}
+
+		static int PeekToken(const StreamState &state) {
+			StreamState peekState = state;
+			return GetToken(peekState);
+		}
 	}
 
-	double GetNumberValue() {
-		return s_internal.NumberValue;
+	// Lexes into its own state, so it doesn't need one bound to the thread
+	void RunBenchmark(llvm::StringRef source, int iterations) {
+		State state;
+		state.Source = source;
+
+		// Streaming lexer peeking at every token, as the parser used to
+		size_t tokenCount = 0;
+		auto start = BenchClock::now();
+		for (int i = 0; i < iterations; i++) {
+			Streaming::StreamState streamState;
+			streamState.Iter = source.begin();
+			streamState.End = source.end();
+			int token;
+			do {
+				token = Streaming::GetToken(streamState);
+				Streaming::PeekToken(streamState);
+				tokenCount++;
+			} while (token != Token_EndOfFile);
+		}
+		double streamingTime = ElapsedSeconds(start);
+
+		fprintf(stderr, ">> BENCH: %zu bytes, %d iterations\n", source.size(), iterations);
+		fprintf(stderr, ">> BENCH: streaming lexer + copied peek state: %12.0f tokens/sec, %8.1f MB/s\n", tokenCount / streamingTime,
+		        double(source.size()) * iterations / streamingTime / (1 << 20));
+
+		// Single lexing pass into the token buffer. Runs once per scanner the CPU supports
+		for (ScannerKind kind : {ScannerKind::Scalar, ScannerKind::SSE2, ScannerKind::AVX2}) {
+			state.ActiveScanner = GetScanner(kind);
+			if (!state.ActiveScanner)
+				continue;
+
+			size_t bufferedCount = 0;
+			start = BenchClock::now();
+			for (int i = 0; i < iterations; i++) {
+				Tokenize(state);
+				bufferedCount += state.Tokens.Size();
+			}
+			double bufferedTime = ElapsedSeconds(start);
+
+			fprintf(stderr, ">> BENCH: token buffer (%s): %12.0f tokens/sec, %8.1f MB/s\n", state.ActiveScanner->Name,
+			        bufferedCount / bufferedTime, double(source.size()) * iterations / bufferedTime / (1 << 20));
+		}
+		const Scanner &hostScanner = GetHostScanner();
+
+		// Number conversion alone, against the locale-dependent strtod on a copy of each literal
+		const TokenBuffer &tokens = state.Tokens;
+		std::vector<llvm::StringRef> literals;
+		for (size_t t = 0; t < tokens.Size(); t++) {
+			if (tokens.Kinds[t] == Token_Number)
+				literals.push_back(tokens.GetText(source, t));
+		}
+		if (literals.empty())
+			return;
+
+		double strtodSum = 0;
+		start = BenchClock::now();
+		for (int i = 0; i < iterations; i++) {
+			for (llvm::StringRef literal : literals)
+				strtodSum += strtod(literal.str().c_str(), 0);
+		}
+		double strtodTime = ElapsedSeconds(start);
+
+		double parsedSum = 0;
+		start = BenchClock::now();
+		for (int i = 0; i < iterations; i++) {
+			for (llvm::StringRef literal : literals)
+				parsedSum += ParseNumber(literal.begin(), literal.end(), hostScanner).Value;
+		}
+		double parsedTime = ElapsedSeconds(start);
+
+		fprintf(stderr, ">> BENCH: %zu number literals (sums %g / %g)\n", literals.size(), strtodSum, parsedSum);
+		fprintf(stderr, ">> BENCH: strtod: %12.0f numbers/sec\n", literals.size() * iterations / strtodTime);
+		fprintf(stderr, ">> BENCH: ParseNumber: %12.0f numbers/sec\n", literals.size() * iterations / parsedTime);
 	}
-}
\ No newline at end of file
+}
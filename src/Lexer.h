@@ -1,6 +1,14 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+
+#include "Symbols.h"
 
 namespace Lexer {
 
@@ -21,14 +29,87 @@ namespace Lexer {
         Token_Unknown,
 	};
 
+	// Payload of identifiers and numbers
+	union TokenValue {
+		double Number;
+		Symbols::Symbol Symbol;
+	};
+
+	// Whole-source token stream, stored as parallel arrays so the parser only
+	// touches token kinds while scanning ahead
+	struct TokenBuffer {
+		std::vector<int16_t> Kinds;
+		std::vector<uint32_t> Offsets;	// Token start, relative to the source
+		std::vector<uint32_t> Lengths;
+		std::vector<TokenValue> Values;
+
+		size_t Size() const { return Kinds.size(); }
+
+		void Clear() {
+			Kinds.clear();
+			Offsets.clear();
+			Lengths.clear();
+			Values.clear();
+		}
+
+		void Reserve(size_t count) {
+			Kinds.reserve(count);
+			Offsets.reserve(count);
+			Lengths.reserve(count);
+			Values.reserve(count);
+		}
+
+		void Push(int kind, uint32_t offset, uint32_t length, TokenValue value) {
+			Kinds.push_back(int16_t(kind));
+			Offsets.push_back(offset);
+			Lengths.push_back(length);
+			Values.push_back(value);
+		}
+
+		llvm::StringRef GetText(llvm::StringRef source, size_t index) const {
+			return source.substr(Offsets[index], Lengths[index]);
+		}
+
+		// Hash of the kinds and values of tokens [begin, end). Doesn't depend on whitespace,
+		// comments or where the tokens are in the source
+		uint64_t Fingerprint(size_t begin, size_t end) const;
+	};
+
+	struct Scanner;
+
+	// Lexer state of a compilation. Functions below work on the state bound to the calling
+	// thread, so independent compilations can run on different threads.
+	struct State {
+		// View of the source being lexed. It either points to a caller-owned buffer or to Mapping
+		llvm::StringRef Source;
+		std::unique_ptr<llvm::sys::fs::mapped_file_region> Mapping;
+
+		// Tokens of the whole source, filled once by Init
+		TokenBuffer Tokens;
+
+		// Bulk scanning routines, picked for the host CPU
+		const Scanner *ActiveScanner;
+
+		State();
+	};
+
+	// Binds the state used by the calling thread, or unbinds it with nullptr. Returns the previous one
+	State *SetState(State *state);
+	State &GetState();
 
     // ##### Lexer
-    void Init(const std::string& source);
-	int GetToken();
-	int PeekToken();
+	// Lexes the source in place, so it must outlive the lexer and the tokens it produces
+	void Init(llvm::StringRef source);
+	// Maps a source file read-only and lexes it in place. The mapping lives until the next Init
+	bool InitFromFile(const std::string &path);
+
+	// The parser reads tokens straight from the buffer, keeping its own position, so
+	// several parsers can work on different parts of it at once
+	const TokenBuffer &GetTokens();
+	llvm::StringRef GetSource();
 
-	const std::string& GetIdentifier();
-	double GetNumberValue();
+	// Prints lexing throughput of the old streaming lexer against the token buffer
+	void RunBenchmark(llvm::StringRef source, int iterations);
 
 
     // ##### Helpers
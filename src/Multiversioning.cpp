@@ -0,0 +1,184 @@
+#include "Multiversioning.h"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+namespace Multiversioning {
+
+	// Each variant targets one of the x86-64 micro-architecture levels, which name the same
+	// features on every vendor. Worst first, and the first one runs everywhere
+	struct Variant {
+		const char *Suffix;
+		const char *CPU;
+	};
+
+	static const Variant s_variants[] = {
+		{"sse2", "x86-64"},
+		{"avx2", "x86-64-v3"},
+		{"avx512", "x86-64-v4"},
+	};
+
+	// CPUID bits of the features of x86-64-v3, which also includes those of v2
+	static const uint32_t s_v3Leaf1Ecx = 1u << 0 | 1u << 9 | 1u << 12 | 1u << 13 | 1u << 19 | 1u << 20 | // SSE3, SSSE3, FMA, CX16, SSE4.1, SSE4.2
+	                                     1u << 22 | 1u << 23 | 1u << 26 | 1u << 27 | 1u << 28 | 1u << 29; // MOVBE, POPCNT, XSAVE, OSXSAVE, AVX, F16C
+	static const uint32_t s_v3Leaf7Ebx = 1u << 3 | 1u << 5 | 1u << 8;							 // BMI1, AVX2, BMI2
+	static const uint32_t s_v3ExtendedEcx = 1u << 0 | 1u << 5;								 // LAHF, LZCNT
+	// And the ones x86-64-v4 adds: AVX512F, AVX512DQ, AVX512CD, AVX512BW, AVX512VL
+	static const uint32_t s_v4Leaf7Ebx = 1u << 16 | 1u << 17 | 1u << 28 | 1u << 30 | 1u << 31;
+
+	// XCR0 bits of the register states the OS saves: XMM and YMM, plus opmasks and ZMM for AVX-512
+	static const uint32_t s_ymmState = 0x6;
+	static const uint32_t s_zmmState = 0xe6;
+
+	// One register of the result of CPUID: 0 is EAX, 1 EBX, 2 ECX and 3 EDX
+	static llvm::Value *Cpuid(llvm::IRBuilder<> &builder, uint32_t leaf, unsigned registerIndex) {
+		llvm::Type *i32 = builder.getInt32Ty();
+		auto *type = llvm::FunctionType::get(llvm::StructType::get(i32, i32, i32, i32), {i32, i32}, false);
+		auto *cpuid = llvm::InlineAsm::get(type, "cpuid", "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}", false);
+		llvm::Value *registers = builder.CreateCall(type, cpuid, {builder.getInt32(leaf), builder.getInt32(0)});
+		return builder.CreateExtractValue(registers, registerIndex);
+	}
+
+	static llvm::Value *HasAll(llvm::IRBuilder<> &builder, llvm::Value *bits, uint32_t mask) {
+		return builder.CreateICmpEQ(builder.CreateAnd(bits, mask), builder.getInt32(mask));
+	}
+
+	// Index of the best variant the running machine supports. Queries the CPU on the first call,
+	// and caches the result for the rest of the module
+	static llvm::Function *GetLevelFunction(llvm::Module &module) {
+		const char *name = "ks.isa_level";
+		if (llvm::Function *existing = module.getFunction(name))
+			return existing;
+
+		llvm::LLVMContext &context = module.getContext();
+		llvm::IRBuilder<> builder(context);
+		llvm::Type *i32 = builder.getInt32Ty();
+
+		// 0 until the level is known, and the level plus one afterwards
+		auto *cache = new llvm::GlobalVariable(module, i32, false, llvm::GlobalValue::InternalLinkage, builder.getInt32(0), "ks.isa_level.cache");
+		auto *function = llvm::Function::Create(llvm::FunctionType::get(i32, false), llvm::GlobalValue::InternalLinkage, name, module);
+		function->addFnAttr(llvm::Attribute::NoUnwind);
+
+		llvm::BasicBlock *entryBlock = llvm::BasicBlock::Create(context, "entry", function);
+		llvm::BasicBlock *cachedBlock = llvm::BasicBlock::Create(context, "cached", function);
+		llvm::BasicBlock *detectBlock = llvm::BasicBlock::Create(context, "detect", function);
+		llvm::BasicBlock *osBlock = llvm::BasicBlock::Create(context, "os", function);
+		llvm::BasicBlock *doneBlock = llvm::BasicBlock::Create(context, "done", function);
+
+		// Every thread computes the same level, so racing on the cache is harmless
+		builder.SetInsertPoint(entryBlock);
+		llvm::LoadInst *cached = builder.CreateAlignedLoad(i32, cache, llvm::MaybeAlign(4), "level.cached");
+		cached->setAtomic(llvm::AtomicOrdering::Monotonic);
+		builder.CreateCondBr(builder.CreateICmpNE(cached, builder.getInt32(0)), cachedBlock, detectBlock);
+
+		builder.SetInsertPoint(cachedBlock);
+		builder.CreateRet(builder.CreateSub(cached, builder.getInt32(1)));
+
+		// Leaves past the highest one the CPU has return garbage, so their bits only count when they exist
+		builder.SetInsertPoint(detectBlock);
+		llvm::Value *maxLeaf = Cpuid(builder, 0, 0);
+		llvm::Value *maxExtendedLeaf = Cpuid(builder, 0x80000000, 0);
+		llvm::Value *leaf1Ecx = Cpuid(builder, 1, 2);
+		llvm::Value *leaf7Ebx = Cpuid(builder, 7, 1);
+		llvm::Value *extendedEcx = Cpuid(builder, 0x80000001, 2);
+
+		llvm::Value *v3 = builder.CreateAnd({
+		    builder.CreateICmpUGE(maxLeaf, builder.getInt32(7)),
+		    builder.CreateICmpUGE(maxExtendedLeaf, builder.getInt32(0x80000001)),
+		    HasAll(builder, leaf1Ecx, s_v3Leaf1Ecx),
+		    HasAll(builder, leaf7Ebx, s_v3Leaf7Ebx),
+		    HasAll(builder, extendedEcx, s_v3ExtendedEcx),
+		});
+		llvm::Value *v4 = HasAll(builder, leaf7Ebx, s_v4Leaf7Ebx);
+		builder.CreateCondBr(v3, osBlock, doneBlock);
+
+		// XGETBV faults unless the OS enabled XSAVE, which v3 requires. Vector registers can
+		// only be used if the OS saves them on context switches too
+		builder.SetInsertPoint(osBlock);
+		auto *xgetbvType = llvm::FunctionType::get(llvm::StructType::get(i32, i32), {i32}, false);
+		auto *xgetbv = llvm::InlineAsm::get(xgetbvType, "xgetbv", "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}", false);
+		llvm::Value *xcr0 = builder.CreateExtractValue(builder.CreateCall(xgetbvType, xgetbv, {builder.getInt32(0)}), 0);
+		llvm::Value *avx512 = builder.CreateAnd(v4, HasAll(builder, xcr0, s_zmmState));
+		llvm::Value *osLevel = builder.CreateSelect(HasAll(builder, xcr0, s_ymmState),
+		                                            builder.CreateSelect(avx512, builder.getInt32(2), builder.getInt32(1)), builder.getInt32(0));
+		builder.CreateBr(doneBlock);
+
+		builder.SetInsertPoint(doneBlock);
+		llvm::PHINode *level = builder.CreatePHI(i32, 2, "level");
+		level->addIncoming(builder.getInt32(0), detectBlock);
+		level->addIncoming(osLevel, osBlock);
+		llvm::StoreInst *store = builder.CreateAlignedStore(builder.CreateAdd(level, builder.getInt32(1)), cache, llvm::MaybeAlign(4));
+		store->setAtomic(llvm::AtomicOrdering::Monotonic);
+		builder.CreateRet(level);
+
+		return function;
+	}
+
+	// Targets a level with nothing else: without a feature list of their own, functions get
+	// the features of the machine compiling them
+	static void SetTarget(llvm::Function &function, const char *cpu) {
+		function.addFnAttr("target-cpu", cpu);
+		function.addFnAttr("target-features", "");
+	}
+
+	bool CreateVariants(llvm::Function &function) {
+		llvm::Module &module = *function.getParent();
+		if (llvm::Triple(module.getTargetTriple()).getArch() != llvm::Triple::x86_64 || function.isDeclaration())
+			return false;
+
+		llvm::Function *variants[llvm::array_lengthof(s_variants)];
+		for (size_t i = 0; i < llvm::array_lengthof(s_variants); i++) {
+			llvm::ValueToValueMapTy map;
+			llvm::Function *clone = llvm::CloneFunction(&function, map);
+			clone->setName(function.getName() + "." + s_variants[i].Suffix);
+			clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+			SetTarget(*clone, s_variants[i].CPU);
+
+			// Recursive calls stay in the same variant
+			function.replaceUsesWithIf(clone, [clone](llvm::Use &use) {
+				auto *user = llvm::dyn_cast<llvm::Instruction>(use.getUser());
+				return user && user->getFunction() == clone;
+			});
+			variants[i] = clone;
+		}
+
+		// The dispatcher itself targets the lowest level, so the other variants can't be inlined into it
+		function.deleteBody();
+		SetTarget(function, s_variants[0].CPU);
+
+		llvm::LLVMContext &context = function.getContext();
+		llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", &function));
+		llvm::Value *level = builder.CreateCall(GetLevelFunction(module), {}, "level");
+
+		llvm::SmallVector<llvm::Value *, 8> args;
+		for (llvm::Argument &arg : function.args())
+			args.push_back(&arg);
+
+		auto CallVariant = [&](llvm::Function *variant) {
+			llvm::CallInst *call = builder.CreateCall(variant, args);
+			call->setTailCall();
+			if (function.getReturnType()->isVoidTy())
+				builder.CreateRetVoid();
+			else
+				builder.CreateRet(call);
+		};
+
+		for (size_t i = llvm::array_lengthof(s_variants) - 1; i > 0; i--) {
+			llvm::BasicBlock *variantBlock = llvm::BasicBlock::Create(context, s_variants[i].Suffix, &function);
+			llvm::BasicBlock *nextBlock = llvm::BasicBlock::Create(context, "", &function);
+			builder.CreateCondBr(builder.CreateICmpUGE(level, builder.getInt32(uint32_t(i))), variantBlock, nextBlock);
+
+			builder.SetInsertPoint(variantBlock);
+			CallVariant(variants[i]);
+			builder.SetInsertPoint(nextBlock);
+		}
+		CallVariant(variants[0]);
+
+		return true;
+	}
+}
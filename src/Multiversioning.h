@@ -0,0 +1,14 @@
+#pragma once
+
+#include <llvm/IR/Function.h>
+
+namespace Multiversioning {
+
+	// Compiles a function for several x86-64 ISA levels behind a dispatcher, so code built on one
+	// machine runs at full width on every other one: the function keeps its name and signature,
+	// and its body is replaced by a call to the clone for the best level the running CPU and OS
+	// support. The CPU is only queried once per module. Must run before optimizations, so each
+	// clone is vectorized for its own level. Returns false and leaves the function as it is on
+	// other targets.
+	bool CreateVariants(llvm::Function &function);
+}
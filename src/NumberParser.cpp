@@ -0,0 +1,354 @@
+#include "NumberParser.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MathExtras.h>
+
+namespace Lexer {
+
+	// Integers up to 2^53 are exactly representable as doubles
+	static constexpr uint64_t s_maxExactMantissa = uint64_t(1) << 53;
+
+	// Powers of ten that are exactly representable as doubles
+	static constexpr double s_exactPowersOf10[] = {
+	    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	static constexpr int s_maxExactPower = 22;
+
+	// Exponents past this are saturated, the result is already zero or infinity
+	static constexpr int s_maxExponent = 100000;
+
+	// Decimal exponents outside this range always round to zero or infinity
+	static constexpr int s_smallestPowerOf10 = -342;
+	static constexpr int s_largestPowerOf10 = 308;
+
+	// Significant digits of a literal. Digits that don't fit are dropped and only
+	// remembered by the Truncated flag, which disables the exact fast paths.
+	struct Mantissa {
+		uint64_t Value = 0;
+		int Exponent = 0;		// Base 10 for decimals, base 2 for hexadecimals
+		bool Truncated = false;
+	};
+
+	inline int HexValue(char c) {
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	inline const char *SkipHexDigits(const char *cur, const char *end) {
+		while (cur != end && HexValue(*cur) >= 0)
+			cur++;
+		return cur;
+	}
+
+	// Reads decimal digits into the mantissa. Fraction digits lower the exponent
+	static void AccumulateDecimal(const char *cur, const char *end, bool fraction, Mantissa &mantissa) {
+		for (; cur != end; cur++) {
+			unsigned digit = *cur - '0';
+			// 10^19 - 1 is the largest run of nines that fits in 64 bits
+			if (mantissa.Value < 1000000000000000000ull) {
+				mantissa.Value = mantissa.Value * 10 + digit;
+				mantissa.Exponent -= fraction;
+			} else {
+				mantissa.Exponent += !fraction;
+				mantissa.Truncated |= digit != 0;
+			}
+		}
+	}
+
+	// Reads hexadecimal digits into the mantissa. Keeps at least 60 significant bits,
+	// more than enough to round a double mantissa correctly
+	static void AccumulateHex(const char *cur, const char *end, bool fraction, Mantissa &mantissa) {
+		for (; cur != end; cur++) {
+			unsigned digit = HexValue(*cur);
+			if (mantissa.Value < (uint64_t(1) << 60)) {
+				mantissa.Value = mantissa.Value * 16 + digit;
+				mantissa.Exponent -= fraction ? 4 : 0;
+			} else {
+				mantissa.Exponent += fraction ? 0 : 4;
+				mantissa.Truncated |= digit != 0;
+			}
+		}
+	}
+
+	// Parses an optional exponent suffix, like 'e-9' or 'p4'. Returns nullptr if the marker
+	// isn't followed by digits
+	static const char *ParseExponent(const char *cur, const char *end, const Scanner &scanner, int &exponent) {
+		exponent = 0;
+		bool negative = false;
+		if (cur != end && (*cur == '+' || *cur == '-')) {
+			negative = *cur == '-';
+			cur++;
+		}
+
+		const char *digitsEnd = scanner.SkipDigits(cur, end);
+		if (digitsEnd == cur)
+			return nullptr;
+
+		for (; cur != digitsEnd; cur++) {
+			if (exponent < s_maxExponent)
+				exponent = exponent * 10 + (*cur - '0');
+		}
+
+		exponent = negative ? -exponent : exponent;
+		return digitsEnd;
+	}
+
+	// Slow path for literals with too many digits to convert exactly with integer math
+	static double ConvertWithAPFloat(llvm::StringRef text) {
+		llvm::APFloat value(llvm::APFloat::IEEEdouble());
+		auto status = value.convertFromString(text, llvm::APFloat::rmNearestTiesToEven);
+		if (!status) {
+			llvm::consumeError(status.takeError());
+			return NAN;
+		}
+		return value.convertToDouble();
+	}
+
+	// #### Eisel-Lemire conversion, as used by fast_float. See "Number Parsing at a Gigabyte
+	// per Second" and "Fast Number Parsing Without Fallback" (Lemire, Mushtak)
+
+	// 128-bit approximations of 5^q, normalized so the highest bit is set. Positive powers
+	// are truncated and negative ones rounded up.
+	struct PowersOf5 {
+		uint64_t Entries[2 * (s_largestPowerOf10 - s_smallestPowerOf10 + 1)]; // high, low
+
+		PowersOf5() {
+			const unsigned width = 2048;
+			llvm::APInt power5(width, 1);
+			for (int q = 0; q <= s_largestPowerOf10; q++) {
+				unsigned bits = power5.getActiveBits();
+				llvm::APInt normalized = bits < 128 ? power5.shl(128 - bits) : power5.lshr(bits - 128);
+				Store(q, normalized);
+				power5 *= 5;
+			}
+
+			power5 = llvm::APInt(width, 5);
+			for (int q = -1; q >= s_smallestPowerOf10; q--) {
+				unsigned bits = power5.getActiveBits();
+				unsigned shift = q >= -27 ? bits + 127 : 2 * bits + 128;
+				llvm::APInt inverse = llvm::APInt::getOneBitSet(width, shift).udiv(power5) + 1;
+				unsigned inverseBits = inverse.getActiveBits();
+				Store(q, inverseBits > 128 ? inverse.lshr(inverseBits - 128) : inverse);
+				power5 *= 5;
+			}
+		}
+
+		void Store(int q, const llvm::APInt &value) {
+			size_t index = 2 * (q - s_smallestPowerOf10);
+			Entries[index] = value.lshr(64).trunc(64).getZExtValue();
+			Entries[index + 1] = value.trunc(64).getZExtValue();
+		}
+	};
+
+	static const PowersOf5 &GetPowersOf5() {
+		static PowersOf5 table;
+		return table;
+	}
+
+	struct UInt128 {
+		uint64_t High, Low;
+	};
+
+	inline UInt128 FullMultiply(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+		unsigned __int128 product = (unsigned __int128)a * b;
+		return {uint64_t(product >> 64), uint64_t(product)};
+#else
+		uint64_t aLow = uint32_t(a), aHigh = a >> 32, bLow = uint32_t(b), bHigh = b >> 32;
+		uint64_t lowLow = aLow * bLow, highLow = aHigh * bLow, lowHigh = aLow * bHigh, highHigh = aHigh * bHigh;
+		uint64_t middle = (lowLow >> 32) + uint32_t(highLow) + uint32_t(lowHigh);
+		return {highHigh + (highLow >> 32) + (lowHigh >> 32) + (middle >> 32), (middle << 32) | uint32_t(lowLow)};
+#endif
+	}
+
+	// Correctly rounded w * 10^q, for any 64-bit w
+	static double EiselLemire(uint64_t w, int q) {
+		if (w == 0 || q < s_smallestPowerOf10)
+			return 0.0;
+		if (q > s_largestPowerOf10)
+			return INFINITY;
+
+		const int mantissaBits = 52;
+		const int minimumExponent = -1023;
+
+		int leadingZeros = llvm::countLeadingZeros(w);
+		w <<= leadingZeros;
+
+		// Only needs the second half of the power when the first product is too close to call
+		const uint64_t *power = &GetPowersOf5().Entries[2 * (q - s_smallestPowerOf10)];
+		UInt128 product = FullMultiply(w, power[0]);
+		const uint64_t precisionMask = ~uint64_t(0) >> (mantissaBits + 3);
+		if ((product.High & precisionMask) == precisionMask) {
+			UInt128 second = FullMultiply(w, power[1]);
+			product.Low += second.High;
+			if (second.High > product.Low)
+				product.High++;
+		}
+
+		int upperBit = int(product.High >> 63);
+		int shift = upperBit + 64 - mantissaBits - 3;
+		uint64_t mantissa = product.High >> shift;
+		// floor(log2(10^q)) + 63, exact for the whole exponent range
+		int power2 = (((152170 + 65536) * q) >> 16) + 63 + upperBit - leadingZeros - minimumExponent;
+
+		if (power2 <= 0) {
+			// Subnormal result
+			if (-power2 + 1 >= 64)
+				return 0.0;
+			mantissa >>= -power2 + 1;
+			mantissa += mantissa & 1;
+			mantissa >>= 1;
+			power2 = mantissa < (uint64_t(1) << mantissaBits) ? 0 : 1;
+		} else {
+			// Exact halfway cases round to even. Only possible for small powers of ten
+			if (product.Low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == product.High)
+				mantissa &= ~uint64_t(1);
+
+			mantissa += mantissa & 1;
+			mantissa >>= 1;
+			if (mantissa >= (uint64_t(2) << mantissaBits)) {
+				mantissa = uint64_t(1) << mantissaBits;
+				power2++;
+			}
+
+			mantissa &= ~(uint64_t(1) << mantissaBits);
+			if (power2 >= 0x7FF)
+				return INFINITY;
+		}
+
+		uint64_t bits = mantissa | (uint64_t(power2) << mantissaBits);
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	static double ConvertDecimal(const Mantissa &mantissa, llvm::StringRef text) {
+		if (mantissa.Value == 0)
+			return 0.0;
+
+		// Clinger's fast path: both operands are exact, so the single multiplication
+		// or division rounds correctly
+		if (!mantissa.Truncated && mantissa.Value <= s_maxExactMantissa) {
+			double value = double(mantissa.Value);
+			int exponent = mantissa.Exponent;
+			if (exponent >= 0 && exponent <= s_maxExactPower)
+				return value * s_exactPowersOf10[exponent];
+			if (exponent < 0 && exponent >= -s_maxExactPower)
+				return value / s_exactPowersOf10[-exponent];
+
+			// Moves some of the exponent into the mantissa while it stays exact. ex: 12e30
+			if (exponent > s_maxExactPower) {
+				uint64_t scaled = mantissa.Value;
+				while (exponent > s_maxExactPower && scaled <= s_maxExactMantissa / 10) {
+					scaled *= 10;
+					exponent--;
+				}
+				if (exponent <= s_maxExactPower)
+					return double(scaled) * s_exactPowersOf10[exponent];
+			}
+		}
+
+		if (!mantissa.Truncated)
+			return EiselLemire(mantissa.Value, mantissa.Exponent);
+
+		// Dropped digits put the exact value between w and w + 1. If both round to the same
+		// double, that's the result
+		double lower = EiselLemire(mantissa.Value, mantissa.Exponent);
+		if (lower == EiselLemire(mantissa.Value + 1, mantissa.Exponent))
+			return lower;
+
+		return ConvertWithAPFloat(text);
+	}
+
+	static double ConvertHex(Mantissa mantissa, llvm::StringRef text) {
+		if (mantissa.Value == 0)
+			return 0.0;
+
+		// A sticky bit below the 60 kept bits is enough to round dropped digits correctly
+		if (mantissa.Truncated)
+			mantissa.Value |= 1;
+
+		// Scaling by a power of two is exact unless the result is subnormal, where the
+		// conversion to double would round twice
+		int highestBit = 63 - llvm::countLeadingZeros(mantissa.Value);
+		if (highestBit + mantissa.Exponent > -1022 || mantissa.Value <= s_maxExactMantissa)
+			return std::ldexp(double(mantissa.Value), mantissa.Exponent);
+
+		return ConvertWithAPFloat(text);
+	}
+
+	// Skips whatever is left of a malformed literal, so it becomes a single token
+	static NumberLiteral Malformed(const char *cur, const char *end) {
+		while (cur != end && (IsAlnum(*cur) || *cur == '.'))
+			cur++;
+		return {cur, 0, false};
+	}
+
+	NumberLiteral ParseNumber(const char *cur, const char *end, const Scanner &scanner) {
+		const char *begin = cur;
+		Mantissa mantissa;
+
+		bool isHex = end - cur > 1 && cur[0] == '0' && (cur[1] == 'x' || cur[1] == 'X');
+		if (isHex) {
+			const char *digits = cur + 2;
+			cur = SkipHexDigits(digits, end);
+			AccumulateHex(digits, cur, false, mantissa);
+
+			bool hasDigits = cur != digits;
+			if (cur != end && *cur == '.') {
+				const char *fraction = cur + 1;
+				cur = SkipHexDigits(fraction, end);
+				AccumulateHex(fraction, cur, true, mantissa);
+				hasDigits |= cur != fraction;
+			}
+			if (!hasDigits)
+				return Malformed(cur, end);
+
+			if (cur != end && (*cur == 'p' || *cur == 'P')) {
+				int exponent;
+				if (!(cur = ParseExponent(cur + 1, end, scanner, exponent)))
+					return Malformed(begin, end);
+				mantissa.Exponent += exponent;
+			}
+		} else {
+			cur = scanner.SkipDigits(cur, end);
+			AccumulateDecimal(begin, cur, false, mantissa);
+
+			// A dot must be followed by digits. ex: '1.' is invalid
+			if (cur != end && *cur == '.') {
+				const char *fraction = cur + 1;
+				cur = scanner.SkipDigits(fraction, end);
+				if (cur == fraction)
+					return Malformed(cur, end);
+				AccumulateDecimal(fraction, cur, true, mantissa);
+			}
+
+			if (cur != end && (*cur == 'e' || *cur == 'E')) {
+				int exponent;
+				if (!(cur = ParseExponent(cur + 1, end, scanner, exponent)))
+					return Malformed(begin, end);
+				mantissa.Exponent += exponent;
+			}
+		}
+
+		// Literals can't run into identifiers or other literals. ex: '3.2.333', '12ab'
+		if (cur != end && (IsAlnum(*cur) || *cur == '.'))
+			return Malformed(cur, end);
+
+		llvm::StringRef text(begin, cur - begin);
+		double value = isHex ? ConvertHex(mantissa, text) : ConvertDecimal(mantissa, text);
+		return {cur, value, true};
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Scanner.h"
+
+namespace Lexer {
+
+	struct NumberLiteral {
+		const char *End;	// First char after the literal
+		double Value;
+		bool Valid;			// False for malformed literals, like '1.', '1e' or '0x'
+	};
+
+	// Parses the number literal starting at cur, which must be a digit. Accepts decimal
+	// ('12', '1.5', '1e-9') and hexadecimal ('0xff', '0x1.8p4') forms.
+	//
+	// Reads straight from the source and doesn't depend on the locale. Results are
+	// correctly rounded: small literals are converted with a single exact floating-point
+	// operation, literals with up to 19 significant digits with the Eisel-Lemire algorithm,
+	// and only longer ones that are too close to call go through llvm::APFloat.
+	NumberLiteral ParseNumber(const char *cur, const char *end, const Scanner &scanner);
+}
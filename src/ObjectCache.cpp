@@ -0,0 +1,183 @@
+#include "ObjectCache.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace ObjectCaching {
+
+	static const char *s_uncacheableFlag = "ks.uncacheable";
+
+	void MarkUncacheable(llvm::Module &module) {
+		module.addModuleFlag(llvm::Module::Override, s_uncacheableFlag, 1);
+	}
+
+	// Compilers look modules up before compiling them, and store the object afterwards on the
+	// same thread. Keys of the modules in between are kept, so they're only hashed once
+	class DiskCache::CompilerCache : public llvm::ObjectCache {
+	public:
+		CompilerCache(DiskCache &cache, std::function<std::string()> describeTarget)
+		    : m_cache(cache), m_describeTarget(std::move(describeTarget)) {}
+
+		std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module) override {
+			if (module->getModuleFlag(s_uncacheableFlag))
+				return nullptr;
+
+			std::string key = GetKey(*module);
+			std::unique_ptr<llvm::MemoryBuffer> object = m_cache.Load(key);
+			if (!object) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pendingKeys[module] = std::move(key);
+			}
+			return object;
+		}
+
+		void notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef object) override {
+			if (module->getModuleFlag(s_uncacheableFlag))
+				return;
+
+			std::string key;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto pending = m_pendingKeys.find(module);
+				if (pending != m_pendingKeys.end()) {
+					key = std::move(pending->second);
+					m_pendingKeys.erase(pending);
+				}
+			}
+			if (key.empty())
+				key = GetKey(*module);
+			m_cache.Store(key, object);
+		}
+
+	private:
+		std::string GetKey(const llvm::Module &module) {
+			std::string bitcode;
+			llvm::raw_string_ostream stream(bitcode);
+			llvm::WriteBitcodeToFile(module, stream);
+			stream.flush();
+
+			llvm::MD5 hasher;
+			hasher.update(bitcode);
+			hasher.update(llvm::StringRef("", 1));
+			hasher.update(m_describeTarget());
+			llvm::MD5::MD5Result hash;
+			hasher.final(hash);
+			return hash.digest().str().str();
+		}
+
+		DiskCache &m_cache;
+		std::function<std::string()> m_describeTarget;
+		std::mutex m_mutex;
+		llvm::DenseMap<const llvm::Module *, std::string> m_pendingKeys;
+	};
+
+	DiskCache::DiskCache(std::string directory, uint64_t maxSize) : m_directory(std::move(directory)), m_maxSize(maxSize) {
+		if (std::error_code error = llvm::sys::fs::create_directories(m_directory))
+			fprintf(stderr, ">> ERROR: Could not create object cache '%s': %s\n", m_directory.c_str(), error.message().c_str());
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Evict();
+	}
+
+	std::unique_ptr<llvm::ObjectCache> DiskCache::CreateObjectCache(std::function<std::string()> describeTarget) {
+		return std::make_unique<CompilerCache>(*this, std::move(describeTarget));
+	}
+
+	std::string DiskCache::GetPath(llvm::StringRef key) const {
+		llvm::SmallString<128> path(m_directory);
+		llvm::sys::path::append(path, key + ".o");
+		return path.str().str();
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> DiskCache::Load(llvm::StringRef key) {
+		std::string path = GetPath(key);
+		int fd;
+		if (llvm::sys::fs::openFileForRead(path, fd)) {
+			m_misses++;
+			return nullptr;
+		}
+
+		// Objects are only ever replaced by renaming a complete file over them, so whatever is
+		// read is a whole object. Using it counts as an access for eviction
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> object = llvm::MemoryBuffer::getOpenFile(fd, path, -1);
+		llvm::sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+		llvm::sys::fs::closeFile(fd);
+		if (!object) {
+			m_misses++;
+			return nullptr;
+		}
+
+		m_hits++;
+		return std::move(*object);
+	}
+
+	void DiskCache::Store(llvm::StringRef key, llvm::MemoryBufferRef object) {
+		// Written next to its final name first, so other processes never see part of it
+		llvm::SmallString<128> model(m_directory);
+		llvm::sys::path::append(model, "%%%%%%%%%%%%.tmp");
+		llvm::Expected<llvm::sys::fs::TempFile> file = llvm::sys::fs::TempFile::create(model);
+		if (!file) {
+			llvm::consumeError(file.takeError());
+			return;
+		}
+
+		{
+			llvm::raw_fd_ostream stream(file->FD, false);
+			stream << object.getBuffer();
+		}
+		if (llvm::Error error = file->keep(GetPath(key))) {
+			llvm::consumeError(std::move(error));
+			llvm::consumeError(file->discard());
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_size += object.getBufferSize();
+		if (m_maxSize && m_size > m_maxSize)
+			Evict();
+	}
+
+	void DiskCache::Evict() {
+		struct Entry {
+			std::string Path;
+			uint64_t Size;
+			llvm::sys::TimePoint<> LastUsed;
+		};
+
+		// Other processes may store objects in the same directory, so it's scanned again
+		std::vector<Entry> entries;
+		m_size = 0;
+		std::error_code error;
+		for (llvm::sys::fs::directory_iterator it(m_directory, error), end; it != end && !error; it.increment(error)) {
+			if (llvm::sys::path::extension(it->path()) != ".o")
+				continue;
+
+			llvm::sys::fs::file_status status;
+			if (llvm::sys::fs::status(it->path(), status))
+				continue;
+			entries.push_back({it->path(), status.getSize(), status.getLastModificationTime()});
+			m_size += status.getSize();
+		}
+
+		if (!m_maxSize || m_size <= m_maxSize)
+			return;
+
+		std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.LastUsed < b.LastUsed; });
+		for (const Entry &entry : entries) {
+			if (m_size <= m_maxSize / 4 * 3)
+				break;
+			if (!llvm::sys::fs::remove(entry.Path)) {
+				m_size -= entry.Size;
+				m_evictions++;
+			}
+		}
+	}
+}
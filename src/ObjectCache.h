@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+
+namespace ObjectCaching {
+
+	// Keeps the objects compiled from a module out of caches, for modules whose code refers to
+	// addresses of the running process
+	void MarkUncacheable(llvm::Module &module);
+
+	// Directory of object files compiled by the JIT, named by a hash of the module each was compiled
+	// from and of the target and level it was compiled for. Processes using the same directory share
+	// their objects, so a run of a program compiled before only links them. The directory is kept
+	// under a size limit by deleting the objects used the longest time ago.
+	class DiskCache {
+	public:
+		// Creates the directory if needed. A size of 0 doesn't limit it
+		DiskCache(std::string directory, uint64_t maxSize);
+
+		// Cache for one compiler, which describes the target and level it compiles for when a
+		// module is compiled. Thread-safe, like the directory
+		std::unique_ptr<llvm::ObjectCache> CreateObjectCache(std::function<std::string()> describeTarget);
+
+		unsigned GetHits() const { return m_hits; }
+		unsigned GetMisses() const { return m_misses; }
+		unsigned GetEvictions() const { return m_evictions; }
+
+	private:
+		class CompilerCache;
+
+		std::unique_ptr<llvm::MemoryBuffer> Load(llvm::StringRef key);
+		void Store(llvm::StringRef key, llvm::MemoryBufferRef object);
+		std::string GetPath(llvm::StringRef key) const;
+		// Deletes the least recently used objects until the directory takes three quarters of
+		// the limit, so it isn't scanned again after every object stored
+		void Evict();
+
+		std::string m_directory;
+		uint64_t m_maxSize;
+
+		std::mutex m_mutex;
+		uint64_t m_size = 0; // Of the objects in the directory, as of the last scan and the ones stored since
+
+		std::atomic<unsigned> m_hits{0};
+		std::atomic<unsigned> m_misses{0};
+		std::atomic<unsigned> m_evictions{0};
+	};
+}
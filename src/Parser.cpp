@@ -2,8 +2,14 @@
 
 #include "Lexer.h"
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <unordered_map>
 
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/ThreadPool.h>
+
 // #### Forward declarations
 namespace Parser {
 	int GetTokenPrecedence(int token);
@@ -11,117 +17,190 @@ namespace Parser {
 
 namespace Parser {
 
-#define EXPECT_TOKEN(c, t)                                               \
-	if (s_state.CurrentToken != c) return LogErrorT<t>("Expected " + c); \
+#define EXPECT_TOKEN(c)                                               \
+	if (GetState().CurrentToken != c) return LogError(FormatExpected(c).c_str()); \
 	NextToken();
 
-#define EXPECT_TOKEN_ID(t)                                         \
-	if (s_state.CurrentToken != Lexer::Token_Identifier) return LogErrorT<t>("Expected identifier"); \
+#define EXPECT_TOKEN_ID()                                         \
+	if (GetState().CurrentToken != Lexer::Token_Identifier) return LogError("Expected identifier"); \
 	NextToken();
 
 // Checks current token but doesn't move to next
-#define CHECK_TOKEN(c, t) \
-	if (s_state.CurrentToken != c) return LogErrorT<t>("Expected " + c); \
+#define CHECK_TOKEN(c) \
+	if (GetState().CurrentToken != c) return LogError(FormatExpected(c).c_str()); \
 
-#define CHECK_TOKEN_ID(t) \
-	if (s_state.CurrentToken != Lexer::Token_Identifier) return LogErrorT<t>("Expected identifier"); \
+#define CHECK_TOKEN_ID() \
+	if (GetState().CurrentToken != Lexer::Token_Identifier) return LogError("Expected identifier"); \
 
-	struct State {
-		int CurrentToken;
-	};
+	static thread_local State *s_state = nullptr;
+
+	State *SetState(State *state) {
+		State *previous = s_state;
+		s_state = state;
+		return previous;
+	}
 
-	static State s_state;
+	State &GetState() {
+		assert(s_state && "No parser state bound to this thread");
+		return *s_state;
+	}
+
+	template <typename T>
+	NodeId Add(const T &node) {
+		return GetState().Context->Add(node);
+	}
 
 	int NextToken() {
-		s_state.CurrentToken = Lexer::GetToken();
-		return s_state.CurrentToken;
+		State &state = GetState();
+		state.CurrentToken = state.Next < state.End ? state.Tokens->Kinds[state.Next++] : int(Lexer::Token_EndOfFile);
+		return state.CurrentToken;
 	}
 
-	TranslationUnitASTPtr GenerateAST() {
-		fprintf(stderr, ">> INFO: Generating AST:\n");
+	// Returns the token 'depth' positions after the current one, without consuming it
+	int PeekToken(int depth = 1) {
+		State &state = GetState();
+		size_t index = state.Next - 1 + depth;
+		return index < state.End ? state.Tokens->Kinds[index] : int(Lexer::Token_EndOfFile);
+	}
+
+	Symbols::Symbol GetSymbol() {
+		State &state = GetState();
+		return state.Tokens->Values[state.Next - 1].Symbol;
+	}
 
+	double GetNumberValue() {
+		State &state = GetState();
+		return state.Tokens->Values[state.Next - 1].Number;
+	}
+
+	// Parses top-level items until the end of the bound token range
+	bool ParseTopLevelItems(std::vector<NodeId> &prototypes, std::vector<NodeId> &functions) {
 		NextToken();
 
-		std::vector<PrototypeASTPtr> m_prototypes;
-		std::vector<FunctionDeclPtr> m_functions;
 		while (true) {
-			switch (s_state.CurrentToken) {
+			switch (GetState().CurrentToken) {
 				case ';': // skips
 					NextToken();
 					break;
-				case Lexer::Token_EndOfFile: {
-					std::unique_ptr<TranslationUnitDecl> unit =
-					    std::make_unique<TranslationUnitDecl>("main", std::move(m_prototypes), std::move(m_functions));
-					unit->Dump();
-					return std::move(unit);
-				}
+				case Lexer::Token_EndOfFile:
+					return true;
 				case Lexer::Token_Extern:
 					if (auto externExpr = ParseExtern()) {
-						m_prototypes.push_back(std::move(externExpr));
+						prototypes.push_back(externExpr);
 						break;
 					}
-					return nullptr;
+					return false;
 				case Lexer::Token_Definition:
 					if (auto definitionExpr = ParseDefinition()) {
-						m_functions.push_back(std::move(definitionExpr));
+						functions.push_back(definitionExpr);
 						break;
 					}
-					return nullptr;
+					return false;
 				default:
 					if (auto topLevelExpr = ParseTopLevelExpr()) {
-						m_functions.push_back(std::move(topLevelExpr));
+						functions.push_back(topLevelExpr);
 						break;
 					}
-					return nullptr;
+					return false;
 			}
 		}
+	}
 
-		return nullptr;
+	TranslationUnitASTPtr GenerateASTParallel(llvm::ThreadPool &pool, const Lexer::TokenBuffer &tokens, llvm::ArrayRef<TokenRange> items);
+
+	// Inputs with fewer tokens are parsed serially, as splitting them isn't worth it
+	static const size_t s_minParallelTokens = 1 << 16;
+
+	static size_t CountTokens(llvm::ArrayRef<TokenRange> items) {
+		size_t count = 0;
+		for (const TokenRange &item : items)
+			count += item.End - item.Begin;
+		return count;
+	}
+
+	TranslationUnitASTPtr GenerateAST(llvm::ThreadPool *pool) {
+		const Lexer::TokenBuffer &tokens = Lexer::GetTokens();
+		if (pool && pool->getThreadCount() > 1 && tokens.Size() >= s_minParallelTokens) {
+			std::vector<TokenRange> items = SplitTopLevelItems(tokens);
+			if (items.size() > 1)
+				return GenerateASTParallel(*pool, tokens, items);
+		}
+
+		// Roughly one node every two tokens
+		ASTContext context;
+		context.Reserve(tokens.Size() / 2);
+
+		State &state = GetState();
+		state.Tokens = &tokens;
+		state.Next = 0;
+		state.End = tokens.Size() - 1; // the last token is always EndOfFile
+		state.Context = &context;
+
+		std::vector<NodeId> m_prototypes;
+		std::vector<NodeId> m_functions;
+		bool valid = ParseTopLevelItems(m_prototypes, m_functions);
+		state.Context = nullptr;
+
+		if (!valid)
+			return nullptr;
+		return std::make_unique<TranslationUnitDecl>("main", std::move(context), std::move(m_prototypes), std::move(m_functions));
 	}
 
 	// Assumes it's only called when current token is a number
-	NumberASTPtr ParseNumberExpr() {
-		auto result = std::make_unique<NumberExpr>(Lexer::GetNumberValue());
+	NodeId ParseNumberExpr() {
+		NodeId result = Add(NumberExpr{GetNumberValue()});
 		NextToken();
-		return std::move(result);
+		return result;
 	}
 
 	// variable ::= <identifier>
 	// function call ::= <identifier>()
-	ExprPtr ParseIdentifierExpr() {
-		std::string identifier = Lexer::GetIdentifier();
+	// array element ::= <identifier>[<expr>]
+	NodeId ParseIdentifierExpr() {
+		Symbols::Symbol identifier = GetSymbol();
 		NextToken();
 
 		// function call
-		if (s_state.CurrentToken == '(') {
+		if (GetState().CurrentToken == '(') {
 			NextToken();
 
-			std::vector<ExprPtr> args;
-			while (s_state.CurrentToken != ')' && s_state.CurrentToken != ',') {
+			llvm::SmallVector<NodeId, 8> args;
+			while (GetState().CurrentToken != ')' && GetState().CurrentToken != ',') {
 				if (auto arg = ParseExpr()) {
-					args.push_back(std::move(arg));
+					args.push_back(arg);
 				}
 				else {
 					return LogError("Expected function arguments");
 				}
 
-				if (s_state.CurrentToken == ')')
+				if (GetState().CurrentToken == ')')
 					break;
 
-				EXPECT_TOKEN(',', Expr);
+				EXPECT_TOKEN(',');
 			}
 
-			EXPECT_TOKEN(')', Expr);
-			return std::make_unique<CallExpr>(identifier, std::move(args));
+			EXPECT_TOKEN(')');
+			return Add(CallExpr{identifier, args});
+		}
+		// array element
+		else if (GetState().CurrentToken == '[') {
+			NextToken();
+
+			NodeId index = ParseExpr();
+			if (!index)
+				return LogError("Expected array index");
+
+			EXPECT_TOKEN(']');
+			return Add(IndexExpr{identifier, index});
 		}
 		// variable
 		else {
-			return std::make_unique<VariableExpr>(identifier);
+			return Add(VariableExpr{identifier});
 		}
 	}
 
-	ExprPtr ParsePrimary() {
-		switch (s_state.CurrentToken) {
+	NodeId ParsePrimary() {
+		switch (GetState().CurrentToken) {
 			case Lexer::Token_Number:
 				return ParseNumberExpr();
 			case Lexer::Token_Identifier:
@@ -133,46 +212,53 @@ namespace Parser {
 			case ')':
 			case ';':
 			case Lexer::Token_EndOfFile:
+			// Ends a run of top-level statements
+			case Lexer::Token_Definition:
+			case Lexer::Token_Extern:
 				return nullptr;
 			default:
 				return LogError("Unknown expression format");
 		}
 	}
 
-	ExprPtr ParseExpr() {
+	NodeId ParseExpr() {
 		if (auto lhs = ParsePrimary())
-			return ParseBinOpRHS(0, std::move(lhs));
+			return ParseBinOpRHS(0, lhs);
 		return nullptr;
 	}
 
 	// Based on pseudocode from: https://en.wikipedia.org/wiki/Operator-precedence_parser
-	ExprPtr ParseBinOpRHS(int minPrecedence, ExprPtr lhs) {
-		int lookahead = s_state.CurrentToken;
+	NodeId ParseBinOpRHS(int minPrecedence, NodeId lhs) {
+		int lookahead = GetState().CurrentToken;
 		while (GetTokenPrecedence(lookahead) >= minPrecedence) {
 			int op = lookahead;
 			NextToken();
 
-			auto rhs = ParsePrimary();
+			NodeId rhs = ParsePrimary();
+			if (!rhs)
+				return nullptr;
 
-			lookahead = s_state.CurrentToken;
+			lookahead = GetState().CurrentToken;
 			int opPrecedence = GetTokenPrecedence(op);
 			while (GetTokenPrecedence(lookahead) > opPrecedence) {
-				rhs = ParseBinOpRHS(opPrecedence + 1, std::move(rhs));
-				lookahead = Lexer::PeekToken();
+				rhs = ParseBinOpRHS(opPrecedence + 1, rhs);
+				if (!rhs)
+					return nullptr;
+				lookahead = GetState().CurrentToken;
 			}
 
-			lhs = std::make_unique<BinaryExpr>(op, std::move(lhs), std::move(rhs));
+			lhs = Add(BinaryExpr{char(op), lhs, rhs});
 		}
 
-		return std::move(lhs);
+		return lhs;
 	}
 
 	// Builds expressions between parenthesis. Note that the parenthesis are
 	// never added to the AST, they simply provide grouping.
-	ExprPtr ParseParenthesisExpr() {
+	NodeId ParseParenthesisExpr() {
 		NextToken(); // consumes (
 		if (auto v = ParseExpr()) {
-			if (s_state.CurrentToken == ')') {
+			if (GetState().CurrentToken == ')') {
 				NextToken(); // consumes )
 				return v;
 			}
@@ -183,23 +269,28 @@ namespace Parser {
 	}
 
 	// Top-level expressions are represented as anonymous functions
-	FunctionDeclPtr ParseTopLevelExpr() {
+	NodeId ParseTopLevelExpr() {
 		if (auto compoundStmt = ParseStmts()) {
-			auto anonProto = std::make_unique<PrototypeDecl>(ANON_EXPR_NAME, std::vector<std::string>());
-			return std::make_unique<FunctionDecl>(std::move(anonProto), std::move(compoundStmt));
+			// Nothing was consumed, so parsing would never move past the current token
+			if (GetState().Context->Get<CompoundStmt>(compoundStmt).Statements.empty())
+				return LogError("Expected top-level expression");
+
+			NodeId anonProto = Add(PrototypeDecl{Symbols::Intern(ANON_EXPR_NAME), {}});
+			return Add(FunctionDecl{anonProto, compoundStmt});
 		}
 
 		return nullptr;
 	}
 
-	StmtPtr ParseAssignOrExpr() {
-		if (Lexer::PeekToken() == '=')
+	NodeId ParseAssignOrExpr() {
+		// Array elements are only known to be assigned once their index is parsed
+		if (PeekToken() == '=' || PeekToken() == '[')
 			return ParseAssignStmt();
 		return ExpectSemicolon(ParseExpr);
 	}
 
-	StmtPtr ParseStmt() {
-		switch (s_state.CurrentToken) {
+	NodeId ParseStmt() {
+		switch (GetState().CurrentToken) {
 			case Lexer::Token_Return:
 				return ParseReturnStmt();
 			case Lexer::Token_If:
@@ -213,173 +304,403 @@ namespace Parser {
 		}
 	}
 
-	CompoundStmtPtr ParseStmts() {
-		std::vector<StmtPtr> statements;
+	NodeId ParseStmts() {
+		llvm::SmallVector<NodeId, 16> statements;
 		while (auto expr = ParseStmt()) {
-			statements.push_back(std::move(expr));
+			statements.push_back(expr);
 		}
 
-		return std::make_unique<CompoundStmt>(std::move(statements));
+		return Add(CompoundStmt{statements});
 	}
 
-	AssignStmtPtr ParseAssignStmt() {
-		std::vector<VariableExprPtr> lhsIDs;
-		while (s_state.CurrentToken == Lexer::Token_Identifier && Lexer::PeekToken() == '=') {
-			lhsIDs.push_back(std::make_unique<VariableExpr>(Lexer::GetIdentifier()));
-			NextToken();		// id
+	// Also parses statements that start with an array element but aren't assignments, which
+	// are expressions
+	NodeId ParseAssignStmt() {
+		llvm::SmallVector<NodeId, 4> lhsIDs;
+		NodeId element = nullptr;
+		while (GetState().CurrentToken == Lexer::Token_Identifier) {
+			if (PeekToken() == '=') {
+				lhsIDs.push_back(Add(VariableExpr{GetSymbol()}));
+				NextToken();		// id
+				NextToken();		// =
+				continue;
+			}
+
+			if (PeekToken() != '[')
+				break;
+
+			element = ParseIdentifierExpr();
+			if (!element)
+				return nullptr;
+			if (GetState().CurrentToken != '=')
+				break;
+
+			lhsIDs.push_back(element);
+			element = nullptr;
 			NextToken();		// =
 		}
 
-		if (lhsIDs.size() == 0) return LogErrorT<AssignStmt>("Expected lvalue");
+		// The element starts the expression
+		NodeId expr = nullptr;
+		if (element) {
+			expr = ExpectSemicolon([element] { return ParseBinOpRHS(0, element); });
+			if (expr && lhsIDs.empty())
+				return expr;
+		} else if (lhsIDs.empty()) {
+			return LogError("Expected lvalue");
+		} else {
+			expr = ExpectSemicolon(ParseExpr);
+		}
 
-		if (auto expr = ExpectSemicolon(ParseExpr)) {
-			return std::make_unique<AssignStmt>(std::move(lhsIDs), std::move(expr));
+		if (expr) {
+			return Add(AssignStmt{lhsIDs, expr});
 		}
 
-		return LogErrorT<AssignStmt>("Expected expression");
+		return LogError("Expected expression");
 	}
 
-	IfStmtPtr ParseIfStmtSingle() {
+	// Parses 'if (<cond>) { <stmts> }' without creating the IfStmt, whose else branch isn't known yet
+	bool ParseIfBranch(NodeId &cond, NodeId &body) {
 		NextToken(); // consumes if
 
-		if (auto cond = ParseExpr()) {
-			if (auto compoundStmt = ExpectSurrounded('{', ParseStmts, '}')) {
-				return std::make_unique<IfStmt>(std::move(cond), std::move(compoundStmt));
-			}
-		}
-
-		return nullptr;
+		cond = ParseExpr();
+		body = cond ? ExpectSurrounded('{', ParseStmts, '}') : nullptr;
+		return bool(body);
 	}
 
 	// Parses if/if else/else statements. 'Else if' statements are a special
 	// case of 'else' where the entire block is surrounded by an if statement.
-	IfStmtPtr ParseIfStmt() {
-		if (IfStmtPtr parentIf = ParseIfStmtSingle()) {
+	// The chain is built from the last branch up, so every IfStmt is added after its else.
+	NodeId ParseIfStmt() {
+		llvm::SmallVector<std::pair<NodeId, NodeId>, 4> branches;
+		NodeId elseStmt = nullptr;
 
-			IfStmt *lastIf = parentIf.get();
-			while (s_state.CurrentToken == Lexer::Token_Else) {
-				NextToken();
+		NodeId cond, body;
+		if (!ParseIfBranch(cond, body))
+			return nullptr;
+		branches.push_back({cond, body});
 
-				// appends else statement to the last parsed if
-				if (s_state.CurrentToken == Lexer::Token_If) {
-					if (auto elseifStmt = ParseIfStmtSingle()) {
-						IfStmt *elseIfPtr = elseifStmt.get();
-						lastIf->SetElse(std::move(elseifStmt));
-						lastIf = elseIfPtr;
-						continue;	// checks for more else if/else statements
-					}
-				}
-				if (auto elseStmt = ExpectSurrounded('{', ParseStmts, '}')) {
-					lastIf->SetElse(std::move(elseStmt));
-					break;			// there should be no more else if/else
-				}
+		while (GetState().CurrentToken == Lexer::Token_Else) {
+			NextToken();
 
-				return nullptr;
+			// appends else if statement to the chain
+			if (GetState().CurrentToken == Lexer::Token_If) {
+				if (ParseIfBranch(cond, body)) {
+					branches.push_back({cond, body});
+					continue;	// checks for more else if/else statements
+				}
 			}
+			if ((elseStmt = ExpectSurrounded('{', ParseStmts, '}')))
+				break;			// there should be no more else if/else
 
-			return std::move(parentIf);
+			return nullptr;
 		}
 
-		return nullptr;
+		for (auto branch = branches.rbegin(); branch != branches.rend(); ++branch)
+			elseStmt = Add(IfStmt{branch->first, branch->second, elseStmt});
+		return elseStmt;
 	}
 
-	ReturnStmtPtr ParseReturnStmt() {
+	NodeId ParseReturnStmt() {
 		NextToken();
 
 		if (auto returnExpr = ExpectSemicolon(ParseExpr)) {
-			return std::make_unique<ReturnStmt>(std::move(returnExpr));
+			return Add(ReturnStmt{returnExpr});
 		}
 
 		return nullptr;
 	}
 
-	ForStmtPtr ParseForStmt() {
+	NodeId ParseForStmt() {
 		NextToken();
 
-		EXPECT_TOKEN('(', ForStmt);
-		CHECK_TOKEN_ID(ForStmt);
-		std::string loopVarId = Lexer::GetIdentifier();
+		EXPECT_TOKEN('(');
+		CHECK_TOKEN_ID();
+		Symbols::Symbol loopVarId = GetSymbol();
 		NextToken();
-		EXPECT_TOKEN('=', ForStmt);
+		EXPECT_TOKEN('=');
 
-		ExprPtr valueExpr, condExpr, stepExpr;
+		NodeId valueExpr, condExpr, stepExpr;
 		if ((valueExpr = ExpectSemicolon(ParseExpr)),
 			(condExpr = ExpectSemicolon(ParseExpr)),
 		    (stepExpr = ParseExpr())) {
 
-			EXPECT_TOKEN(')', ForStmt);
+			EXPECT_TOKEN(')');
 			
 			if (auto forBody = ExpectSurrounded('{', ParseStmts, '}')) {
-				return std::make_unique<ForStmt>(loopVarId, std::move(valueExpr), std::move(condExpr), std::move(stepExpr), std::move(forBody));
+				return Add(ForStmt{loopVarId, valueExpr, condExpr, stepExpr, forBody});
 			}
 		}
 
 		return nullptr;
 	}
 
-	PrototypeASTPtr ParseExtern() {
+	NodeId ParseExtern() {
 		NextToken();
 
-		if (auto proto = ExpectSemicolon(ParsePrototype)) {
+		if (auto proto = ExpectSemicolon([] { return ParsePrototype(false); })) {
 			return proto;
 		}
 		return nullptr;
 	}
 
-	// prototype ::= <identifier>(<args>)
+	// prototype ::= <identifier>(<args>) [<mode>]
 	// args ::= <id>, ...
-	PrototypeASTPtr ParsePrototype() {
-		if (s_state.CurrentToken != Lexer::Token_Identifier)
-			return LogErrorT<PrototypeDecl>("Expected function identifier");
+	// Definitions may name the floating-point mode of their code after the parameters
+	NodeId ParsePrototype(bool isDefinition) {
+		if (GetState().CurrentToken != Lexer::Token_Identifier)
+			return LogError("Expected function identifier");
 
 		// Parses prototype identifier
-		std::string funcIdentifier = Lexer::GetIdentifier();
+		Symbols::Symbol funcIdentifier = GetSymbol();
 		NextToken();
 
 		// Parses prototype parameter list
-		std::vector<std::string> params;
+		llvm::SmallVector<Symbols::Symbol, 8> params;
+		uint32_t arrayParams = 0;
 		while (NextToken() != ')') {
-			CHECK_TOKEN_ID(PrototypeDecl);
-			params.push_back(Lexer::GetIdentifier());
+			CHECK_TOKEN_ID();
+			params.push_back(GetSymbol());
 			NextToken();
 
-			if (s_state.CurrentToken == ')') {
+			// Array parameters are marked with '[]'
+			if (GetState().CurrentToken == '[') {
+				NextToken();
+				CHECK_TOKEN(']');
+				NextToken();
+
+				if (params.size() > 32)
+					return LogError("Only the first 32 parameters can be arrays");
+				arrayParams |= 1u << (params.size() - 1);
+			}
+
+			if (GetState().CurrentToken == ')') {
 				break;
 			}
 
-			CHECK_TOKEN(',', PrototypeDecl);
+			CHECK_TOKEN(',');
+		}
+		EXPECT_TOKEN(')');
+
+		FPMode mode = FPMode::Default;
+		if (isDefinition && GetState().CurrentToken == Lexer::Token_Identifier) {
+			static const Symbols::Symbol modeNames[] = {Symbols::Intern("strict"), Symbols::Intern("contract"), Symbols::Intern("fast")};
+			const Symbols::Symbol *found = std::find(std::begin(modeNames), std::end(modeNames), GetSymbol());
+			if (found == std::end(modeNames))
+				return LogError("Expected floating-point mode 'strict', 'contract' or 'fast'");
+
+			mode = FPMode(uint8_t(FPMode::Strict) + (found - modeNames));
+			NextToken();
 		}
-		EXPECT_TOKEN(')', PrototypeDecl);
 
-		return std::make_unique<PrototypeDecl>(funcIdentifier, std::move(params));
+		return Add(PrototypeDecl{funcIdentifier, params, arrayParams, mode});
 	}
 
-	FunctionDeclPtr ParseDefinition() {
+	NodeId ParseDefinition() {
 		NextToken();
-		if (auto prototype = ParsePrototype()) {
+		if (auto prototype = ParsePrototype(true)) {
 			if (auto compoundStmt = ExpectSurrounded('{', ParseStmts, '}')) {
-				return std::make_unique<FunctionDecl>(std::move(prototype), std::move(compoundStmt));
+				return Add(FunctionDecl{prototype, compoundStmt});
 			}
 		}
 		return nullptr;
 	}
 
-	ExprPtr LogError(const char *msg) {
+	NodeId LogError(const char *msg) {
 		fprintf(stderr, ">> ERROR: %s\n", msg);
 		return nullptr;
 	}
 
 }
 
+// #### Parallel parsing
+namespace Parser {
+
+	// A new item starts at every 'fn' or 'extern' outside of braces and parentheses. Functions
+	// end with the brace closing their body and externs with their semicolon, so each item
+	// holds a single declaration. Runs of top-level statements stay in one item, since the
+	// parser turns them into a single anonymous function.
+	std::vector<TokenRange> SplitTopLevelItems(const Lexer::TokenBuffer &tokens) {
+		std::vector<TokenRange> items;
+		size_t end = tokens.Size() - 1; // skips EndOfFile
+		size_t i = 0;
+		while (i < end) {
+			int itemKind = tokens.Kinds[i];
+			// Separators between items don't belong to any of them
+			if (itemKind == ';') {
+				i++;
+				continue;
+			}
+
+			size_t begin = i++;
+			int depth = 0;
+			for (; i < end; i++) {
+				int kind = tokens.Kinds[i];
+				if (kind == '{' || kind == '(') {
+					depth++;
+				} else if (kind == '}' || kind == ')') {
+					// Unbalanced sources are reported by the parser, splitting just carries on
+					depth = depth > 0 ? depth - 1 : 0;
+					if (depth == 0 && kind == '}' && itemKind == Lexer::Token_Definition) {
+						i++;
+						break;
+					}
+				} else if (depth == 0) {
+					if (kind == Lexer::Token_Definition || kind == Lexer::Token_Extern)
+						break;
+					if (kind == ';' && itemKind == Lexer::Token_Extern) {
+						i++;
+						break;
+					}
+				}
+			}
+
+			items.push_back({begin, i});
+		}
+
+		return items;
+	}
+
+	// AST of consecutive top-level items, parsed by a single worker
+	struct Fragment {
+		ASTContext Context;
+		std::vector<NodeId> Prototypes;
+		std::vector<NodeId> Functions;
+		bool Valid = true;
+	};
+
+	void ParseFragment(const Lexer::TokenBuffer &tokens, llvm::ArrayRef<TokenRange> items, Fragment &fragment) {
+		State state;
+		state.Tokens = &tokens;
+		state.Context = &fragment.Context;
+		State *previous = SetState(&state);
+
+		fragment.Context.Reserve((items.back().End - items.front().Begin) / 2);
+		for (const TokenRange &item : items) {
+			state.Next = item.Begin;
+			state.End = item.End;
+			if (!ParseTopLevelItems(fragment.Prototypes, fragment.Functions)) {
+				fragment.Valid = false;
+				break;
+			}
+		}
+
+		SetState(previous);
+	}
+
+	// Parses batches of items on the pool and merges their fragments in source order, so the
+	// result is the same as parsing serially
+	TranslationUnitASTPtr GenerateASTParallel(llvm::ThreadPool &pool, const Lexer::TokenBuffer &tokens, llvm::ArrayRef<TokenRange> items) {
+		// A few batches per thread balance the load, as item sizes vary a lot
+		size_t batchTokens = std::max<size_t>(CountTokens(items) / (pool.getThreadCount() * 4), 4096);
+
+		std::vector<llvm::ArrayRef<TokenRange>> batches;
+		size_t batchBegin = 0, batchSize = 0;
+		for (size_t i = 0; i < items.size(); i++) {
+			batchSize += items[i].End - items[i].Begin;
+			if (batchSize >= batchTokens || i + 1 == items.size()) {
+				batches.push_back(items.slice(batchBegin, i + 1 - batchBegin));
+				batchBegin = i + 1;
+				batchSize = 0;
+			}
+		}
+
+		std::vector<Fragment> fragments(batches.size());
+		std::vector<std::shared_future<void>> tasks;
+		for (size_t i = 0; i < batches.size(); i++)
+			tasks.push_back(pool.async([&, i] { ParseFragment(tokens, batches[i], fragments[i]); }));
+		for (auto &task : tasks)
+			task.wait();
+
+		ASTContext context;
+		size_t nodeCount = 0;
+		for (const Fragment &fragment : fragments) {
+			if (!fragment.Valid)
+				return nullptr;
+			nodeCount += fragment.Context.GetNodeCount();
+		}
+		context.Reserve(nodeCount);
+
+		std::vector<NodeId> prototypes;
+		std::vector<NodeId> functions;
+		for (const Fragment &fragment : fragments) {
+			uint32_t offset = context.Append(fragment.Context);
+			for (NodeId proto : fragment.Prototypes)
+				prototypes.push_back(NodeId(proto.GetIndex() + offset));
+			for (NodeId func : fragment.Functions)
+				functions.push_back(NodeId(func.GetIndex() + offset));
+		}
+
+		return std::make_unique<TranslationUnitDecl>("main", std::move(context), std::move(prototypes), std::move(functions));
+	}
+
+	TranslationUnitASTPtr GenerateAST(llvm::ArrayRef<TokenRange> items, llvm::ThreadPool *pool) {
+		const Lexer::TokenBuffer &tokens = Lexer::GetTokens();
+		if (pool && pool->getThreadCount() > 1 && items.size() > 1 && CountTokens(items) >= s_minParallelTokens)
+			return GenerateASTParallel(*pool, tokens, items);
+
+		Fragment fragment;
+		if (!items.empty())
+			ParseFragment(tokens, items, fragment);
+		if (!fragment.Valid)
+			return nullptr;
+		return std::make_unique<TranslationUnitDecl>("main", std::move(fragment.Context), std::move(fragment.Prototypes), std::move(fragment.Functions));
+	}
+}
+
+// #### Benchmark
+namespace Parser {
+
+	using BenchClock = std::chrono::steady_clock;
+
+	static double ElapsedSeconds(BenchClock::time_point start) {
+		return std::chrono::duration<double>(BenchClock::now() - start).count();
+	}
+
+	void RunBenchmark(llvm::ThreadPool &pool, int iterations) {
+		const Lexer::TokenBuffer &tokens = Lexer::GetTokens();
+		std::vector<TokenRange> items = SplitTopLevelItems(tokens);
+
+		size_t nodeCount = 0;
+		auto start = BenchClock::now();
+		for (int i = 0; i < iterations; i++) {
+			if (TranslationUnitASTPtr unit = GenerateAST())
+				nodeCount = unit->GetContext().GetNodeCount();
+		}
+		double serialTime = ElapsedSeconds(start);
+
+		start = BenchClock::now();
+		for (int i = 0; i < iterations; i++)
+			SplitTopLevelItems(tokens);
+		double splitTime = ElapsedSeconds(start);
+
+		start = BenchClock::now();
+		for (int i = 0; i < iterations; i++)
+			GenerateASTParallel(pool, tokens, SplitTopLevelItems(tokens));
+		double parallelTime = ElapsedSeconds(start);
+
+		fprintf(stderr, ">> BENCH: %zu tokens, %zu top-level items, %zu nodes, %d iterations\n", tokens.Size(), items.size(), nodeCount, iterations);
+		fprintf(stderr, ">> BENCH: pre-scan: %12.0f tokens/sec\n", tokens.Size() * iterations / splitTime);
+		fprintf(stderr, ">> BENCH: serial parse: %12.0f tokens/sec\n", tokens.Size() * iterations / serialTime);
+		fprintf(stderr, ">> BENCH: parallel parse (%u threads): %12.0f tokens/sec, %.2fx\n", pool.getThreadCount(),
+		        tokens.Size() * iterations / parallelTime, serialTime / parallelTime);
+	}
+}
+
 // #### Operator-precedence parsing helpers
 namespace Parser {
-	static std::unordered_map<int, int> s_precedenceTable{
+	static const std::unordered_map<int, int> s_precedenceTable{
 	    {'<', 10}, { '>', 10 }, {'+', 20}, {'-', 30}, {'*', 40}, {'/', 50}};
 
+	// Read-only lookup, so sessions on different threads can share the table
 	int GetTokenPrecedence(int token) {
-		if (!__isascii(token) || s_precedenceTable[token] <= 0)
+		if (!__isascii(token))
+			return -1;
+
+		auto it = s_precedenceTable.find(token);
+		if (it == s_precedenceTable.end() || it->second <= 0)
 			return -1;
 
-		return s_precedenceTable[token];
+		return it->second;
 	}
 }
\ No newline at end of file
@@ -1,61 +1,115 @@
 #pragma once
 
 #include "AST.h"
+#include "Lexer.h"
+
+namespace llvm {
+	class ThreadPool;
+}
 
 namespace Parser {
 
-	TranslationUnitASTPtr GenerateAST();
+	// Parser state of a compilation, bound to the calling thread like the lexer state.
+	// Parallel parsing gives each worker its own state over a part of the same tokens.
+	struct State {
+		// Tokens [Next, End) are left to parse. End acts as the end of file
+		const Lexer::TokenBuffer *Tokens = nullptr;
+		size_t Next = 0;
+		size_t End = 0;
+
+		int CurrentToken = 0;
+		ASTContext *Context = nullptr; // Node pool of the translation unit being parsed
+	};
+
+	// See Lexer::SetState
+	State *SetState(State *state);
+	State &GetState();
+
+	int NextToken();
+
+	// Parses the tokens of the lexer state bound to the calling thread. With a thread pool,
+	// large inputs are split into top-level items that are parsed in parallel.
+	TranslationUnitASTPtr GenerateAST(llvm::ThreadPool *pool = nullptr);
+
+	// Tokens [Begin, End) of a top-level item: a function, an extern or a run of top-level
+	// statements, which the parser turns into a single anonymous function
+	struct TokenRange {
+		size_t Begin, End;
+	};
+
+	// Splits the tokens into top-level items with a single pass over token kinds
+	std::vector<TokenRange> SplitTopLevelItems(const Lexer::TokenBuffer &tokens);
+
+	// Parses the given items of the bound token buffer only. Each item adds one declaration,
+	// externs to the prototypes and everything else to the functions of the result
+	TranslationUnitASTPtr GenerateAST(llvm::ArrayRef<TokenRange> items, llvm::ThreadPool *pool = nullptr);
+
+	// Prints parsing throughput of the serial parser against the parallel one
+	void RunBenchmark(llvm::ThreadPool &pool, int iterations);
 
 	// #### AST parsers
-	NumberASTPtr ParseNumberExpr();
-	ExprPtr ParseIdentifierExpr();
-
-	ExprPtr ParsePrimary();
-	ExprPtr ParseExpr();
-	ExprPtr ParseParenthesisExpr();
-	ExprPtr ParseBinOpRHS(int minPrecedence, ExprPtr lhs);
-	FunctionDeclPtr ParseTopLevelExpr();
-
-	StmtPtr ParseStmt();
-	CompoundStmtPtr ParseStmts();
-	AssignStmtPtr ParseAssignStmt();
-	IfStmtPtr ParseIfStmt();
-	ReturnStmtPtr ParseReturnStmt();
-	ForStmtPtr ParseForStmt();
-
-	PrototypeASTPtr ParseExtern();
-	PrototypeASTPtr ParsePrototype();
-	FunctionDeclPtr ParseDefinition();
+	// Each parser returns the id of the node it added, or nullptr on errors
+	NodeId ParseNumberExpr();
+	NodeId ParseIdentifierExpr();
+
+	NodeId ParsePrimary();
+	NodeId ParseExpr();
+	NodeId ParseParenthesisExpr();
+	NodeId ParseBinOpRHS(int minPrecedence, NodeId lhs);
+	NodeId ParseTopLevelExpr();
+
+	NodeId ParseStmt();
+	NodeId ParseStmts();
+	NodeId ParseAssignStmt();
+	NodeId ParseIfStmt();
+	NodeId ParseReturnStmt();
+	NodeId ParseForStmt();
+
+	NodeId ParseExtern();
+	NodeId ParsePrototype(bool isDefinition);
+	NodeId ParseDefinition();
 
 	// #### Helpers
+	NodeId LogError(const char *msg);
+
+	// Message for a missing punctuation token, like "Expected ')'"
+	inline std::string FormatExpected(char token) {
+		return std::string("Expected '") + token + "'";
+	}
+
+	template <typename T>
+	T LogErrorPtr(const char *msg) {
+		fprintf(stderr, ">> ERROR: %s\n", msg);
+		return nullptr;
+	}
 
 	template <typename Func, typename R = std::result_of_t<Func && ()>>
 	R ExpectSurrounded(char a, Func func, char b) {
-		if (s_state.CurrentToken == a) {
+		if (GetState().CurrentToken == a) {
 			NextToken();
 
 			if (auto result = func()) {
-				if (s_state.CurrentToken == b) {
+				if (GetState().CurrentToken == b) {
 					NextToken();
-					return std::move(result);
+					return result;
 				}
 
-				return LogErrorPtr<R>("Expected " + b);
+				return LogErrorPtr<R>(FormatExpected(b).c_str());
 			}
 		}
 
-		return LogErrorPtr<R>("Expected " + a);
+		return LogErrorPtr<R>(FormatExpected(a).c_str());
 	}
 
 	template <typename Func, typename R = std::result_of_t<Func && ()>>
 	R ExpectTrailing(Func func, char s) {
 		if (auto result = func()) {
-			if (s_state.CurrentToken == s) {
+			if (GetState().CurrentToken == s) {
 				NextToken();
-				return std::move(result);
+				return result;
 			}
 
-			return LogErrorPtr<R>("Expected " + s);
+			return LogErrorPtr<R>(FormatExpected(s).c_str());
 		}
 
 		return nullptr;
@@ -65,19 +119,4 @@ namespace Parser {
 	R ExpectSemicolon(Func func) {
 		return ExpectTrailing(func, ';');
 	}
-
-	ExprPtr LogError(const char *msg);
-
-	template <typename T>
-	std::unique_ptr<T> LogErrorT(const char *msg) {
-		fprintf(stderr, ">> ERROR: %s\n", msg);
-		return nullptr;
-	}
-
-	template <typename T>
-	T LogErrorPtr(const char *msg) {
-		fprintf(stderr, ">> ERROR: %s\n", msg);
-		return nullptr;
-	}
-
 }
\ No newline at end of file
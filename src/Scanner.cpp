@@ -0,0 +1,221 @@
+#include "Scanner.h"
+
+#include <initializer_list>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MathExtras.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KALEIDOSCOPE_X86 1
+#include <immintrin.h>
+#else
+#define KALEIDOSCOPE_X86 0
+#endif
+
+// GCC and Clang only emit vector instructions for functions that enable the target, while
+// MSVC accepts the intrinsics anywhere. Callers must check the CPU supports them first.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+namespace Lexer {
+
+	// Built at compile time, so it is ready before any static initializer runs
+	const CharClassTable g_charClasses;
+}
+
+// #### Scalar scanner
+namespace Lexer {
+
+	template <uint8_t Classes, bool Match>
+	static const char *SkipScalar(const char *cur, const char *end) {
+		while (cur != end && HasClass(*cur, Classes) == Match)
+			cur++;
+		return cur;
+	}
+
+	static const Scanner s_scalarScanner{
+	    ScannerKind::Scalar,
+	    "scalar",
+	    SkipScalar<Char_Space, true>,
+	    SkipScalar<Char_Newline, false>,
+	    SkipScalar<Char_Alpha | Char_Digit, true>,
+	    SkipScalar<Char_Digit, true>,
+	};
+}
+
+#if KALEIDOSCOPE_X86
+
+// #### SSE2 scanner
+namespace Lexer {
+
+	// Sets lanes where lo <= c <= lo + span, using unsigned wrap-around of c - lo
+	TARGET_SSE2 static inline __m128i InRange16(__m128i chars, char lo, char span) {
+		__m128i shifted = _mm_sub_epi8(chars, _mm_set1_epi8(lo));
+		return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(span)), shifted);
+	}
+
+	TARGET_SSE2 static inline __m128i Whitespace16(__m128i chars) {
+		return _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), InRange16(chars, '\t', '\r' - '\t'));
+	}
+
+	TARGET_SSE2 static inline __m128i Newline16(__m128i chars) {
+		return _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')));
+	}
+
+	TARGET_SSE2 static inline __m128i Digit16(__m128i chars) {
+		return InRange16(chars, '0', 9);
+	}
+
+	TARGET_SSE2 static inline __m128i Alnum16(__m128i chars) {
+		// Setting bit 5 maps upper case letters to lower case, without creating new letters
+		__m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+		return _mm_or_si128(InRange16(lower, 'a', 'z' - 'a'), Digit16(chars));
+	}
+
+	// Most runs between tokens are one or two chars long, which are cheaper to test one by one
+	template <uint8_t Classes, bool Match>
+	static inline bool SkipShortRun(const char *&cur, const char *end) {
+		for (int i = 0; i < 4; i++) {
+			if (cur == end || HasClass(*cur, Classes) != Match)
+				return true;
+			cur++;
+		}
+		return false;
+	}
+
+	// Skips chars while they match Predicate, 16 at a time
+	template <__m128i (*Predicate)(__m128i), bool Match, uint8_t Classes>
+	TARGET_SSE2 static const char *SkipSSE2(const char *cur, const char *end) {
+		if (SkipShortRun<Classes, Match>(cur, end))
+			return cur;
+
+		while (end - cur >= 16) {
+			__m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cur));
+			uint32_t matches = uint32_t(_mm_movemask_epi8(Predicate(chars)));
+			uint32_t stops = Match ? (~matches & 0xFFFF) : matches;
+			if (stops)
+				return cur + llvm::countTrailingZeros(stops);
+			cur += 16;
+		}
+		return SkipScalar<Classes, Match>(cur, end);
+	}
+
+	static const Scanner s_sse2Scanner{
+	    ScannerKind::SSE2,
+	    "sse2",
+	    SkipSSE2<Whitespace16, true, Char_Space>,
+	    SkipSSE2<Newline16, false, Char_Newline>,
+	    SkipSSE2<Alnum16, true, Char_Alpha | Char_Digit>,
+	    SkipSSE2<Digit16, true, Char_Digit>,
+	};
+}
+
+// #### AVX2 scanner
+namespace Lexer {
+
+	TARGET_AVX2 static inline __m256i InRange32(__m256i chars, char lo, char span) {
+		__m256i shifted = _mm256_sub_epi8(chars, _mm256_set1_epi8(lo));
+		return _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(span)), shifted);
+	}
+
+	TARGET_AVX2 static inline __m256i Whitespace32(__m256i chars) {
+		return _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')), InRange32(chars, '\t', '\r' - '\t'));
+	}
+
+	TARGET_AVX2 static inline __m256i Newline32(__m256i chars) {
+		return _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')));
+	}
+
+	TARGET_AVX2 static inline __m256i Digit32(__m256i chars) {
+		return InRange32(chars, '0', 9);
+	}
+
+	TARGET_AVX2 static inline __m256i Alnum32(__m256i chars) {
+		__m256i lower = _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+		return _mm256_or_si256(InRange32(lower, 'a', 'z' - 'a'), Digit32(chars));
+	}
+
+	// Skips chars while they match Predicate, 32 at a time. The remainder goes through SSE2
+	template <__m256i (*Predicate)(__m256i), bool Match, __m128i (*Predicate16)(__m128i), uint8_t Classes>
+	TARGET_AVX2 static const char *SkipAVX2(const char *cur, const char *end) {
+		if (SkipShortRun<Classes, Match>(cur, end))
+			return cur;
+
+		while (end - cur >= 32) {
+			__m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cur));
+			uint32_t matches = uint32_t(_mm256_movemask_epi8(Predicate(chars)));
+			uint32_t stops = Match ? ~matches : matches;
+			if (stops)
+				return cur + llvm::countTrailingZeros(stops);
+			cur += 32;
+		}
+		return SkipSSE2<Predicate16, Match, Classes>(cur, end);
+	}
+
+	static const Scanner s_avx2Scanner{
+	    ScannerKind::AVX2,
+	    "avx2",
+	    SkipAVX2<Whitespace32, true, Whitespace16, Char_Space>,
+	    SkipAVX2<Newline32, false, Newline16, Char_Newline>,
+	    SkipAVX2<Alnum32, true, Alnum16, Char_Alpha | Char_Digit>,
+	    SkipAVX2<Digit32, true, Digit16, Char_Digit>,
+	};
+}
+
+#endif
+
+// #### Runtime dispatch
+namespace Lexer {
+
+	struct HostFeatures {
+		bool SSE2 = false;
+		bool AVX2 = false;
+
+		HostFeatures() {
+			llvm::StringMap<bool> features;
+			if (!llvm::sys::getHostCPUFeatures(features))
+				return;
+
+			SSE2 = features.lookup("sse2");
+			AVX2 = features.lookup("avx2");
+		}
+	};
+
+	static const HostFeatures &GetHostFeatures() {
+		static HostFeatures features;
+		return features;
+	}
+
+	const Scanner *GetScanner(ScannerKind kind) {
+		switch (kind) {
+			case ScannerKind::Scalar:
+				return &s_scalarScanner;
+#if KALEIDOSCOPE_X86
+			case ScannerKind::SSE2:
+				return GetHostFeatures().SSE2 ? &s_sse2Scanner : nullptr;
+			case ScannerKind::AVX2:
+				// The AVX2 scanner handles its remainder with SSE2
+				return GetHostFeatures().AVX2 && GetHostFeatures().SSE2 ? &s_avx2Scanner : nullptr;
+#endif
+			default:
+				return nullptr;
+		}
+	}
+
+	const Scanner &GetHostScanner() {
+		static const Scanner *scanner = [] {
+			for (ScannerKind kind : {ScannerKind::AVX2, ScannerKind::SSE2}) {
+				if (const Scanner *candidate = GetScanner(kind))
+					return candidate;
+			}
+			return &s_scalarScanner;
+		}();
+		return *scanner;
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Lexer {
+
+	// ##### Character classes
+	enum CharClass : uint8_t {
+		Char_Space = 1 << 0,
+		Char_Alpha = 1 << 1,
+		Char_Digit = 1 << 2,
+		Char_Newline = 1 << 3, // '\n' and '\r', which end comments
+	};
+
+	// Locale-independent replacement for isspace/isalpha/isdigit, matching the "C" locale
+	struct CharClassTable {
+		uint8_t Classes[256];
+
+		constexpr CharClassTable() : Classes() {
+			for (int c = 0; c < 256; c++) {
+				uint8_t classes = 0;
+				if (c == ' ' || (c >= '\t' && c <= '\r'))
+					classes |= Char_Space;
+				if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+					classes |= Char_Alpha;
+				if (c >= '0' && c <= '9')
+					classes |= Char_Digit;
+				if (c == '\n' || c == '\r')
+					classes |= Char_Newline;
+				Classes[c] = classes;
+			}
+		}
+	};
+	extern const CharClassTable g_charClasses;
+
+	inline bool HasClass(char c, uint8_t classes) { return (g_charClasses.Classes[(unsigned char)c] & classes) != 0; }
+	inline bool IsSpace(char c) { return HasClass(c, Char_Space); }
+	inline bool IsAlpha(char c) { return HasClass(c, Char_Alpha); }
+	inline bool IsDigit(char c) { return HasClass(c, Char_Digit); }
+	inline bool IsAlnum(char c) { return HasClass(c, Char_Alpha | Char_Digit); }
+
+
+	// ##### Scanner
+	enum class ScannerKind {
+		Scalar,
+		SSE2,
+		AVX2,
+	};
+
+	// Bulk scanning routines. Each one returns the first char in [cur, end) that doesn't
+	// belong to the run it skips, or end. Vector versions test 16/32 chars at a time and
+	// only fall back to checking single chars on the last few bytes of the buffer.
+	struct Scanner {
+		ScannerKind Kind;
+		const char *Name;
+
+		const char *(*SkipWhitespace)(const char *cur, const char *end);
+		const char *(*SkipToNewline)(const char *cur, const char *end);
+		const char *(*SkipAlnum)(const char *cur, const char *end);
+		const char *(*SkipDigits)(const char *cur, const char *end);
+	};
+
+	// Widest scanner supported by the host CPU, detected once at runtime
+	const Scanner &GetHostScanner();
+
+	// Returns nullptr if the host CPU doesn't support the requested scanner
+	const Scanner *GetScanner(ScannerKind kind);
+}
@@ -0,0 +1,613 @@
+#include "Session.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/STLExtras.h>
+
+// Lexer, parser and code generation work on the states bound to the calling thread.
+// Binds the states of a session for the duration of a call and restores the previous
+// ones after, so a thread can also drive several sessions in turn.
+class CompilerSession::Binding {
+public:
+	Binding(CompilerSession &session)
+	    : m_lexer(Lexer::SetState(&session.m_lexer)),
+	      m_parser(Parser::SetState(&session.m_parser)),
+	      m_ir(IR::SetContext(&session.m_ir)) {}
+
+	~Binding() {
+		Lexer::SetState(m_lexer);
+		Parser::SetState(m_parser);
+		IR::SetContext(m_ir);
+	}
+
+private:
+	Lexer::State *m_lexer;
+	Parser::State *m_parser;
+	IR::Context *m_ir;
+};
+
+void CompilerSession::Load(llvm::StringRef source) {
+	Binding binding(*this);
+	Lexer::Init(source);
+}
+
+bool CompilerSession::LoadFile(const std::string &path) {
+	Binding binding(*this);
+	return Lexer::InitFromFile(path);
+}
+
+llvm::ThreadPool *CompilerSession::GetThreadPool() {
+	if (m_threadCount == 1)
+		return nullptr;
+
+	if (!m_threadPool)
+		m_threadPool = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(m_threadCount));
+	return m_threadPool.get();
+}
+
+// Functions called from the nodes [begin, end) of a pool, without duplicates
+static std::vector<Symbols::Symbol> CollectCallees(const Parser::ASTContext &nodes, uint32_t begin, uint32_t end) {
+	std::vector<Symbols::Symbol> callees;
+	for (uint32_t i = begin; i < end; i++) {
+		if (nodes.GetKind(Parser::NodeId(i)) == Parser::NodeKind::CallExpr)
+			callees.push_back(nodes.Get<Parser::CallExpr>(Parser::NodeId(i)).Callee);
+	}
+
+	llvm::sort(callees);
+	callees.erase(std::unique(callees.begin(), callees.end()), callees.end());
+	return callees;
+}
+
+static const size_t s_noMatch = ~size_t(0);
+
+// Items are linked in the JIT in units of up to this many items. Every module has a fixed cost
+// to compile and link, which would make large programs much slower to build from scratch with
+// a module per item. Replacing an item links the rest of its unit again.
+static const size_t s_maxUnitItems = 32;
+
+bool CompilerSession::Run() {
+	return Run(m_optLevel);
+}
+
+bool CompilerSession::Run(IR::OptLevel level) {
+	return Run(level, nullptr);
+}
+
+bool CompilerSession::Emit(const std::string &path, IR::OutputKind kind) {
+	Output output{path, kind};
+	return Run(m_optLevel, &output);
+}
+
+bool CompilerSession::Run(IR::OptLevel level, const Output *output) {
+	using ItemKind = CompiledItem::ItemKind;
+	Binding binding(*this);
+
+	// Files are compiled ahead of time as a whole, at the level of the session
+	bool tiered = m_tieredCompilation && !output;
+	bool lazy = (m_lazyCompilation || m_tieredCompilation) && !output;
+
+	// Tier 0 is always compiled at -O0, and tier 1 at -O3
+	if (tiered)
+		level = IR::OptLevel::O0;
+
+	// Code of another level or target can't be reused, so none of the items match. Neither can
+	// code in the JIT be emitted to a file
+	bool levelChanged = level != m_ir.OptimizationLevel || m_fpMode != m_ir.FPMode || m_multiversioning != m_ir.Multiversioning ||
+	                    lazy != m_ir.LazyCompilation || tiered != m_ir.TieredCompilation || output;
+	m_ir.OptimizationLevel = level;
+	m_ir.FPMode = m_fpMode;
+	m_ir.Multiversioning = m_multiversioning;
+	m_ir.LazyCompilation = lazy;
+	m_ir.TieredCompilation = tiered;
+	m_ir.Emitting = output != nullptr;
+	if (!m_ir.Init())
+		return false;
+
+	const Lexer::TokenBuffer &tokens = Lexer::GetTokens();
+	std::vector<Parser::TokenRange> ranges = Parser::SplitTopLevelItems(tokens);
+
+	// Matches items with the ones of the last run by fingerprint. Whatever is left unmatched
+	// was edited or removed, and is unloaded below
+	std::unordered_multimap<uint64_t, size_t> previous;
+	for (size_t i = 0; i < m_items.size(); i++)
+		previous.emplace(m_items[i].Fingerprint, i);
+
+	std::vector<CompiledItem> items(ranges.size());
+	std::vector<size_t> matches(ranges.size(), s_noMatch);
+	for (size_t i = 0; i < ranges.size(); i++) {
+		items[i].Fingerprint = tokens.Fingerprint(ranges[i].Begin, ranges[i].End);
+		auto found = levelChanged ? previous.end() : previous.find(items[i].Fingerprint);
+		if (found != previous.end()) {
+			matches[i] = found->second;
+			previous.erase(found);
+		}
+	}
+
+	std::vector<size_t> stale;
+	for (const auto &entry : previous)
+		stale.push_back(entry.second);
+
+	auto GetItem = [&](size_t i) -> const CompiledItem & {
+		return matches[i] != s_noMatch ? m_items[matches[i]] : items[i];
+	};
+
+	if (m_verbose)
+		fprintf(stderr, ">> INFO: Generating AST:\n");
+
+	// Unchanged items that call a function whose signature changed can't keep their code, so
+	// they're parsed again too, as are the ones that evaluated an edited function at compile
+	// time. Their own signatures stay the same, and evaluated functions are recorded with the
+	// ones they evaluated in turn, so one more pass is enough
+	Parser::TranslationUnitASTPtr unit;
+	std::vector<Parser::NodeId> decls(ranges.size());
+	IR::SignatureMap signatures;
+	for (bool reparse = true; reparse;) {
+		std::vector<size_t> parsedItems;
+		std::vector<Parser::TokenRange> parsedRanges;
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (matches[i] == s_noMatch) {
+				parsedItems.push_back(i);
+				parsedRanges.push_back(ranges[i]);
+			}
+		}
+
+		unit = Parser::GenerateAST(parsedRanges, GetThreadPool());
+		if (!unit)
+			return false;
+
+		// Declarations come in source order, externs as prototypes and everything else as functions
+		const Parser::ASTContext &nodes = unit->GetContext();
+		const std::vector<Parser::NodeId> &prototypes = unit->GetPrototypes();
+		const std::vector<Parser::NodeId> &functions = unit->GetFunctions();
+		if (prototypes.size() + functions.size() != parsedItems.size()) {
+			fprintf(stderr, ">> ERROR: Top-level items don't match their declarations\n");
+			return false;
+		}
+
+		size_t nextPrototype = 0, nextFunction = 0;
+		for (size_t i : parsedItems) {
+			CompiledItem &item = items[i];
+			int firstToken = tokens.Kinds[ranges[i].Begin];
+			Parser::PrototypeDecl prototype;
+			if (firstToken == Lexer::Token_Extern && nextPrototype < prototypes.size()) {
+				item.Kind = ItemKind::Extern;
+				decls[i] = prototypes[nextPrototype++];
+				prototype = nodes.Get<Parser::PrototypeDecl>(decls[i]);
+			} else if (firstToken != Lexer::Token_Extern && nextFunction < functions.size()) {
+				item.Kind = firstToken == Lexer::Token_Definition ? ItemKind::Function : ItemKind::TopLevel;
+				decls[i] = functions[nextFunction++];
+				prototype = nodes.Get<Parser::PrototypeDecl>(nodes.Get<Parser::FunctionDecl>(decls[i]).Prototype);
+			} else {
+				fprintf(stderr, ">> ERROR: Top-level items don't match their declarations\n");
+				return false;
+			}
+
+			item.Name = prototype.Name;
+			item.Signature = {unsigned(prototype.Params.size()), prototype.ArrayParams, item.Kind == ItemKind::Extern};
+		}
+
+		// Nodes of a declaration sit between the previous declaration and itself in the pool
+		std::vector<uint32_t> declEnds;
+		for (size_t i : parsedItems)
+			declEnds.push_back(decls[i].GetIndex());
+		llvm::sort(declEnds);
+		for (size_t i : parsedItems) {
+			uint32_t end = decls[i].GetIndex();
+			auto previousDecl = std::lower_bound(declEnds.begin(), declEnds.end(), end);
+			uint32_t begin = previousDecl == declEnds.begin() ? 0 : *(previousDecl - 1) + 1;
+			items[i].Callees = CollectCallees(nodes, begin, end);
+		}
+
+		// Definitions take precedence over externs, and the first of several definitions wins
+		signatures.clear();
+		for (ItemKind kind : {ItemKind::Function, ItemKind::Extern}) {
+			for (size_t i = 0; i < ranges.size(); i++) {
+				if (GetItem(i).Kind == kind)
+					signatures.try_emplace(GetItem(i).Name, GetItem(i).Signature);
+			}
+		}
+
+		const IR::SignatureMap noSignatures;
+		const IR::SignatureMap &previousSignatures = m_ir.Signatures ? *m_ir.Signatures : noSignatures;
+		auto SignatureChanged = [&](Symbols::Symbol name) {
+			auto before = previousSignatures.find(name);
+			auto after = signatures.find(name);
+			if (before == previousSignatures.end() || after == signatures.end())
+				return before != previousSignatures.end() || after != signatures.end();
+			return before->second != after->second;
+		};
+
+		llvm::DenseSet<Symbols::Symbol> edited;
+		for (size_t index : stale) {
+			if (m_items[index].Kind == ItemKind::Function)
+				edited.insert(m_items[index].Name);
+		}
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (matches[i] == s_noMatch && items[i].Kind == ItemKind::Function)
+				edited.insert(items[i].Name);
+		}
+		auto Edited = [&](Symbols::Symbol name) { return edited.count(name) != 0; };
+
+		reparse = false;
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (matches[i] == s_noMatch)
+				continue;
+
+			const CompiledItem &item = m_items[matches[i]];
+			if (llvm::any_of(item.Callees, SignatureChanged) || llvm::any_of(item.FoldedCallees, Edited)) {
+				stale.push_back(matches[i]);
+				matches[i] = s_noMatch;
+				reparse = true;
+			}
+		}
+	}
+
+	if (m_verbose) {
+		unit->Dump();
+
+		Parser::ASTContext::Stats stats = unit->GetContext().GetStats();
+		fprintf(stderr, ">> INFO: AST pool: %zu nodes, %zu list entries, %zu bytes used, %zu bytes reserved in %zu allocations\n",
+		        stats.Nodes, stats.ListEntries, stats.BytesUsed, stats.BytesReserved, stats.Allocations);
+	}
+
+	// Later definitions of a function are errors, even if they were compiled before
+	// Written by workers, so it can't be a vector<bool>
+	std::vector<char> valid(ranges.size(), true);
+	llvm::DenseMap<Symbols::Symbol, size_t> definitions;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		const CompiledItem &item = GetItem(i);
+		if (item.Kind == ItemKind::Function && !definitions.try_emplace(item.Name, i).second) {
+			fprintf(stderr, ">> ERROR: Redefinition of function '%s'\n", Symbols::GetName(item.Name).data());
+			valid[i] = false;
+			if (matches[i] != s_noMatch) {
+				stale.push_back(matches[i]);
+				matches[i] = s_noMatch;
+			}
+		}
+	}
+
+	// Definitions parsed in this run can be evaluated at compile time. Top-level statements that
+	// only compute values from them are evaluated right away, and don't need any code
+	Folding::FunctionTable functions;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (matches[i] == s_noMatch && valid[i] && items[i].Kind == ItemKind::Function)
+			functions.try_emplace(items[i].Name, decls[i]);
+	}
+
+	size_t foldedCount = 0;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (matches[i] != s_noMatch || !valid[i] || items[i].Kind != ItemKind::TopLevel)
+			continue;
+
+		Folding::Evaluator evaluator(unit->GetContext(), functions);
+		items[i].FoldedValue = evaluator.Run(decls[i]);
+		if (items[i].FoldedValue) {
+			items[i].FoldedCallees.assign(evaluator.GetCalledFunctions().begin(), evaluator.GetCalledFunctions().end());
+			foldedCount++;
+		}
+	}
+
+	// Calls are resolved to addresses when code is linked, so callers of every function whose
+	// code moves must be linked again, and their callers in turn. So does the rest of each
+	// link unit that is unloaded
+	llvm::DenseMap<Symbols::Symbol, std::vector<size_t>> callers;
+	llvm::DenseMap<llvm::orc::ResourceTracker *, std::vector<size_t>> unitMembers;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (matches[i] != s_noMatch) {
+			const CompiledItem &item = m_items[matches[i]];
+			for (Symbols::Symbol callee : item.Callees)
+				callers[callee].push_back(i);
+			if (item.Tracker)
+				unitMembers[item.Tracker.get()].push_back(i);
+		}
+	}
+
+	std::vector<bool> relink(ranges.size(), false);
+	std::vector<Symbols::Symbol> moved;
+	llvm::DenseSet<llvm::orc::ResourceTracker *> unloaded;
+	auto Unload = [&](const llvm::orc::ResourceTrackerSP &tracker) {
+		if (!tracker || !unloaded.insert(tracker.get()).second)
+			return;
+
+		for (size_t i : unitMembers.lookup(tracker.get())) {
+			relink[i] = true;
+			if (m_items[matches[i]].Kind == ItemKind::Function)
+				moved.push_back(m_items[matches[i]].Name);
+		}
+	};
+
+	for (size_t index : stale) {
+		if (m_items[index].Kind == ItemKind::Function)
+			moved.push_back(m_items[index].Name);
+		Unload(m_items[index].Tracker);
+	}
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (matches[i] == s_noMatch && valid[i] && items[i].Kind == ItemKind::Function)
+			moved.push_back(items[i].Name);
+	}
+
+	// Functions internalized in units that are kept can't be called from the code being linked,
+	// so those units are linked again too, with the functions exported
+	auto Rebuilt = [&](size_t i) {
+		return valid[i] && (matches[i] == s_noMatch || relink[i]);
+	};
+
+	for (bool unloadedInternal = true; unloadedInternal;) {
+		while (!moved.empty()) {
+			Symbols::Symbol name = moved.back();
+			moved.pop_back();
+			for (size_t i : callers.lookup(name)) {
+				if (!relink[i])
+					Unload(m_items[matches[i]].Tracker);
+			}
+		}
+
+		unloadedInternal = false;
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (!Rebuilt(i) || GetItem(i).FoldedValue)
+				continue;
+
+			for (Symbols::Symbol callee : GetItem(i).Callees) {
+				auto definition = definitions.find(callee);
+				if (definition == definitions.end())
+					continue;
+
+				size_t definer = definition->second;
+				if (valid[definer] && !Rebuilt(definer) && !m_items[matches[definer]].Exported) {
+					Unload(m_items[matches[definer]].Tracker);
+					unloadedInternal = true;
+				}
+			}
+		}
+	}
+
+	// Old code is unloaded before anything replaces it, so symbols are never defined twice
+	for (llvm::orc::ResourceTracker *tracker : unloaded)
+		IR::RemoveModule(*tracker);
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (matches[i] != s_noMatch)
+			items[i] = std::move(m_items[matches[i]]);
+	}
+	m_ir.Signatures = std::make_shared<const IR::SignatureMap>(std::move(signatures));
+
+	size_t compiledCount = 0, relinkedCount = 0;
+	std::vector<size_t> unitItems;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (matches[i] == s_noMatch) {
+			compiledCount += !items[i].FoldedValue;
+			// Named here, so names don't depend on the order workers finish in
+			if (valid[i] && items[i].Kind == ItemKind::TopLevel)
+				items[i].Name = Symbols::Intern(ANON_EXPR_NAME "." + std::to_string(m_topLevelCount++));
+		} else if (relink[i]) {
+			relinkedCount++;
+		} else {
+			continue;
+		}
+
+		// Externs only add a signature, calls declare them in each module
+		if (valid[i] && items[i].Kind != ItemKind::Extern && !items[i].FoldedValue)
+			unitItems.push_back(i);
+	}
+
+	// Units are built in parallel, each on a worker with an LLVM context of its own, and handed
+	// to the JIT in order
+	std::vector<llvm::ArrayRef<size_t>> units;
+	for (size_t begin = 0; begin < unitItems.size(); begin += s_maxUnitItems)
+		units.push_back(llvm::makeArrayRef(unitItems).slice(begin, std::min(s_maxUnitItems, unitItems.size() - begin)));
+
+	// A function is exported when it's called from outside its unit. Nothing is internalized at
+	// -O0 or with lazy compilation, so there every function is. Scripts can't create arrays, so
+	// functions taking them are called from the host and always exported, as are all functions
+	// compiled ahead of time
+	std::vector<size_t> unitOf(ranges.size(), s_noMatch);
+	for (size_t u = 0; u < units.size(); u++) {
+		for (size_t i : units[u]) {
+			unitOf[i] = u;
+			items[i].Exported = level == IR::OptLevel::O0 || m_ir.LazyCompilation || items[i].Signature.ArrayParams != 0 || output;
+		}
+	}
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (!valid[i] || items[i].FoldedValue)
+			continue;
+
+		for (Symbols::Symbol callee : items[i].Callees) {
+			auto definition = definitions.find(callee);
+			if (definition != definitions.end() && unitOf[definition->second] != s_noMatch && unitOf[definition->second] != unitOf[i])
+				items[definition->second].Exported = true;
+		}
+	}
+
+	std::vector<std::vector<llvm::orc::ThreadSafeModule>> unitModules(units.size());
+	std::vector<std::string> listings(m_verbose ? ranges.size() : 0);
+	auto BuildUnitAt = [&](size_t u) {
+		unitModules[u] = BuildUnit(items, units[u], unit->GetContext(), decls, valid, listings);
+	};
+
+	// Workers evaluate calls with constant arguments against the definitions too
+	m_ir.Functions = &functions;
+	llvm::ThreadPool *pool = GetThreadPool();
+	if (pool && units.size() > 1) {
+		std::vector<std::shared_future<void>> tasks;
+		for (size_t u = 0; u < units.size(); u++)
+			tasks.push_back(pool->async([&, u] { BuildUnitAt(u); }));
+		for (auto &task : tasks)
+			task.wait();
+	} else {
+		for (size_t u = 0; u < units.size(); u++)
+			BuildUnitAt(u);
+	}
+
+	m_ir.Functions = nullptr;
+
+	for (const std::string &listing : listings)
+		fputs(listing.c_str(), stderr);
+
+	if (output) {
+		// Nothing of this run is loaded in the JIT, so the next one compiles everything again
+		m_items.clear();
+		if (llvm::is_contained(valid, false))
+			return false;
+
+		std::vector<IR::TopLevelStatement> statements;
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (items[i].Kind == ItemKind::TopLevel)
+				statements.push_back({Symbols::GetName(items[i].Name).str(), items[i].FoldedValue});
+		}
+
+		std::vector<llvm::orc::ThreadSafeModule> modules;
+		for (std::vector<llvm::orc::ThreadSafeModule> &unitModule : unitModules)
+			modules.push_back(std::move(unitModule.front()));
+
+		if (m_verbose)
+			fprintf(stderr, ">> INFO: %zu top-level items: %zu compiled, %zu evaluated\n", ranges.size(), compiledCount, foldedCount);
+		return IR::EmitProgram(std::move(modules), statements, output->Path, output->Kind);
+	}
+
+	for (size_t u = 0; u < units.size(); u++) {
+		// Lazily compiled items are added one by one, so each has a tracker of its own. Top-level
+		// statements are compiled right away instead, so their link errors are reported when
+		// they're looked up, like without lazy compilation
+		if (m_ir.LazyCompilation) {
+			for (size_t k = 0; k < units[u].size(); k++) {
+				size_t i = units[u][k];
+				if (valid[i]) {
+					items[i].Tracker = IR::AddModule(std::move(unitModules[u][k]), items[i].Kind != ItemKind::TopLevel);
+					valid[i] = items[i].Tracker != nullptr;
+				}
+			}
+			continue;
+		}
+
+		llvm::orc::ResourceTrackerSP tracker = IR::AddModule(std::move(unitModules[u].front()), false);
+		for (size_t i : units[u]) {
+			items[i].Tracker = tracker;
+			valid[i] = valid[i] && tracker;
+		}
+	}
+
+	if (m_verbose) {
+		fprintf(stderr, ">> INFO: %zu top-level items: %zu compiled, %zu evaluated, %zu linked again, %zu unchanged, %zu unloaded\n",
+		        ranges.size(), compiledCount, foldedCount, relinkedCount, ranges.size() - compiledCount - foldedCount - relinkedCount, stale.size());
+	}
+
+	bool success = true;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		success = success && valid[i];
+		if (!valid[i] || items[i].Kind != ItemKind::TopLevel)
+			continue;
+
+		if (items[i].FoldedValue)
+			IR::PrintValue(*items[i].FoldedValue);
+		else
+			success = IR::Evaluate(Symbols::GetName(items[i].Name)) && success;
+	}
+
+	// Modules are compiled when they're first looked up or called, so after they ran
+	if (m_verbose && m_ir.ObjectCache) {
+		const ObjectCaching::DiskCache &cache = *m_ir.ObjectCache;
+		fprintf(stderr, ">> INFO: Object cache: %u hits, %u misses, %u evicted\n", cache.GetHits(), cache.GetMisses(), cache.GetEvictions());
+	}
+	if (m_verbose && m_ir.JITLinkMemory) {
+		const JITMemory::SlabMemoryManager &memory = *m_ir.JITLinkMemory;
+		fprintf(stderr, ">> INFO: JIT memory: %zu bytes reserved, %zu committed, %zu freed\n",
+		        memory.GetReservedBytes(), memory.GetCommittedBytes(), memory.GetFreedBytes());
+	}
+
+	// Failed items are compiled again on the next run, whatever changed
+	m_items.clear();
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (valid[i])
+			m_items.push_back(std::move(items[i]));
+	}
+
+	return success;
+}
+
+std::vector<llvm::orc::ThreadSafeModule> CompilerSession::BuildUnit(std::vector<CompiledItem> &items, llvm::ArrayRef<size_t> members,
+                                                                     const Parser::ASTContext &nodes, llvm::ArrayRef<Parser::NodeId> decls,
+                                                                     std::vector<char> &valid, std::vector<std::string> &listings) const {
+	IR::Context ir;
+	ir.InitWorker(m_ir);
+	IR::Context *previous = IR::SetContext(&ir);
+
+	// Every item is generated into a module of its own, so it can be cached on its own, and
+	// then linked into the module of the unit
+	ir.ResetModule();
+	std::unique_ptr<llvm::Module> unitModule = std::move(ir.Module);
+	std::vector<std::unique_ptr<llvm::Module>> itemModules(members.size());
+	for (size_t k = 0; k < members.size(); k++) {
+		size_t i = members[k];
+		CompiledItem &item = items[i];
+		ir.StartModule();
+
+		// Items parsed in this run don't have any code yet
+		if (item.Bitcode.empty()) {
+			llvm::Function *function = IR::GenerateCode(nodes, decls[i]);
+			if (!function) {
+				valid[i] = false;
+				continue;
+			}
+
+			// Each run of top-level statements is an anonymous function of its own
+			if (item.Kind == CompiledItem::ItemKind::TopLevel)
+				function->setName(Symbols::GetName(item.Name));
+
+			if (m_verbose) {
+				llvm::raw_string_ostream listing(listings[i]);
+				ir.Dump(listing);
+			}
+
+			item.FoldedCallees = std::move(ir.FoldedFunctions);
+			IR::WriteModule(item.Bitcode);
+		} else if (!IR::ReadModule(item.Bitcode)) {
+			valid[i] = false;
+			continue;
+		}
+
+		if (ir.LazyCompilation)
+			itemModules[k] = std::move(ir.Module);
+		else
+			valid[i] = IR::LinkModule(*unitModule);
+	}
+
+	std::vector<llvm::orc::ThreadSafeModule> modules;
+	if (ir.LazyCompilation) {
+		unitModule.reset();
+		llvm::orc::ThreadSafeContext context = IR::TakeContext();
+		for (std::unique_ptr<llvm::Module> &module : itemModules)
+			modules.push_back(module ? llvm::orc::ThreadSafeModule(std::move(module), context) : llvm::orc::ThreadSafeModule());
+
+		IR::SetContext(previous);
+		return modules;
+	}
+
+	std::vector<Symbols::Symbol> internalFunctions;
+	for (size_t i : members) {
+		if (items[i].Kind == CompiledItem::ItemKind::Function && !items[i].Exported)
+			internalFunctions.push_back(items[i].Name);
+	}
+
+	ir.Module = std::move(unitModule);
+	IR::OptimizeModule(internalFunctions);
+	modules.push_back(IR::TakeModule());
+	IR::SetContext(previous);
+	return modules;
+}
+
+uint64_t CompilerSession::GetFunctionAddress(llvm::StringRef name) {
+	Binding binding(*this);
+	return IR::Lookup(name);
+}
+
+void CompilerSession::RunParserBenchmark(int iterations) {
+	Binding binding(*this);
+
+	if (llvm::ThreadPool *pool = GetThreadPool()) {
+		Parser::RunBenchmark(*pool, iterations);
+	} else {
+		fprintf(stderr, ">> ERROR: Parser benchmark needs more than one thread\n");
+	}
+}
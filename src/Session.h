@@ -0,0 +1,159 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+#include <llvm/Support/ThreadPool.h>
+
+#include "IR.h"
+#include "Lexer.h"
+#include "Parser.h"
+
+// Owns the whole state of one compilation: token buffer, parser state, LLVM context,
+// module, builder, pass managers and JIT. Sessions share no mutable state besides the
+// symbol table, which is thread-safe, so independent sessions can run in parallel on
+// different threads. A single session must only be used by one thread at a time.
+class CompilerSession {
+public:
+	CompilerSession() = default;
+	CompilerSession(const CompilerSession &) = delete;
+	CompilerSession &operator=(const CompilerSession &) = delete;
+
+	// Lexes a caller-owned source, which must outlive the session
+	void Load(llvm::StringRef source);
+	// Maps a source file read-only and lexes it in place
+	bool LoadFile(const std::string &path);
+
+	// Parses the loaded source, generates IR and JIT-compiles it, evaluating top-level expressions.
+	// Compiled items are kept for the next run: after loading an edited source, only items whose
+	// tokens changed are parsed and compiled again, and their callers linked again.
+	bool Run();
+	// Runs at a given optimization level instead of the one of the session. Changing levels
+	// compiles everything again
+	bool Run(IR::OptLevel level);
+
+	// Compiles the loaded source ahead of time into a file, instead of running it. Functions keep
+	// the signatures they're called with from the host, and top-level statements become an init
+	// function, see IR::EmitProgram. Nothing is left loaded in the JIT, so the next run compiles
+	// everything again
+	bool Emit(const std::string &path, IR::OutputKind kind);
+
+	// Level code is optimized at by Run(). -O2 by default
+	void SetOptLevel(IR::OptLevel level) { m_optLevel = level; }
+	// Floating-point mode of functions that don't name one of their own. Strict by default, and
+	// like the level, changing it compiles everything again
+	void SetFPMode(Parser::FPMode mode) { m_fpMode = mode; }
+	// Compiles functions with loops for SSE2, AVX2 and AVX-512, and picks one when they're called,
+	// so their code runs well on every x86-64 machine. Off by default, which tunes all code for
+	// the host CPU, or the one Emit() compiles for
+	void SetMultiversioning(bool multiversioning) { m_multiversioning = multiversioning; }
+	// Compiles each function to machine code on its first call instead of when it's linked, which
+	// starts large programs that only call a few of their functions much faster. Every item is
+	// linked on its own then, so functions aren't inlined into other items
+	void SetLazyCompilation(bool lazyCompilation) { m_lazyCompilation = lazyCompilation; }
+	// Compiles functions lazily and quickly at first, with counters of their calls and loop
+	// iterations. Hot functions are optimized at -O3 on a background thread, and their callers
+	// switch to the new code on their next call. Ignores the optimization level
+	void SetTieredCompilation(bool tieredCompilation) { m_tieredCompilation = tieredCompilation; }
+	// CPU Emit() optimizes and compiles for, like "skylake". Empty by default, which picks the
+	// baseline of the host architecture so files run on any machine of it, and "native" tunes
+	// them for the host with all of its features
+	void SetTargetCPU(std::string cpu) { m_ir.TargetCPU = std::move(cpu); }
+
+	// Keeps compiled objects in a directory, by a hash of the optimized module and the target,
+	// so later runs and other processes only link them instead of generating code again. Objects
+	// used the longest time ago are deleted once the directory grows over the size, in bytes.
+	// Must be set before the first run
+	void SetObjectCache(std::string directory, uint64_t maxSize) {
+		m_ir.ObjectCacheDirectory = std::move(directory);
+		m_ir.ObjectCacheSize = maxSize;
+	}
+
+	// Links compiled objects with JITLink, into slabs of memory of the given size in bytes reserved
+	// up front, instead of mapping pages for each object. Pages of unloaded functions are reused
+	// by the next ones linked. 0 keeps linking with RuntimeDyld. Must be set before the first run
+	void SetJITLinkSlabSize(size_t slabSize) { m_ir.JITLinkSlabSize = slabSize; }
+
+	// Worker threads used to compile large sources, 0 picks one per hardware thread. Setting
+	// 1 keeps everything on the calling thread
+	void SetThreadCount(unsigned threadCount) { m_threadCount = threadCount; }
+
+	// Address of a function compiled by the last run, or 0 if there's none. Functions taking arrays
+	// are meant to be called from here: each array is passed as a 'double *' followed by its
+	// 'int64_t' length, and scalars as doubles
+	uint64_t GetFunctionAddress(llvm::StringRef name);
+
+	// Prints parsing throughput on the loaded source
+	void RunParserBenchmark(int iterations);
+
+	// Prints the AST and the generated IR while running. Enabled by default
+	void SetVerbose(bool verbose) { m_verbose = verbose; }
+
+	llvm::StringRef GetSource() const { return m_lexer.Source; }
+
+private:
+	class Binding;
+
+	// File Emit() compiles the program into
+	struct Output {
+		std::string Path;
+		IR::OutputKind Kind;
+	};
+
+	// Runs the program, or compiles it into the output when there's one
+	bool Run(IR::OptLevel level, const Output *output);
+
+	// A top-level item of the last run, identified by the fingerprint of its tokens
+	struct CompiledItem {
+		enum class ItemKind { Extern, Function, TopLevel };
+
+		ItemKind Kind = ItemKind::TopLevel;
+		uint64_t Fingerprint = 0;
+		Symbols::Symbol Name = Symbols::InvalidSymbol; // Top-level statements get a name unique to the session
+		IR::Signature Signature;
+		std::vector<Symbols::Symbol> Callees;
+
+		// Optimized module, so the item can be linked again without generating it
+		std::string Bitcode;
+		// Link unit in the JIT, shared with other items. Null for externs
+		llvm::orc::ResourceTrackerSP Tracker;
+		// Functions only called from their own unit are internalized when the unit is optimized.
+		// A call from another unit links the unit again, so they're exported
+		bool Exported = false;
+
+		// Value of top-level statements the compiler could evaluate, which don't get any code
+		llvm::Optional<double> FoldedValue;
+		// Functions run at compile time to evaluate the item or calls in it. Editing them
+		// compiles the item again
+		std::vector<Symbols::Symbol> FoldedCallees;
+	};
+
+	// Links the code of several items into a single module for the JIT and optimizes it as a whole.
+	// Generates and optimizes the code of items parsed in this run, and reads the others back from
+	// their bitcode. With lazy compilation, items keep a module each, in the LLVM context of the
+	// unit, and are optimized by the JIT instead.
+	// Runs on worker threads, so it only writes to the given items.
+	std::vector<llvm::orc::ThreadSafeModule> BuildUnit(std::vector<CompiledItem> &items, llvm::ArrayRef<size_t> members, const Parser::ASTContext &nodes,
+	                                      llvm::ArrayRef<Parser::NodeId> decls, std::vector<char> &valid, std::vector<std::string> &listings) const;
+
+	// Created on first use, so single-threaded sessions don't spawn workers
+	llvm::ThreadPool *GetThreadPool();
+
+	Lexer::State m_lexer;
+	Parser::State m_parser;
+	IR::Context m_ir;
+	bool m_verbose = true;
+	IR::OptLevel m_optLevel = IR::OptLevel::O2;
+	Parser::FPMode m_fpMode = Parser::FPMode::Strict;
+	bool m_multiversioning = false;
+	bool m_lazyCompilation = false;
+	bool m_tieredCompilation = false;
+
+	std::vector<CompiledItem> m_items; // In source order
+	unsigned m_topLevelCount = 0;
+
+	unsigned m_threadCount = 0;
+	std::unique_ptr<llvm::ThreadPool> m_threadPool;
+};
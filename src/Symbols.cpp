@@ -0,0 +1,44 @@
+#include "Symbols.h"
+
+#include <vector>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/RWMutex.h>
+
+namespace Symbols {
+
+	// Names are stored once, inside the map entries. Entries never move, so the
+	// id -> name table can point into them.
+	static llvm::StringMap<Symbol> s_ids;
+	static std::vector<llvm::StringRef> s_names;
+
+	// The table is shared by all compiler sessions. Lookups of known names, by far the
+	// most common case, only take the lock in shared mode.
+	static llvm::sys::SmartRWMutex<true> s_lock;
+
+	Symbol Intern(llvm::StringRef name) {
+		{
+			llvm::sys::SmartScopedReader<true> reader(s_lock);
+			auto it = s_ids.find(name);
+			if (it != s_ids.end())
+				return it->getValue();
+		}
+
+		llvm::sys::SmartScopedWriter<true> writer(s_lock);
+		auto result = s_ids.try_emplace(name, Symbol(s_names.size()));
+		if (result.second)
+			s_names.push_back(result.first->getKey());
+
+		return result.first->getValue();
+	}
+
+	llvm::StringRef GetName(Symbol symbol) {
+		llvm::sys::SmartScopedReader<true> reader(s_lock);
+		return s_names[symbol];
+	}
+
+	size_t GetSymbolCount() {
+		llvm::sys::SmartScopedReader<true> reader(s_lock);
+		return s_names.size();
+	}
+}
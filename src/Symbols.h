@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+#include <llvm/ADT/StringRef.h>
+
+namespace Symbols {
+
+	// Small integer id of an interned name. Equal names always get the same id, so
+	// names can be compared and hashed as integers after lexing. The table is global
+	// and thread-safe, so ids can be shared between compiler sessions.
+	using Symbol = uint32_t;
+	constexpr Symbol InvalidSymbol = ~0u;
+
+	// Returns the id of a name, adding it to the table the first time it's seen
+	Symbol Intern(llvm::StringRef name);
+
+	// Returned names are null-terminated, owned by the table and valid for the lifetime of the program
+	llvm::StringRef GetName(Symbol symbol);
+
+	size_t GetSymbolCount();
+}
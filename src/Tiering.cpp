@@ -0,0 +1,206 @@
+#include "Tiering.h"
+
+#include "AST.h"
+#include "ObjectCache.h"
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+namespace Tiering {
+
+	// Calls and loop iterations a function runs in tier 0 before it's compiled in tier 1
+	static const uint32_t s_tierUpThreshold = 10000;
+
+	TieredCompiler::TieredCompiler(llvm::orc::KaleidoscopeJIT &jit, llvm::unique_function<void(llvm::Module &)> optimize)
+	    : m_jit(jit), m_optimize(std::move(optimize)), m_pool(llvm::hardware_concurrency(1)) {}
+
+	TieredCompiler::~TieredCompiler() {
+		m_stopping = true;
+		m_pool.wait();
+	}
+
+	// Blocks a counter is incremented at the start of: the entry block for calls, after the
+	// allocas of local variables so they're still promoted to registers, and loop headers for iterations
+	static void AddCounter(llvm::Function &f, uint32_t *counter, uint64_t function, uint64_t tierUp, bool countCalls) {
+		llvm::SmallVector<llvm::Instruction *, 8> insertPoints;
+		if (countCalls) {
+			llvm::BasicBlock::iterator first = f.getEntryBlock().getFirstInsertionPt();
+			while (llvm::isa<llvm::AllocaInst>(*first))
+				++first;
+			insertPoints.push_back(&*first);
+		}
+
+		// Edges to a block that dominates their source go back to the header of a loop
+		llvm::DominatorTree dominators(f);
+		llvm::SmallPtrSet<llvm::BasicBlock *, 8> headers;
+		for (llvm::BasicBlock &block : f) {
+			for (llvm::BasicBlock *successor : llvm::successors(&block)) {
+				if (dominators.dominates(successor, &block) && headers.insert(successor).second)
+					insertPoints.push_back(&*successor->getFirstInsertionPt());
+			}
+		}
+
+		llvm::LLVMContext &context = f.getContext();
+		llvm::IRBuilder<> builder(context);
+		llvm::Type *i32 = builder.getInt32Ty();
+		auto *tierUpType = llvm::FunctionType::get(builder.getVoidTy(), {builder.getInt8PtrTy()}, false);
+		llvm::MDNode *unlikely = llvm::MDBuilder(context).createBranchWeights(1, s_tierUpThreshold);
+
+		// Tier 0 code only runs in this process, so it refers to the counter and the compiler by address
+		for (llvm::Instruction *insertPoint : insertPoints) {
+			builder.SetInsertPoint(insertPoint);
+			llvm::Value *counterPointer = builder.CreateIntToPtr(builder.getInt64(uintptr_t(counter)), i32->getPointerTo());
+			llvm::Value *count = builder.CreateAdd(builder.CreateLoad(builder.getInt32Ty(), counterPointer), builder.getInt32(1));
+			builder.CreateStore(count, counterPointer);
+
+			llvm::Value *hot = builder.CreateICmpEQ(count, builder.getInt32(s_tierUpThreshold));
+			builder.SetInsertPoint(llvm::SplitBlockAndInsertIfThen(hot, insertPoint, false, unlikely));
+			llvm::Value *callee = builder.CreateIntToPtr(builder.getInt64(tierUp), tierUpType->getPointerTo());
+			builder.CreateCall(tierUpType, callee, {builder.CreateIntToPtr(builder.getInt64(function), builder.getInt8PtrTy())});
+		}
+	}
+
+	void TieredCompiler::Instrument(llvm::Module &module) {
+		std::string bitcode;
+		llvm::raw_string_ostream stream(bitcode);
+		llvm::WriteBitcodeToFile(module, stream);
+		stream.flush();
+
+		// Top-level statements only run once. The session numbers them, as in __anon_expr.1
+		std::vector<std::shared_ptr<Function>> functions;
+		for (llvm::Function &f : module) {
+			if (f.isDeclaration() || f.hasLocalLinkage() || f.getName() == ANON_EXPR_NAME || f.getName().startswith(ANON_EXPR_NAME "."))
+				continue;
+
+			auto function = std::make_shared<Function>();
+			function->Compiler = this;
+			function->Name = f.getName().str();
+			function->Bitcode = bitcode;
+			functions.push_back(std::move(function));
+		}
+
+		// Modules hold one function, which may call internal ones like its multiversioned variants:
+		// their loops count towards it
+		uint64_t tierUp = llvm::pointerToJITTargetAddress(&TierUp);
+		for (llvm::Function &f : module) {
+			if (f.isDeclaration())
+				continue;
+			auto owner = llvm::find_if(functions, [&f](const std::shared_ptr<Function> &function) { return function->Name == f.getName(); });
+			if (owner != functions.end())
+				AddCounter(f, &(*owner)->Counter, llvm::pointerToJITTargetAddress(owner->get()), tierUp, true);
+			else if (f.hasLocalLinkage() && functions.size() == 1)
+				AddCounter(f, &functions.front()->Counter, llvm::pointerToJITTargetAddress(functions.front().get()), tierUp, false);
+		}
+		if (!functions.empty())
+			ObjectCaching::MarkUncacheable(module);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (std::shared_ptr<Function> &function : functions) {
+			std::string name = function->Name;
+			m_functions[name] = std::move(function);
+		}
+	}
+
+	void TieredCompiler::Track(llvm::orc::ResourceTracker &tracker, const llvm::Module &module) {
+		std::vector<std::string> names;
+		for (const llvm::Function &f : module) {
+			if (!f.isDeclaration() && !f.hasLocalLinkage())
+				names.push_back(f.getName().str());
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_trackedFunctions[&tracker] = std::move(names);
+	}
+
+	void TieredCompiler::Forget(llvm::orc::ResourceTracker &tracker) {
+		std::vector<llvm::orc::ResourceTrackerSP> optimized;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto tracked = m_trackedFunctions.find(&tracker);
+			if (tracked == m_trackedFunctions.end())
+				return;
+
+			for (const std::string &name : tracked->second) {
+				auto found = m_functions.find(name);
+				if (found == m_functions.end())
+					continue;
+				found->second->Removed = true;
+				if (found->second->Optimized)
+					optimized.push_back(std::move(found->second->Optimized));
+				m_functions.erase(found);
+			}
+			m_trackedFunctions.erase(tracked);
+		}
+
+		for (llvm::orc::ResourceTrackerSP &code : optimized) {
+			if (llvm::Error error = code->remove())
+				llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), ">> ERROR: ");
+		}
+	}
+
+	void TieredCompiler::TierUp(Function *function) {
+		if (function->Queued.exchange(true))
+			return;
+
+		TieredCompiler &compiler = *function->Compiler;
+		std::shared_ptr<Function> queued;
+		{
+			std::lock_guard<std::mutex> lock(compiler.m_mutex);
+			auto found = compiler.m_functions.find(function->Name);
+			if (found == compiler.m_functions.end() || found->second.get() != function)
+				return;
+			queued = found->second;
+		}
+		compiler.m_pool.async([&compiler, queued] { compiler.Optimize(queued); });
+	}
+
+	void TieredCompiler::Optimize(std::shared_ptr<Function> function) {
+		if (m_stopping)
+			return;
+
+		auto context = std::make_unique<llvm::LLVMContext>();
+		llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(llvm::MemoryBufferRef(function->Bitcode, function->Name), *context);
+		if (!module) {
+			llvm::logAllUnhandledErrors(module.takeError(), llvm::errs(), ">> ERROR: ");
+			return;
+		}
+
+		// Tier 1 code lives next to the stubs under a name of its own, so it never clashes with
+		// the tier 1 code of an older definition that's still being unloaded
+		std::string name = function->Name + ".tier1." + std::to_string(m_compiledCount++);
+		(*module)->getFunction(function->Name)->setName(name);
+		m_optimize(**module);
+
+		llvm::orc::ResourceTrackerSP tracker = m_jit.getMainJITDylib().createResourceTracker();
+		if (llvm::Error error = m_jit.addOptimizedModule(llvm::orc::ThreadSafeModule(std::move(*module), std::move(context)), tracker)) {
+			llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), ">> ERROR: ");
+			return;
+		}
+
+		// Compiles it on this thread
+		llvm::Expected<llvm::JITEvaluatedSymbol> symbol = m_jit.lookup(name);
+		if (!symbol) {
+			llvm::logAllUnhandledErrors(symbol.takeError(), llvm::errs(), ">> ERROR: ");
+			llvm::consumeError(tracker->remove());
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (function->Removed) {
+			llvm::consumeError(tracker->remove());
+			return;
+		}
+		if (llvm::Error error = m_jit.redirect(function->Name, symbol->getAddress())) {
+			llvm::logAllUnhandledErrors(std::move(error), llvm::errs(), ">> ERROR: ");
+			return;
+		}
+		function->Optimized = std::move(tracker);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/FunctionExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/ThreadPool.h>
+
+#include "KailedoscopeJIT.h"
+
+namespace Tiering {
+
+	// Compiles lazily compiled functions in two tiers. Tier 0 compiles a function quickly on its
+	// first call, with a counter of its calls and loop iterations. Once the counter crosses a
+	// threshold, a background thread optimizes the IR of the function and compiles it again, and
+	// its stub is redirected to the new code. Calls already running stay in tier 0 until they return.
+	class TieredCompiler {
+	public:
+		// Tier 1 optimizes modules with the given function, which only ever runs on the background thread
+		TieredCompiler(llvm::orc::KaleidoscopeJIT &jit, llvm::unique_function<void(llvm::Module &)> optimize);
+		// Waits for the functions being compiled in the background
+		~TieredCompiler();
+
+		// Adds the counters of tier 0 to the functions of a module the JIT is about to compile,
+		// keeping a copy of their IR without them for tier 1. Thread-safe
+		void Instrument(llvm::Module &module);
+		// Functions of a module handed to the JIT, which are unloaded with its tracker
+		void Track(llvm::orc::ResourceTracker &tracker, const llvm::Module &module);
+		// Unloads the tier 1 code of the functions of a tracker, before the tracker itself is
+		// removed. Their compilations still running are dropped once they finish
+		void Forget(llvm::orc::ResourceTracker &tracker);
+
+	private:
+		struct Function {
+			TieredCompiler *Compiler;
+			std::string Name;
+			std::string Bitcode;			 // Before the counters were added
+			uint32_t Counter = 0;			 // Incremented by tier 0 code, without synchronization
+			std::atomic<bool> Queued{false}; // Set by the first call crossing the threshold
+			bool Removed = false;			 // Guarded by the mutex of the compiler
+			llvm::orc::ResourceTrackerSP Optimized;
+		};
+
+		// Called by tier 0 code crossing the threshold
+		static void TierUp(Function *function);
+		void Optimize(std::shared_ptr<Function> function);
+
+		llvm::orc::KaleidoscopeJIT &m_jit;
+		llvm::unique_function<void(llvm::Module &)> m_optimize;
+
+		std::mutex m_mutex;
+		llvm::StringMap<std::shared_ptr<Function>> m_functions;
+		llvm::DenseMap<llvm::orc::ResourceTracker *, std::vector<std::string>> m_trackedFunctions;
+		unsigned m_compiledCount = 0; // Only used by the background thread
+		std::atomic<bool> m_stopping{false};
+
+		// Declared last, so it's joined before everything its tasks use is destroyed
+		llvm::ThreadPool m_pool;
+	};
+}
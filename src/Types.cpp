@@ -0,0 +1,177 @@
+#include "Types.h"
+
+#include <cmath>
+
+namespace Types {
+
+	using namespace Parser;
+
+	Symbols::Symbol GetLengthBuiltin() {
+		static const Symbols::Symbol length = Symbols::Intern("len");
+		return length;
+	}
+
+	ValueType GetLiteralType(double value) {
+		// Beyond 2^53 doubles skip integers, so larger literals may already be rounded
+		const double maxExactInteger = 9007199254740992.0;
+		return std::trunc(value) == value && std::fabs(value) <= maxExactInteger ? ValueType::Integer : ValueType::Double;
+	}
+
+	int64_t GetIntegerBound(double value, bool less) {
+		if (std::isnan(value))
+			return less ? MaxIntegerBound : -MaxIntegerBound;
+		double rounded = less ? std::ceil(value) : std::floor(value);
+		return int64_t(std::fmin(std::fmax(rounded, -double(MaxIntegerBound)), double(MaxIntegerBound)));
+	}
+
+	ValueType GetBinaryType(char op, ValueType, ValueType) {
+		return op == '<' || op == '>' ? ValueType::Bool : ValueType::Double;
+	}
+
+	ValueType Join(ValueType a, ValueType b) {
+		if (a == b || b == ValueType::Unknown)
+			return a;
+		if (a == ValueType::Unknown)
+			return b;
+		// Arrays can't be assigned, code generation reports it
+		if (a == ValueType::Array || b == ValueType::Array)
+			return ValueType::Array;
+		// Booleans are stored as 0 or 1 in integers
+		if (a != ValueType::Double && b != ValueType::Double)
+			return ValueType::Integer;
+		return ValueType::Double;
+	}
+
+	// Assigns types flow-insensitively: a variable has the same type in its whole function,
+	// so loops see the same alloca on every iteration. Types only grow, so visiting the
+	// function until nothing changes takes a few passes at most.
+	class TypeInference : public ASTVisitor<TypeInference, ValueType> {
+	public:
+		TypeInference(const ASTContext &nodes, VariableTypes types = VariableTypes()) : ASTVisitor(nodes), m_types(std::move(types)) {}
+
+		ValueType VisitNumberExpr(NodeId, const NumberExpr &expr) { return GetLiteralType(expr.Value); }
+
+		ValueType VisitVariableExpr(NodeId, const VariableExpr &expr) { return m_types.lookup(expr.Name); }
+
+		ValueType VisitBinaryExpr(NodeId, const BinaryExpr &expr) {
+			ValueType lhs = Visit(expr.Lhs);
+			return GetBinaryType(expr.Op, lhs, Visit(expr.Rhs));
+		}
+
+		// Functions always return doubles, array lengths are integers
+		ValueType VisitCallExpr(NodeId, const CallExpr &expr) {
+			bool isLength = expr.Callee == GetLengthBuiltin() && expr.Args.size() == 1;
+			for (NodeId arg : expr.Args) {
+				if (Visit(arg) != ValueType::Array)
+					isLength = false;
+			}
+			return isLength ? ValueType::Integer : ValueType::Double;
+		}
+
+		ValueType VisitIndexExpr(NodeId, const IndexExpr &expr) {
+			Visit(expr.Index);
+			return ValueType::Double;
+		}
+
+		ValueType VisitCompoundStmt(NodeId, const CompoundStmt &stmt) {
+			for (NodeId child : stmt.Statements)
+				Visit(child);
+			return ValueType::Unknown;
+		}
+
+		ValueType VisitAssignStmt(NodeId, const AssignStmt &stmt) {
+			ValueType type = Visit(stmt.Rhs);
+			for (NodeId lhs : stmt.Lhs) {
+				if (m_context.GetKind(lhs) == NodeKind::IndexExpr)
+					Visit(lhs);
+				else
+					Assign(m_context.Get<VariableExpr>(lhs).Name, type);
+			}
+			return type;
+		}
+
+		ValueType VisitReturnStmt(NodeId, const ReturnStmt &stmt) {
+			Visit(stmt.ReturnExpr);
+			return ValueType::Unknown;
+		}
+
+		ValueType VisitIfStmt(NodeId, const IfStmt &stmt) {
+			Visit(stmt.Condition);
+			Visit(stmt.Body);
+			if (stmt.Else)
+				Visit(stmt.Else);
+			return ValueType::Unknown;
+		}
+
+		// The loop variable takes its start value, and then itself plus the step after every
+		// iteration. That sum is only an integer when the loop is bounded
+		ValueType VisitForStmt(NodeId, const ForStmt &stmt) {
+			Assign(stmt.LoopVarName, Visit(stmt.Value));
+			Visit(stmt.Body);
+			Visit(stmt.Step);
+			Assign(stmt.LoopVarName, IsBoundedLoop(stmt) ? ValueType::Integer : ValueType::Double);
+			Visit(stmt.Condition);
+			return ValueType::Unknown;
+		}
+
+		ValueType VisitFunctionDecl(NodeId, const FunctionDecl &decl) {
+			PrototypeDecl prototype = m_context.Get<PrototypeDecl>(decl.Prototype);
+			for (size_t i = 0; i < prototype.Params.size(); i++)
+				m_types[prototype.Params[i]] = prototype.IsArrayParam(i) ? ValueType::Array : ValueType::Double;
+
+			do {
+				m_changed = false;
+				Visit(decl.Body);
+			} while (m_changed);
+
+			// Variables only ever assigned from themselves
+			for (auto &entry : m_types) {
+				if (entry.second == ValueType::Unknown)
+					entry.second = ValueType::Double;
+			}
+			return ValueType::Unknown;
+		}
+
+		VariableTypes TakeTypes() { return std::move(m_types); }
+
+	private:
+		// Loops stepping by a whole constant, whose exit condition compares the variable with a
+		// bound in the direction of the step. Every integer it's assigned is within the bounds
+		// integers are compared with, so it only ever gets one step past them
+		bool IsBoundedLoop(const ForStmt &stmt) const {
+			if (m_context.GetKind(stmt.Step) != NodeKind::NumberExpr || m_context.GetKind(stmt.Condition) != NodeKind::BinaryExpr)
+				return false;
+			double step = m_context.Get<NumberExpr>(stmt.Step).Value;
+			const BinaryExpr &condition = m_context.Get<BinaryExpr>(stmt.Condition);
+			if (step == 0 || GetLiteralType(step) != ValueType::Integer || (condition.Op != '<' && condition.Op != '>'))
+				return false;
+
+			auto IsLoopVar = [&](NodeId id) {
+				return m_context.GetKind(id) == NodeKind::VariableExpr && m_context.Get<VariableExpr>(id).Name == stmt.LoopVarName;
+			};
+			// Counting up needs 'i < bound' or 'bound > i', and counting down the opposite
+			char towardsBound = step > 0 ? '<' : '>';
+			return IsLoopVar(condition.Op == towardsBound ? condition.Lhs : condition.Rhs);
+		}
+
+		void Assign(Symbols::Symbol name, ValueType type) {
+			ValueType &current = m_types[name];
+			ValueType joined = Join(current, type);
+			m_changed = m_changed || joined != current;
+			current = joined;
+		}
+
+		VariableTypes m_types;
+		bool m_changed = false;
+	};
+
+	VariableTypes InferVariableTypes(const ASTContext &nodes, NodeId functionDecl) {
+		TypeInference inference(nodes);
+		inference.Visit(functionDecl);
+		return inference.TakeTypes();
+	}
+
+	ValueType GetExpressionType(const ASTContext &nodes, NodeId expr, const VariableTypes &variables) {
+		return TypeInference(nodes, variables).Visit(expr);
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <llvm/ADT/DenseMap.h>
+
+#include "AST.h"
+
+namespace Types {
+
+	// Static type of a value. Values are doubles at function boundaries, but locals are
+	// stored as booleans or integers whenever every value assigned to them is one. Integers
+	// only come from literals, array lengths and loop counters bounded by their exit condition,
+	// so loop counters become integer induction variables that can't overflow.
+	enum class ValueType : uint8_t {
+		Unknown,	// Nothing assigned yet
+		Bool,		// i1, result of comparisons
+		Integer,	// i64
+		Double,
+		Array,		// double[] parameter, passed as a pointer and a length
+	};
+
+	using VariableTypes = llvm::DenseMap<Symbols::Symbol, ValueType>;
+
+	// Name of the builtin that returns the length of an array, as in 'len(values)'
+	Symbols::Symbol GetLengthBuiltin();
+
+	// Literals are integers when they're whole and exactly representable as doubles
+	ValueType GetLiteralType(double value);
+
+	// Largest magnitude integers are compared with. Bounds beyond it are clamped, so a loop
+	// counter never gets further than a step past it, and stepping it never overflows
+	constexpr int64_t MaxIntegerBound = int64_t(1) << 62;
+
+	// Integer an integer is compared with in place of a double: i < x is i < ceil(x) and i > x
+	// is i > floor(x), clamped to MaxIntegerBound. Comparisons with NaN are true, so NaN is the
+	// farthest bound. Integers doubles represent exactly compare the same as doubles
+	int64_t GetIntegerBound(double value, bool less);
+
+	// Type of a binary expression. Comparisons are booleans, and arithmetic is on doubles, where
+	// booleans take part as 0 or 1: nothing proves integer arithmetic wouldn't overflow
+	ValueType GetBinaryType(char op, ValueType lhs, ValueType rhs);
+
+	// Smallest type both can be stored as
+	ValueType Join(ValueType a, ValueType b);
+
+	// Infers the types of all variables of a function: parameters are doubles or arrays, and every other
+	// variable gets the join of the values assigned to it. Code generation derives the types of
+	// expressions with the same rules, so stores never lose precision.
+	VariableTypes InferVariableTypes(const Parser::ASTContext &nodes, Parser::NodeId functionDecl);
+
+	// Type of an expression in a function whose variables have the given types
+	ValueType GetExpressionType(const Parser::ASTContext &nodes, Parser::NodeId expr, const VariableTypes &variables);
+}
@@ -1,7 +1,15 @@
 #include "Lexer.h"
-#include "Parser.h"
-#include "IR.h"
+#include "Session.h"
 
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <llvm/ADT/Triple.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/TargetSelect.h>
 
 static std::string s_source = R"(
@@ -63,18 +71,170 @@ testfor(1000.0, 200.0);
 )";
 
 
-int main() {
+static llvm::cl::list<std::string> s_inputFiles(llvm::cl::Positional, llvm::cl::desc("<input files>"));
+static llvm::cl::opt<bool> s_benchLexer("bench-lexer", llvm::cl::desc("Measures lexer throughput on the input instead of compiling it"));
+static llvm::cl::opt<bool> s_benchParser("bench-parser", llvm::cl::desc("Measures serial and parallel parsing throughput on the input instead of compiling it"));
+static llvm::cl::opt<unsigned> s_threads("threads", llvm::cl::desc("Worker threads per compilation, 0 uses all hardware threads"), llvm::cl::init(0));
+static llvm::cl::opt<bool> s_watch("watch", llvm::cl::desc("Runs the input file again whenever it changes, compiling only edited functions"));
+static llvm::cl::opt<unsigned> s_optLevel("O", llvm::cl::desc("Optimization level: -O0, -O1, -O2 or -O3"), llvm::cl::Prefix, llvm::cl::init(2));
+static llvm::cl::opt<Parser::FPMode> s_fpMode("fp-mode", llvm::cl::desc("Floating-point mode of functions that don't name one:"), llvm::cl::init(Parser::FPMode::Strict),
+                                               llvm::cl::values(clEnumValN(Parser::FPMode::Strict, "strict", "IEEE arithmetic (default)"),
+                                                                clEnumValN(Parser::FPMode::Contract, "contract", "Fuses multiplies and adds into FMAs"),
+                                                                clEnumValN(Parser::FPMode::Fast, "fast", "Reassociates and assumes no NaNs, infinities or signed zeros")));
+static llvm::cl::opt<bool> s_multiversion("multiversion", llvm::cl::desc("Compiles functions with loops for SSE2, AVX2 and AVX-512, picking one at runtime, instead of for the host CPU"));
+static llvm::cl::opt<bool> s_lazy("lazy", llvm::cl::desc("Compiles each function on its first call instead of before running the program"));
+static llvm::cl::opt<bool> s_tiered("tiered", llvm::cl::desc("Compiles functions lazily at -O0, and hot ones again at -O3 in the background"));
+static llvm::cl::opt<std::string> s_cacheDir("cache-dir", llvm::cl::desc("Keeps compiled objects in a directory, so later runs only link them"), llvm::cl::value_desc("directory"));
+static llvm::cl::opt<unsigned> s_cacheSize("cache-size", llvm::cl::desc("Size in MB the object cache is kept under"), llvm::cl::init(256));
+static llvm::cl::opt<bool> s_jitLink("jitlink", llvm::cl::desc("Links compiled objects with JITLink, into slabs of memory reserved up front"));
+static llvm::cl::opt<unsigned> s_slabSize("slab-size", llvm::cl::desc("Size in MB of the slabs --jitlink reserves"), llvm::cl::init(64));
+static llvm::cl::opt<IR::OutputKind> s_emit("emit", llvm::cl::desc("Compiles the input ahead of time instead of running it:"),
+                                             llvm::cl::values(clEnumValN(IR::OutputKind::Object, "obj", "Object file"),
+                                                              clEnumValN(IR::OutputKind::Archive, "lib", "Static library"),
+                                                              clEnumValN(IR::OutputKind::SharedLibrary, "shared", "Shared library")));
+static llvm::cl::opt<std::string> s_targetCPU("mcpu", llvm::cl::desc("CPU --emit compiles for, the baseline of the host architecture by default, or 'native' for the host"),
+                                               llvm::cl::value_desc("cpu"));
+static llvm::cl::opt<std::string> s_outputPath("o", llvm::cl::desc("File --emit writes, named after the input by default"), llvm::cl::value_desc("path"));
+static llvm::cl::opt<int> s_benchIterations("bench-iterations", llvm::cl::desc("Number of benchmark iterations"), llvm::cl::init(10));
+
+// Runs the benchmarks on the first input file, or on the sample program repeated up to a few MB
+static int RunBenchmark() {
+	std::string sampleSource;
+	CompilerSession session;
+	session.SetThreadCount(s_threads);
+	if (s_inputFiles.empty()) {
+		while (sampleSource.size() < (8u << 20))
+			sampleSource += s_source;
+		session.Load(sampleSource);
+	} else if (!session.LoadFile(s_inputFiles.front())) {
+		return 1;
+	}
+
+	if (s_benchLexer)
+		Lexer::RunBenchmark(session.GetSource(), s_benchIterations);
+	if (s_benchParser)
+		session.RunParserBenchmark(s_benchIterations);
+	return 0;
+}
+
+// Output file named after the input, or the sample program, with the extension of the host
+static std::string GetOutputPath() {
+	if (!s_outputPath.empty())
+		return s_outputPath;
+
+	llvm::SmallString<128> path(s_inputFiles.empty() ? "sample" : llvm::sys::path::filename(s_inputFiles.front()));
+	bool windows = llvm::Triple(llvm::sys::getProcessTriple()).isOSWindows();
+	switch (s_emit) {
+		case IR::OutputKind::Object: llvm::sys::path::replace_extension(path, windows ? "obj" : "o"); break;
+		case IR::OutputKind::Archive: llvm::sys::path::replace_extension(path, windows ? "lib" : "a"); break;
+		case IR::OutputKind::SharedLibrary: llvm::sys::path::replace_extension(path, windows ? "dll" : "so"); break;
+	}
+	return path.str().str();
+}
+
+// Applies the code generation and JIT options, which every way of running sources shares
+static void ConfigureSession(CompilerSession &session) {
+	session.SetOptLevel(IR::OptLevel(unsigned(s_optLevel)));
+	session.SetFPMode(s_fpMode);
+	session.SetMultiversioning(s_multiversion);
+	session.SetLazyCompilation(s_lazy);
+	session.SetTieredCompilation(s_tiered);
+	session.SetTargetCPU(s_targetCPU);
+	session.SetObjectCache(s_cacheDir, uint64_t(s_cacheSize) << 20);
+	session.SetJITLinkSlabSize(s_jitLink ? size_t(s_slabSize) << 20 : 0);
+}
+
+// Compiles and runs every input file in its own session, each on its own thread
+static int RunParallel() {
+	std::vector<std::thread> threads;
+	std::vector<int> results(s_inputFiles.size(), 0);
+	for (size_t i = 0; i < s_inputFiles.size(); i++) {
+		threads.emplace_back([i, &results] {
+			CompilerSession session;
+			session.SetVerbose(false);
+			session.SetThreadCount(1);
+			ConfigureSession(session);
+			results[i] = session.LoadFile(s_inputFiles[i]) && session.Run() ? 0 : 1;
+		});
+	}
+
+	int result = 0;
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+		if (results[i]) {
+			fprintf(stderr, ">> ERROR: Could not compile '%s'\n", s_inputFiles[i].c_str());
+			result = 1;
+		}
+	}
+	return result;
+}
+
+// Reruns the input file every time it's saved, until the process is interrupted. The session
+// keeps compiled functions between runs, so each run only compiles what was edited
+static int RunWatch() {
+	const std::string &path = s_inputFiles.front();
+	CompilerSession session;
+	session.SetThreadCount(s_threads);
+	ConfigureSession(session);
+
+	llvm::sys::TimePoint<> lastModified;
+	while (true) {
+		llvm::sys::fs::file_status status;
+		if (!llvm::sys::fs::status(path, status) && status.getLastModificationTime() != lastModified) {
+			lastModified = status.getLastModificationTime();
+			if (session.LoadFile(path))
+				session.Run();
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+}
+
+int main(int argc, char **argv) {
+	llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+	if (s_optLevel > 3) {
+		fprintf(stderr, ">> ERROR: Optimization level must be 0, 1, 2 or 3\n");
+		return 1;
+	}
+
+	if (s_benchLexer || s_benchParser)
+		return RunBenchmark();
+
 	// Initializes LLVM target architecture
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
 	llvm::InitializeNativeTargetAsmParser();
 
-	// Compiles source code
-    Lexer::Init(s_source);
-	if (auto unit = Parser::GenerateAST()) {
-		IR::GenerateCode(std::move(unit));
-		IR::JITCompile();
+	if (s_emit.getNumOccurrences() && (s_watch || s_inputFiles.size() > 1)) {
+		fprintf(stderr, ">> ERROR: --emit compiles a single input file, and can't be used with --watch\n");
+		return 1;
 	}
 
+	if (s_watch) {
+		if (s_inputFiles.size() != 1) {
+			fprintf(stderr, ">> ERROR: --watch needs a single input file\n");
+			return 1;
+		}
+		return RunWatch();
+	}
+
+	if (s_inputFiles.size() > 1)
+		return RunParallel();
+
+	// Compiles source code. Input files are mapped and lexed in place, without copies
+	CompilerSession session;
+	session.SetThreadCount(s_threads);
+	ConfigureSession(session);
+	if (s_inputFiles.empty()) {
+		session.Load(s_source);
+	} else if (!session.LoadFile(s_inputFiles.front())) {
+		return 1;
+	}
+
+	if (s_emit.getNumOccurrences())
+		return session.Emit(GetOutputPath(), s_emit) ? 0 : 1;
+
+	session.Run();
+
     return 0;
-}
\ No newline at end of file
+}
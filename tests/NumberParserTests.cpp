@@ -0,0 +1,91 @@
+// Checks ParseNumber gives the same bits as strtod, on literals picked to reach every
+// conversion path, and on random ones
+
+#include "NumberParser.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace Lexer;
+
+namespace {
+
+	const char *const s_literals[] = {
+	    // Exact with a single operation
+	    "0", "1", "0.5", "1e-9", "123456789", "9007199254740992", "1e22", "1e23",
+	    // Subnormals, and the boundaries of the normal and subnormal ranges
+	    "4.9e-324", "5e-324", "2.4703282292062327e-324", "2.4703282292062328e-324", "1e-320",
+	    "2.2250738585072011e-308", "2.2250738585072014e-308", "2.225073858507201136057409796709131975934819546351645648e-308",
+	    "0x1p-1074", "0x1p-1075", "0x1.8p-1074", "0x1.fffffffffffffp-1023", "0x0.0000000000001p-1022",
+	    // 19 and 20 significant digits, around the limit of a 64-bit mantissa
+	    "9007199254740993", "1234567890123456789", "9999999999999999999", "12345678901234567890",
+	    "18446744073709551615", "18446744073709551616", "18446744073709551617", "99999999999999999999",
+	    "9223372036854775807.5", "7.2057594037927933e16", "1.0000000000000001110223024625156540423631668090820312500001",
+	    "123456789012345678901234567890", "3.14159265358979323846264338327950288419716939937510",
+	    // Largest doubles, and exponents too large or small for any
+	    "1.7976931348623157e308", "1.7976931348623158e308", "1.7976931348623159e308", "0x1.fffffffffffffp1023",
+	    "2e308", "1e400", "1e-400", "0e999", "1e99999999999999999999", "1e-99999999999999999999",
+	    "1e4294967296", "1e-4294967296", "1e4294967297", "1e18446744073709551617",
+	    "0.000000000000000000000000000000000000001e330", "100000000000000000000000000000e-330",
+	    // Hexadecimal
+	    "0xff", "0XFF", "0x1p4", "0x1.8p4", "0x123456789abcdef123p-1100",
+	};
+
+	// Literals the lexer must reject
+	const char *const s_malformed[] = {"1.", "1e", "1e+", "0x", "0x1p"};
+
+	size_t s_failures = 0;
+
+	void Check(const std::string &literal) {
+		const char *begin = literal.data(), *end = begin + literal.size();
+		NumberLiteral result = ParseNumber(begin, end, GetHostScanner());
+		double expected = strtod(literal.c_str(), nullptr);
+		if (result.Valid && result.End == end && memcmp(&result.Value, &expected, sizeof(double)) == 0)
+			return;
+
+		if (s_failures++ < 20)
+			fprintf(stderr, ">> ERROR: '%s' parsed as %.17g (valid %d, %td chars), strtod gives %.17g\n", literal.c_str(), result.Value,
+			        result.Valid, result.End - begin, expected);
+	}
+}
+
+int main() {
+	for (const char *literal : s_literals)
+		Check(literal);
+
+	for (const char *literal : s_malformed) {
+		if (ParseNumber(literal, literal + strlen(literal), GetHostScanner()).Valid && s_failures++ < 20)
+			fprintf(stderr, ">> ERROR: '%s' should be rejected\n", literal);
+	}
+
+	// Shortest round trips and truncated forms of random doubles, across the whole range
+	std::mt19937_64 rng(42);
+	char buffer[128];
+	for (int i = 0; i < 200000; i++) {
+		uint64_t bits = rng();
+		double value;
+		memcpy(&value, &bits, sizeof(double));
+		value = fabs(value);
+		if (!std::isfinite(value))
+			continue;
+
+		switch (i % 4) {
+			case 0: snprintf(buffer, sizeof(buffer), "%.17g", value); break;
+			case 1: snprintf(buffer, sizeof(buffer), "%.*e", int(rng() % 25), value); break;
+			case 2: snprintf(buffer, sizeof(buffer), "%a", value); break;
+			default: snprintf(buffer, sizeof(buffer), "%llu.%llue%d", (unsigned long long)(rng() % 1000000000000ull),
+			                  (unsigned long long)rng(), int(rng() % 700) - 350); break;
+		}
+		Check(buffer);
+	}
+
+	if (s_failures) {
+		fprintf(stderr, ">> ERROR: %zu mismatches\n", s_failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,90 @@
+// Checks the vector scanners against the scalar one, on every alignment and length of
+// buffers mixing the chars each routine stops at
+
+#include "Scanner.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace Lexer;
+
+namespace {
+
+	struct Routine {
+		const char *Name;
+		const char *(*Scanner::*Skip)(const char *cur, const char *end);
+		const char *Matching; // Chars the routine skips
+	};
+
+	const Routine s_routines[] = {
+	    {"SkipWhitespace", &Scanner::SkipWhitespace, " \t\n\v\f\r"},
+	    {"SkipToNewline", &Scanner::SkipToNewline, "abc 09#\t\x80\xff"},
+	    {"SkipAlnum", &Scanner::SkipAlnum, "azAZ09gG"},
+	    {"SkipDigits", &Scanner::SkipDigits, "0123456789"},
+	};
+
+	size_t s_failures = 0;
+
+	// Runs of chars the routine skips, broken by random chars, so every position of a
+	// vector is the first one that stops it somewhere
+	std::string MakeBuffer(std::mt19937 &rng, const Routine &routine, size_t size) {
+		size_t matchingCount = strlen(routine.Matching);
+		std::string buffer(size, ' ');
+		for (char &c : buffer)
+			c = rng() % 8 ? routine.Matching[rng() % matchingCount] : char(rng() % 256);
+		return buffer;
+	}
+
+	void Check(const Scanner &scanner, const Routine &routine, const std::string &buffer, size_t begin, size_t end) {
+		const Scanner &scalar = *GetScanner(ScannerKind::Scalar);
+		const char *data = buffer.data();
+		const char *expected = (scalar.*routine.Skip)(data + begin, data + end);
+		const char *result = (scanner.*routine.Skip)(data + begin, data + end);
+		if (result == expected)
+			return;
+
+		if (s_failures++ < 20)
+			fprintf(stderr, ">> ERROR: %s %s stopped at %td instead of %td, scanning [%zu, %zu)\n", scanner.Name, routine.Name,
+			        result - data, expected - data, begin, end);
+	}
+}
+
+int main() {
+	std::mt19937 rng(42);
+	for (ScannerKind kind : {ScannerKind::SSE2, ScannerKind::AVX2}) {
+		const Scanner *scanner = GetScanner(kind);
+		if (!scanner) {
+			fprintf(stderr, ">> INFO: skipping scanner %d, which the CPU doesn't support\n", int(kind));
+			continue;
+		}
+
+		for (const Routine &routine : s_routines) {
+			// Chars past the end of the range match too, so reading them would show
+			for (int i = 0; i < 200; i++) {
+				std::string buffer = MakeBuffer(rng, routine, 160);
+				for (size_t begin = 0; begin < 40; begin++) {
+					for (size_t end = begin; end <= 120; end++)
+						Check(*scanner, routine, buffer, begin, end);
+				}
+			}
+
+			// Every byte value, alone after a long run that matches
+			for (int c = 0; c < 256; c++) {
+				for (size_t position = 0; position < 70; position++) {
+					std::string buffer(80, routine.Matching[0]);
+					buffer[position] = char(c);
+					Check(*scanner, routine, buffer, 0, buffer.size());
+				}
+			}
+		}
+	}
+
+	if (s_failures) {
+		fprintf(stderr, ">> ERROR: %zu mismatches\n", s_failures);
+		return 1;
+	}
+	return 0;
+}